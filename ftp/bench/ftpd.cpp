@@ -0,0 +1,799 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include "ftpd.h"
+
+static std::string port = DEFAULT_PORT;
+static std::string root = ".";
+static std::chrono::milliseconds delay(0);
+static bool quiet = false;
+static std::string certificate;         // PEM file with the certificate and its key, enables AUTH TLS
+static SSL_CTX *tls_context = nullptr;
+
+static int epfd = -1;
+static unsigned long long next_id = 1;
+static std::unordered_map<unsigned long long, Client> clients;
+static std::deque<Delayed> delayed;     // in due order, since every reply waits the same time
+
+// an epoll key holds the client and which of its descriptors is ready
+enum Role { CONTROL = 0, LISTENER = 1, DATA = 2 };
+
+
+bool parse_command(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-p" && i + 1 < argc) {
+            port = argv[++i];
+        } else if (arg == "-r" && i + 1 < argc) {
+            root = argv[++i];
+        } else if (arg == "-d" && i + 1 < argc) {
+            delay = std::chrono::milliseconds(std::max(0, std::atoi(argv[++i])));
+        } else if (arg == "-t" && i + 1 < argc) {
+            certificate = argv[++i];
+        } else if (arg == "-q") {
+            quiet = true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Make a descriptor non-blocking.
+ */
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+
+/**
+ * Register or change the events epoll reports for one descriptor of a client.
+ */
+static void watch(int op, int fd, unsigned long long id, Role role, uint32_t events) {
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.u64 = id << 2 | role;
+    epoll_ctl(epfd, op, fd, &event);
+}
+
+
+/**
+ * Set up the TLS context from the PEM file given with -t.
+ * @return true if the certificate and key load, false otherwise.
+ */
+static bool make_tls_context() {
+    tls_context = SSL_CTX_new(TLS_server_method());
+    if (!tls_context || SSL_CTX_use_certificate_chain_file(tls_context, certificate.c_str()) != 1
+        || SSL_CTX_use_PrivateKey_file(tls_context, certificate.c_str(), SSL_FILETYPE_PEM) != 1) {
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(tls_context, TLS1_2_VERSION);
+    // kernel TLS lets RETR keep sendfile; a client that closes without close_notify ends its upload normally
+    SSL_CTX_set_options(tls_context, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // replies and file chunks are retried from wherever the last partial write stopped
+    SSL_CTX_set_mode(tls_context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    static const unsigned char context_id[] = "ftpd";
+    SSL_CTX_set_session_id_context(tls_context, context_id, sizeof(context_id) - 1);
+    return true;
+}
+
+
+/**
+ * Start the server side of a TLS session on a socket; the handshake runs inside the first read or write.
+ */
+static SSL *accept_tls(int sockfd) {
+    SSL *ssl = SSL_new(tls_context);
+    SSL_set_fd(ssl, sockfd);
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+
+/**
+ * Turn the result of a failed SSL call into the result of a failed socket call. A session that has to
+ * wait for its socket gives -1 with EAGAIN, whichever direction it waits for.
+ * @return 0 at the end of the stream, -1 otherwise.
+ */
+static ssize_t tls_result(SSL *ssl, int result) {
+    switch (SSL_get_error(ssl, result)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_SYSCALL:
+            errno = errno != 0 ? errno : ECONNRESET;
+            return -1;
+        default:
+            ERR_clear_error();
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+
+/**
+ * Receive from a socket, through its TLS session if it has one.
+ * @return the number of bytes received, 0 at the end of the stream, or -1 with errno set.
+ */
+static ssize_t channel_recv(SSL *ssl, int sockfd, char *buffer, size_t length) {
+    if (!ssl) {
+        return recv(sockfd, buffer, length, 0);
+    }
+    int received = SSL_read(ssl, buffer, static_cast<int>(length));
+    return received > 0 ? received : tls_result(ssl, received);
+}
+
+
+/**
+ * Send to a socket, through its TLS session if it has one.
+ * @return the number of bytes sent, or -1 with errno set.
+ */
+static ssize_t channel_send(SSL *ssl, int sockfd, const char *buffer, size_t length) {
+    if (!ssl) {
+        return send(sockfd, buffer, length, MSG_NOSIGNAL);
+    }
+    int sent = SSL_write(ssl, buffer, static_cast<int>(length));
+    if (sent > 0) {
+        return sent;
+    }
+    // a peer that ends the session while we write has not taken the data
+    ssize_t result = tls_result(ssl, sent);
+    if (result == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    return result;
+}
+
+
+int open_listenfd(const std::string& port) {
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<uint16_t>(std::atoi(port.c_str())));
+    if (bind(listenfd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 || listen(listenfd, 128) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    set_nonblocking(listenfd);
+    return listenfd;
+}
+
+
+void reply(unsigned long long id, int code, const std::string& text) {
+    // a multi-line reply passes its text starting with '-', which goes right after the code
+    std::string line = std::to_string(code) + (text.starts_with('-') ? "" : " ") + text + "\r\n";
+    auto found = clients.find(id);
+    if (found == clients.end()) {
+        return;
+    }
+    if (delay.count() == 0) {
+        found->second.output += line;
+        flush_replies(id);
+        return;
+    }
+    found->second.delayed++;
+    delayed.push_back({std::chrono::steady_clock::now() + delay, id, line});
+}
+
+
+void flush_replies(unsigned long long id) {
+    Client& client = clients.at(id);
+    size_t total = 0;
+    ssize_t sent;
+    while (total < client.output.length()) {
+        if ((sent = channel_send(client.control_tls, client.control, client.output.data() + total,
+                                 client.output.length() - total)) < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                close_client(id);
+                return;
+            }
+            break;
+        }
+        total += sent;
+    }
+    client.output.erase(0, total);
+    // the reply to AUTH TLS goes out in plain text, and the client's handshake follows it
+    if (client.tls_starting && client.output.empty() && client.delayed == 0) {
+        client.tls_starting = false;
+        client.control_tls = accept_tls(client.control);
+    }
+    if (client.closing && client.output.empty() && client.delayed == 0) {
+        close_client(id);
+        return;
+    }
+    watch(EPOLL_CTL_MOD, client.control, id, CONTROL, EPOLLIN | (client.output.empty() ? 0 : EPOLLOUT));
+}
+
+
+/**
+ * Stop using the data channel and the file of the current transfer.
+ */
+static void close_data(Client& client) {
+    if (client.data_tls) {
+        SSL_free(client.data_tls);
+        client.data_tls = nullptr;
+    }
+    if (client.data >= 0) {
+        close(client.data);
+        client.data = -1;
+    }
+    if (client.listener >= 0) {
+        close(client.listener);
+        client.listener = -1;
+    }
+    if (client.fd >= 0) {
+        close(client.fd);
+        client.fd = -1;
+    }
+    client.op = Op::None;
+    client.listing.clear();
+    client.listing_sent = 0;
+    client.data_events = 0;
+    client.pending.clear();
+    client.pending_sent = 0;
+}
+
+
+void close_client(unsigned long long id) {
+    auto found = clients.find(id);
+    if (found == clients.end()) {
+        return;
+    }
+    close_data(found->second);
+    if (found->second.control_tls) {
+        SSL_free(found->second.control_tls);
+    }
+    close(found->second.control);
+    clients.erase(found);
+}
+
+
+std::string local_path(const Client& client, const std::string& path) {
+    std::filesystem::path remote = path.empty() ? client.cwd : path;
+    if (remote.is_relative()) {
+        remote = std::filesystem::path(client.cwd) / remote;
+    }
+    // normalizing "/.." gives "/", so the result stays inside the root
+    std::string relative = remote.lexically_normal().relative_path().string();
+    return (std::filesystem::path(root) / relative).string();
+}
+
+
+/**
+ * Format a modification time the way MDTM and MLSD give it, `YYYYMMDDHHMMSS` in UTC.
+ */
+static std::string format_time(time_t time) {
+    char text[32];
+    struct tm utc;
+    gmtime_r(&time, &utc);
+    strftime(text, sizeof(text), "%Y%m%d%H%M%S", &utc);
+    return text;
+}
+
+
+/**
+ * Build the listing text of a directory for LIST, NLST, or MLSD.
+ * @return true if the path is a directory, false otherwise.
+ */
+static bool build_listing(const std::string& cmd, const std::string& path, std::string& listing) {
+    std::error_code error;
+    std::vector<std::filesystem::directory_entry> entries;
+    for (const auto& entry : std::filesystem::directory_iterator(path, error)) {
+        entries.push_back(entry);
+    }
+    if (error) {
+        return false;
+    }
+    std::sort(entries.begin(), entries.end());
+    for (const auto& entry : entries) {
+        struct stat st;
+        if (stat(entry.path().c_str(), &st) < 0) {
+            continue;
+        }
+        std::string name = entry.path().filename().string();
+        bool directory = S_ISDIR(st.st_mode);
+        if (cmd == "NLST") {
+            listing += name;
+        } else if (cmd == "MLSD") {
+            listing += std::string("type=") + (directory ? "dir" : "file") + ";size=" + std::to_string(st.st_size)
+                       + ";modify=" + format_time(st.st_mtime) + "; " + name;
+        } else {
+            char month_day[16];
+            struct tm utc;
+            gmtime_r(&st.st_mtime, &utc);
+            strftime(month_day, sizeof(month_day), "%b %d %H:%M", &utc);
+            char line[64];
+            snprintf(line, sizeof(line), "%crw-r--r-- 1 ftp ftp %12lld %s ", directory ? 'd' : '-',
+                     static_cast<long long>(st.st_size), month_day);
+            listing += line + name;
+        }
+        listing += "\r\n";
+    }
+    return true;
+}
+
+
+/**
+ * Open a passive port on the address the control connection arrived at.
+ * @return the port number, or -1 on error.
+ */
+static int open_passive(Client& client, unsigned long long id) {
+    close_data(client);
+    struct sockaddr_in addr = {};
+    socklen_t length = sizeof(addr);
+    getsockname(client.control, reinterpret_cast<struct sockaddr *>(&addr), &length);
+    addr.sin_port = 0;
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0
+        || listen(listener, 1) < 0 || getsockname(listener, reinterpret_cast<struct sockaddr *>(&addr), &length) < 0) {
+        if (listener >= 0) {
+            close(listener);
+        }
+        return -1;
+    }
+    set_nonblocking(listener);
+    client.listener = listener;
+    watch(EPOLL_CTL_ADD, listener, id, LISTENER, EPOLLIN);
+    return ntohs(addr.sin_port);
+}
+
+
+void handle_command(unsigned long long id, const std::string& line) {
+    Client& client = clients.at(id);
+    std::string cmd = line.substr(0, line.find(' '));
+    std::string arg = line.length() > cmd.length() ? line.substr(cmd.length() + 1) : "";
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+    if (!quiet) {
+        std::cout << id << " > " << (cmd == "PASS" ? "PASS ****" : line) << '\n';
+    }
+
+    if (cmd == "USER") {
+        reply(id, CODE_REQPW, "Password required");
+    } else if (cmd == "PASS") {
+        // any password is good, the server only stands in for benchmarks
+        client.logged_in = true;
+        reply(id, CODE_LOGIN, "Logged in");
+    } else if (cmd == "QUIT") {
+        client.closing = true;
+        reply(id, CODE_CLOSE, "Goodbye");
+    } else if (cmd == "FEAT") {
+        reply(id, CODE_FEATS, std::string("-Features:\r\n") + (tls_context ? " AUTH TLS\r\n PBSZ\r\n PROT\r\n" : "")
+                              + " EPSV\r\n MDTM\r\n MLSD type*;size*;modify*;\r\n REST STREAM\r\n SIZE\r\n"
+                              + std::to_string(CODE_FEATS) + " End");
+    } else if (cmd == "AUTH") {
+        if (!tls_context) {
+            reply(id, CODE_NOIMP, "TLS not configured, start with -t");
+        } else if (client.control_tls || (arg != "TLS" && arg != "tls")) {
+            reply(id, CODE_NOPRM, "Only AUTH TLS, once");
+        } else {
+            client.tls_starting = true;
+            reply(id, CODE_AUTHOK, "Starting TLS");
+        }
+    } else if (cmd == "PBSZ") {
+        reply(id, CODE_CMPLT, "PBSZ=0");
+    } else if (cmd == "PROT") {
+        if ((arg == "P" || arg == "p") && client.control_tls) {
+            client.protect = true;
+            reply(id, CODE_CMPLT, "Data channels use TLS");
+        } else if (arg == "C" || arg == "c") {
+            client.protect = false;
+            reply(id, CODE_CMPLT, "Data channels in the clear");
+        } else {
+            reply(id, CODE_NOPRM, "Only C, or P after AUTH TLS");
+        }
+    } else if (!client.logged_in) {
+        reply(id, CODE_NOLOG, "Not logged in");
+    } else if (cmd == "TYPE" || cmd == "STRU" || cmd == "NOOP") {
+        reply(id, CODE_CMPLT, "Okay");
+    } else if (cmd == "MODE") {
+        if (arg == "S" || arg == "s") {
+            reply(id, CODE_CMPLT, "Okay");
+        } else {
+            reply(id, CODE_NOPRM, "Only stream mode");
+        }
+    } else if (cmd == "SYST") {
+        reply(id, CODE_SYSTM, "UNIX Type: L8");
+    } else if (cmd == "PWD") {
+        reply(id, CODE_CRDIR, "\"" + client.cwd + "\"");
+    } else if (cmd == "CWD") {
+        std::error_code error;
+        if (std::filesystem::is_directory(local_path(client, arg), error)) {
+            std::filesystem::path cwd = std::filesystem::path(client.cwd) / arg;
+            client.cwd = "/" + cwd.lexically_normal().relative_path().generic_string();
+            reply(id, CODE_FSUCC, "Okay");
+        } else {
+            reply(id, CODE_NOFILE, "No such directory");
+        }
+    } else if (cmd == "PASV" || cmd == "EPSV") {
+        int passive = open_passive(client, id);
+        if (passive < 0) {
+            reply(id, CODE_NODATA, "Cannot open passive port");
+        } else if (cmd == "EPSV") {
+            reply(id, CODE_EPSVM, "Entering Extended Passive Mode (|||" + std::to_string(passive) + "|)");
+        } else {
+            reply(id, CODE_PSVMD, "Entering Passive Mode (127,0,0,1," + std::to_string(passive >> 8) + ","
+                                  + std::to_string(passive & 255) + ")");
+        }
+    } else if (cmd == "REST") {
+        client.rest = std::atoll(arg.c_str());
+        reply(id, CODE_RSTRT, "Restarting at " + std::to_string(client.rest));
+    } else if (cmd == "SIZE" || cmd == "MDTM") {
+        struct stat st;
+        if (stat(local_path(client, arg).c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+            reply(id, CODE_NOFILE, "No such file");
+        } else {
+            reply(id, CODE_FSTAT, cmd == "SIZE" ? std::to_string(st.st_size) : format_time(st.st_mtime));
+        }
+    } else if (cmd == "MKD") {
+        if (mkdir(local_path(client, arg).c_str(), 0755) == 0) {
+            reply(id, CODE_CRDIR, "\"" + arg + "\" created");
+        } else {
+            reply(id, CODE_NOFILE, std::string("Cannot create directory: ") + strerror(errno));
+        }
+    } else if (cmd == "RMD" || cmd == "DELE") {
+        if ((cmd == "RMD" ? rmdir(local_path(client, arg).c_str()) : unlink(local_path(client, arg).c_str())) == 0) {
+            reply(id, CODE_FSUCC, "Removed");
+        } else {
+            reply(id, CODE_NOFILE, std::string("Cannot remove: ") + strerror(errno));
+        }
+    } else if (cmd == "LIST" || cmd == "NLST" || cmd == "MLSD" || cmd == "RETR" || cmd == "STOR" || cmd == "APPE") {
+        if (client.listener < 0 && client.data < 0) {
+            reply(id, CODE_NODATA, "Use PASV or EPSV first");
+            return;
+        }
+        std::string path = local_path(client, arg);
+        long long rest = client.rest;
+        client.rest = 0;
+        if (cmd == "RETR") {
+            client.fd = open(path.c_str(), O_RDONLY);
+            struct stat st;
+            if (client.fd < 0 || fstat(client.fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+                close_data(client);
+                reply(id, CODE_NOFILE, "No such file");
+                return;
+            }
+            lseek(client.fd, rest, SEEK_SET);
+            client.op = Op::Retr;
+        } else if (cmd == "STOR" || cmd == "APPE") {
+            int flags = O_WRONLY | O_CREAT | (cmd == "APPE" ? O_APPEND : rest > 0 ? 0 : O_TRUNC);
+            client.fd = open(path.c_str(), flags, 0644);
+            if (client.fd < 0 || (rest > 0 && (ftruncate(client.fd, rest) < 0 || lseek(client.fd, rest, SEEK_SET) < 0))) {
+                close_data(client);
+                reply(id, CODE_NOFILE, std::string("Cannot open file: ") + strerror(errno));
+                return;
+            }
+            client.op = Op::Stor;
+        } else {
+            if (!build_listing(cmd, path, client.listing)) {
+                close_data(client);
+                reply(id, CODE_NOFILE, "No such directory");
+                return;
+            }
+            client.op = Op::Listing;
+        }
+        reply(id, CODE_STXFR, "Opening data connection");
+        start_transfer(id);
+    } else {
+        reply(id, CODE_NOIMP, "Command not implemented");
+    }
+}
+
+
+/**
+ * Watch the data channel for the direction of its transfer, or for the one its TLS session waits on.
+ */
+static void watch_data(unsigned long long id, Client& client) {
+    uint32_t events = client.op == Op::Stor ? EPOLLIN : EPOLLOUT;
+    if (client.data_tls && SSL_want_read(client.data_tls)) {
+        events = EPOLLIN;
+    } else if (client.data_tls && SSL_want_write(client.data_tls)) {
+        events = EPOLLOUT;
+    }
+    if (events != client.data_events) {
+        watch(client.data_events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, client.data, id, DATA, events);
+        client.data_events = events;
+    }
+}
+
+
+void start_transfer(unsigned long long id) {
+    auto found = clients.find(id);
+    if (found == clients.end()) {
+        return;
+    }
+    Client& client = found->second;
+    if (client.op == Op::None || client.data < 0) {
+        return;
+    }
+    watch_data(id, client);
+}
+
+
+/**
+ * End the current transfer and go on with the commands that arrived meanwhile.
+ */
+static void finish_transfer(unsigned long long id, bool success) {
+    Client& client = clients.at(id);
+    // close_notify tells the client that a listing or file is complete, not cut off
+    if (success && client.data_tls) {
+        SSL_shutdown(client.data_tls);
+    }
+    close_data(client);
+    if (success) {
+        reply(id, CODE_DSUCC, "Transfer complete");
+    } else {
+        reply(id, CODE_ABORT, "Transfer aborted");
+    }
+    if (clients.contains(id)) {
+        run_commands(id);
+    }
+}
+
+
+/**
+ * Move the next chunk of a RETR over TLS. With kernel TLS the file still goes through sendfile;
+ * otherwise it is read into the pending buffer and written through SSL_write.
+ * @return what sendfile would return.
+ */
+static ssize_t send_file_tls(Client& client) {
+    if (BIO_get_ktls_send(SSL_get_wbio(client.data_tls))) {
+        off_t offset = lseek(client.fd, 0, SEEK_CUR);
+        ssize_t sent = SSL_sendfile(client.data_tls, client.fd, offset, DATA_CHUNK, 0);
+        if (sent > 0) {
+            lseek(client.fd, offset + sent, SEEK_SET);
+        }
+        return sent;
+    }
+    if (client.pending_sent == client.pending.size()) {
+        client.pending.resize(DATA_CHUNK);
+        ssize_t bytes = read(client.fd, client.pending.data(), client.pending.size());
+        client.pending.resize(std::max<ssize_t>(bytes, 0));
+        client.pending_sent = 0;
+        if (bytes <= 0) {
+            return bytes;
+        }
+    }
+    ssize_t sent = channel_send(client.data_tls, client.data, client.pending.data() + client.pending_sent,
+                                client.pending.size() - client.pending_sent);
+    if (sent > 0) {
+        client.pending_sent += sent;
+    }
+    return sent;
+}
+
+
+void continue_transfer(unsigned long long id) {
+    Client& client = clients.at(id);
+    ssize_t bytes;
+    // finish the handshake before any data, so the client's last handshake message is never left unread
+    if (client.data_tls && !SSL_is_init_finished(client.data_tls)) {
+        int result = SSL_do_handshake(client.data_tls);
+        if (result != 1 && (tls_result(client.data_tls, result) == 0 || errno != EAGAIN)) {
+            finish_transfer(id, false);
+            return;
+        }
+        watch_data(id, client);
+        return;
+    }
+    if (client.op == Op::Retr) {
+        bytes = client.data_tls ? send_file_tls(client) : sendfile(client.data, client.fd, nullptr, DATA_CHUNK);
+    } else if (client.op == Op::Listing) {
+        // the event after the last byte is sent ends the listing
+        size_t left = client.listing.length() - client.listing_sent;
+        bytes = left == 0 ? 0 : channel_send(client.data_tls, client.data, client.listing.data() + client.listing_sent, left);
+        if (bytes > 0) {
+            client.listing_sent += bytes;
+        }
+    } else {
+        static std::vector<char> buffer(DATA_CHUNK);
+        // SSL_read gives one record of at most 16 KB, so TLS keeps reading until the socket runs dry
+        size_t filled = 0;
+        while ((bytes = channel_recv(client.data_tls, client.data, buffer.data() + filled, buffer.size() - filled)) > 0) {
+            filled += bytes;
+            if (!client.data_tls || filled == buffer.size()) {
+                break;
+            }
+        }
+        int error = errno;
+        for (size_t total = 0; total < filled; ) {
+            ssize_t written = write(client.fd, buffer.data() + total, filled - total);
+            if (written < 0) {
+                finish_transfer(id, false);
+                return;
+            }
+            total += written;
+        }
+        errno = error;
+    }
+    if (bytes == 0) {
+        finish_transfer(id, true);
+    } else if (bytes < 0 && errno != EAGAIN && errno != EINTR) {
+        finish_transfer(id, false);
+    } else if (client.data_tls) {
+        watch_data(id, client);
+    }
+}
+
+
+void run_commands(unsigned long long id) {
+    size_t end;
+    while (clients.contains(id)) {
+        Client& client = clients.at(id);
+        if (client.op != Op::None || client.closing || (end = client.input.find("\r\n")) == std::string::npos) {
+            return;
+        }
+        std::string line = client.input.substr(0, end);
+        client.input.erase(0, end + 2);
+        handle_command(id, line);
+    }
+}
+
+
+/**
+ * Release the replies whose delay is over.
+ * @return milliseconds until the next one is due, or -1 if none is waiting.
+ */
+static int release_delayed() {
+    auto now = std::chrono::steady_clock::now();
+    while (!delayed.empty() && delayed.front().due <= now) {
+        Delayed item = delayed.front();
+        delayed.pop_front();
+        auto found = clients.find(item.id);
+        if (found != clients.end()) {
+            found->second.delayed--;
+            found->second.output += item.text;
+            flush_replies(item.id);
+        }
+    }
+    if (delayed.empty()) {
+        return -1;
+    }
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(delayed.front().due - now).count();
+    return static_cast<int>(wait) + 1;
+}
+
+
+/**
+ * Handle a ready descriptor of a client.
+ */
+static void handle_event(unsigned long long id, Role role, uint32_t events) {
+    auto found = clients.find(id);
+    if (found == clients.end()) {
+        return;
+    }
+    Client& client = found->second;
+
+    if (role == LISTENER) {
+        int data = accept(client.listener, nullptr, nullptr);
+        if (data < 0) {
+            return;
+        }
+        close(client.listener);
+        client.listener = -1;
+        set_nonblocking(data);
+        client.data = data;
+        if (client.protect) {
+            client.data_tls = accept_tls(data);
+        }
+        start_transfer(id);
+    } else if (role == DATA) {
+        if (client.data >= 0 && client.op != Op::None) {
+            continue_transfer(id);
+        }
+    } else {
+        if (events & EPOLLOUT) {
+            flush_replies(id);
+            if (!clients.contains(id)) {
+                return;
+            }
+        }
+        if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            return;
+        }
+        // a TLS session may hold decrypted bytes that no longer show on the socket, so drain it
+        char buffer[4096];
+        ssize_t received;
+        size_t before = client.input.length();
+        do {
+            if ((received = channel_recv(client.control_tls, client.control, buffer, sizeof(buffer))) > 0) {
+                client.input.append(buffer, received);
+            }
+        } while (received > 0 && client.control_tls && SSL_pending(client.control_tls) > 0);
+        bool ended = received == 0 || (received < 0 && errno != EAGAIN && errno != EINTR);
+        if (client.input.length() > before) {
+            run_commands(id);
+        }
+        if (ended) {
+            close_client(id);
+        }
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    if (!parse_command(argc, argv)) {
+        std::cerr << "Usage: ./ftpd [-p PORT] [-r ROOT] [-d DELAY_MS] [-t PEM] [-q]\n";
+        return 1;
+    }
+    if (!certificate.empty() && !make_tls_context()) {
+        std::cerr << "Failed to load a certificate and key from " << certificate << '\n';
+        return 1;
+    }
+    int listenfd = open_listenfd(port);
+    if (listenfd < 0) {
+        std::cerr << "Failed to listen on port " << port << ": " << strerror(errno) << '\n';
+        return 1;
+    }
+    // a segmented download closes its data channel once it has its range, which must not end the server
+    signal(SIGPIPE, SIG_IGN);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &event);
+    if (!quiet) {
+        std::cout << "Serving " << root << " on 127.0.0.1:" << port << " with " << delay.count() << " ms reply delay"
+                  << (tls_context ? ", AUTH TLS" : "") << '\n';
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = -1;
+    while (true) {
+        int count = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (count < 0 && errno != EINTR) {
+            std::cerr << "Failed to wait for events: " << strerror(errno) << '\n';
+            return 1;
+        }
+        for (int i = 0; i < count; i++) {
+            unsigned long long key = events[i].data.u64;
+            if (key != 0) {
+                handle_event(key >> 2, static_cast<Role>(key & 3), events[i].events);
+                continue;
+            }
+            // new clients; id 0 is the listening socket itself
+            int control;
+            while ((control = accept(listenfd, nullptr, nullptr)) >= 0) {
+                set_nonblocking(control);
+                int nodelay = 1;
+                setsockopt(control, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+                unsigned long long id = next_id++;
+                clients[id].control = control;
+                watch(EPOLL_CTL_ADD, control, id, CONTROL, EPOLLIN);
+                reply(id, CODE_READY, "Stand-in FTP server ready");
+            }
+        }
+        timeout = release_delayed();
+    }
+}
@@ -0,0 +1,146 @@
+#ifndef FTP_BENCH_FTPD_H
+#define FTP_BENCH_FTPD_H
+
+#define DEFAULT_PORT "2150"
+#define DATA_CHUNK (1 << 20)        // bytes moved per event on a data channel
+#define MAX_EVENTS 64
+
+#define CODE_STXFR 150
+#define CODE_CMPLT 200
+#define CODE_FSTAT 213
+#define CODE_FEATS 211
+#define CODE_SYSTM 215
+#define CODE_READY 220
+#define CODE_CLOSE 221
+#define CODE_DSUCC 226
+#define CODE_PSVMD 227
+#define CODE_EPSVM 229
+#define CODE_LOGIN 230
+#define CODE_AUTHOK 234
+#define CODE_FSUCC 250
+#define CODE_CRDIR 257
+#define CODE_REQPW 331
+#define CODE_RSTRT 350
+#define CODE_NODATA 425
+#define CODE_ABORT 426
+#define CODE_NOCMD 500
+#define CODE_NOIMP 502
+#define CODE_NOPRM 504
+#define CODE_NOLOG 530
+#define CODE_NOFILE 550
+
+/**
+ * What the data channel of a client is used for.
+ */
+enum class Op {
+    None,
+    Retr,                       // file to socket
+    Stor,                       // socket to file
+    Listing                     // prepared LIST, NLST, or MLSD text to socket
+};
+
+/**
+ * One control connection and its data channel. Every descriptor is non-blocking.
+ */
+struct Client {
+    int control = -1;
+    int listener = -1;          // passive port waiting for the data connection, -1 if none
+    int data = -1;
+    std::string input;          // received bytes not parsed yet
+    std::string output;         // replies due and not sent yet
+    int delayed = 0;            // replies still held back by the latency setting
+    bool closing = false;       // close once every reply is sent
+    bool logged_in = false;
+    std::string cwd = "/";
+    long long rest = 0;         // offset from REST for the next RETR or STOR
+    Op op = Op::None;
+    int fd = -1;                // file of the current RETR or STOR
+    std::string listing;
+    size_t listing_sent = 0;
+    uint32_t data_events = 0;   // what epoll watches on the data channel, 0 if not registered
+    SSL *control_tls = nullptr; // set once the reply to AUTH TLS is out
+    bool tls_starting = false;  // AUTH TLS accepted, its reply not sent yet
+    bool protect = false;       // PROT P: data channels use TLS too
+    SSL *data_tls = nullptr;
+    std::vector<char> pending;  // file bytes read for SSL_write and not sent yet
+    size_t pending_sent = 0;
+};
+
+/**
+ * A reply held back to simulate a slower network.
+ */
+struct Delayed {
+    std::chrono::steady_clock::time_point due;
+    unsigned long long id;      // the client it goes to
+    std::string text;
+};
+
+/**
+ * Parse command line arguments `./ftpd [-p PORT] [-r ROOT] [-d DELAY_MS] [-t PEM] [-q]`.
+ * @param argc number of arguments.
+ * @param argv array of arguments.
+ * @return true if the arguments are valid, false otherwise.
+ */
+bool parse_command(int argc, char *argv[]);
+
+/**
+ * Open the listening socket on the loopback address.
+ * @param port the port number as text.
+ * @return the socket descriptor, or -1 on error.
+ */
+int open_listenfd(const std::string& port);
+
+/**
+ * Queue a reply to a client, right away or after the configured delay.
+ * @param id the client.
+ * @param code the reply code.
+ * @param text the rest of the reply; a multi-line reply starts with '-' and has its inner lines already joined with '\r\n'.
+ */
+void reply(unsigned long long id, int code, const std::string& text);
+
+/**
+ * Map a path of a command onto the served directory. `..` never leaves the root.
+ * @param client the client, for its working directory.
+ * @param path the path given with the command.
+ * @return the local path.
+ */
+std::string local_path(const Client& client, const std::string& path);
+
+/**
+ * Run one command line of a client.
+ * @param id the client.
+ * @param line the command line without '\r\n'.
+ */
+void handle_command(unsigned long long id, const std::string& line);
+
+/**
+ * Start the transfer of a client once it has both its command and its data connection.
+ * @param id the client.
+ */
+void start_transfer(unsigned long long id);
+
+/**
+ * Move the next chunk of a transfer, and finish it with 226 or 426 at its end.
+ * @param id the client.
+ */
+void continue_transfer(unsigned long long id);
+
+/**
+ * Run the commands a client has sent, in order, stopping at one that starts a transfer.
+ * @param id the client.
+ */
+void run_commands(unsigned long long id);
+
+/**
+ * Send as many queued replies as the control connection takes, and close it after QUIT.
+ * @param id the client.
+ */
+void flush_replies(unsigned long long id);
+
+/**
+ * Close every descriptor of a client and forget it.
+ * @param id the client.
+ */
+void close_client(unsigned long long id);
+
+#endif
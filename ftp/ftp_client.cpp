@@ -1,26 +1,130 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <map>
-#include <regex>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
+#include <fcntl.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <netinet/tcp.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
 #include "ftp_client.h"
 
 static bool verbose = false;
+static int jobs = 1;
+static bool recursive = false;
+static bool delete_extra = false;
+static bool mlsd_supported = true;     // cleared the first time the server refuses MLSD
+static bool resume = false;
+static bool uring = false;             // upload_file and download_file move their data through io_uring
+static bool threaded = false;          // run_transfers gives each session a thread instead of the epoll engine
+static std::atomic<bool> pipeline = true;
+static std::atomic<bool> epsv_supported = true;
+static std::atomic<bool> prefetch = false;     // set for jobs of many files
+static bool mode_z = false;            // send and fetch files worth compressing in MODE Z
+static int compress_level = COMPRESS_LEVEL;
+static long long compress_min = COMPRESS_MIN;
+static std::atomic<bool> mode_z_supported = false;     // set when FEAT lists MODE Z
+static std::once_flag features_once;
+static bool verify = false;            // check every transferred file against the server's checksum
+static std::string checksum_command;   // HASH, XCRC, or XMD5; empty if the server has none
+static std::string checksum_algorithm; // as HASH names it: CRC32, MD5, SHA-1, SHA-256, or SHA-512
+static bool tls = false;               // explicit FTPS: AUTH TLS on the control connection, PROT P on data channels
+static bool tls_insecure = false;      // accept any server certificate
+static std::string tls_ca_file;        // trust the certificates in this file instead of the system store
+static SSL_CTX *tls_context = nullptr;
+static std::once_flag tls_once;
 
-bool parse_command(int argc, char *argv[], bool& help, std::string& operation,
-                   std::string& param1, std::string& param2) {
+// data channels asked for ahead of the next transfer, keyed by control socket
+static std::mutex prefetch_mutex;
+static std::map<int, Prefetch> prefetched;
+
+// one buffered reader per control connection, keyed by socket
+static std::mutex reader_mutex;
+static std::map<int, Reader> readers;
+
+// TLS sessions of control connections and data channels, keyed by socket
+static std::mutex tls_mutex;
+static std::map<int, SSL *> tls_sockets;
+
+// control connections that are in MODE Z; every other one is in MODE S
+static std::mutex mode_mutex;
+static std::set<int> deflating;
+
+// directory listings keyed by site and path, so walks and checks can skip their round trips
+static int cache_ttl = CACHE_TTL;      // seconds a cached listing is trusted; 0 turns the cache off
+static std::string cache_path;         // --cache-file, loaded once every option is known
+static std::mutex cache_mutex;
+static std::map<int, std::string> sites;       // `user@host:port` of each logged-in control connection
+static std::map<std::string, Listing> listings;
+static int cache_fd = -1;              // the cache file, appended to with O_APPEND
+static int cache_lockfd = -1;          // flock'd around every read and write of it, shared by concurrent runs
+
+// completed files and reached offsets of earlier runs, keyed by local and remote path
+static std::mutex journal_mutex;
+static std::ofstream journal;
+static std::map<std::string, std::pair<bool, long long>> journal_entries;
+
+// metrics of every login and transfer, for --stats and --stats-json
+static bool stats = false;
+static std::mutex metrics_mutex;
+static std::vector<Metrics> metrics_log;
+static std::ofstream stats_json;
+
+// verbose traces are stamped with the seconds since the program started
+static const auto program_start = std::chrono::steady_clock::now();
+static std::mutex trace_mutex;
+
+bool valid_operation(const std::string& operation, int count) {
     const std::map<std::string, int> valid_commands = {
         {"ls", 2},
         {"mkdir", 2},
         {"rm", 2},
         {"rmdir", 2},
         {"cp", 3},
-        {"mv", 3}
+        {"mv", 3},
+        {"sync", 3}
     };
+    return valid_commands.contains(operation) && valid_commands.at(operation) == count;
+}
+
+
+bool parse_command(int argc, char *argv[], bool& help, std::string& operation,
+                   std::string& param1, std::string& param2) {
     std::vector<std::string> arguments;
 
     for (int i = 1; i < argc; i++) {
@@ -29,6 +133,53 @@ bool parse_command(int argc, char *argv[], bool& help, std::string& operation,
             help = true;
         } else if (arg == "-v" || arg == "--verbose") {
             verbose = true;
+        } else if (arg == "-r" || arg == "--recursive") {
+            recursive = true;
+        } else if (arg == "--delete") {
+            delete_extra = true;
+        } else if (arg == "--no-pipeline") {
+            pipeline = false;
+        } else if (arg == "--io-uring") {
+            uring = true;
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg == "--stats-json" && i + 1 < argc) {
+            if (!open_stats(argv[++i])) {
+                return false;
+            }
+        } else if (arg == "--threads") {
+            threaded = true;
+        } else if (arg == "--tls") {
+            tls = true;
+        } else if (arg == "--tls-ca-file" && i + 1 < argc) {
+            tls = true;
+            tls_ca_file = argv[++i];
+        } else if (arg == "--tls-insecure") {
+            tls = true;
+            tls_insecure = true;
+        } else if (arg == "--verify") {
+            verify = true;
+        } else if (arg == "-z" || arg == "--compress") {
+            mode_z = true;
+        } else if (arg == "--compress-level" && i + 1 < argc) {
+            mode_z = true;
+            compress_level = std::clamp(std::atoi(argv[++i]), 1, 9);
+        } else if (arg == "--compress-min" && i + 1 < argc) {
+            mode_z = true;
+            compress_min = std::max(0LL, std::atoll(argv[++i]));
+        } else if (arg == "-c" || arg == "--continue") {
+            resume = true;
+        } else if (arg == "--journal" && i + 1 < argc) {
+            resume = true;
+            if (!open_journal(argv[++i])) {
+                return false;
+            }
+        } else if (arg == "--cache-ttl" && i + 1 < argc) {
+            cache_ttl = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--cache-file" && i + 1 < argc) {
+            cache_path = argv[++i];
+        } else if ((arg == "-j" || arg == "--jobs") && i + 1 < argc) {
+            jobs = std::max(1, std::atoi(argv[++i]));
         } else {
             arguments.push_back(arg);
         }
@@ -37,8 +188,12 @@ bool parse_command(int argc, char *argv[], bool& help, std::string& operation,
     if (help) {
         return true;
     }
-    if (arguments.size() < 2 || !valid_commands.contains(arguments[0])
-        || valid_commands.at(arguments[0]) != static_cast<int>(arguments.size())) {
+    if (!cache_path.empty() && cache_ttl > 0 && !open_listing_cache(cache_path)) {
+        return false;
+    }
+    // batch takes the server URL and an optional script file
+    bool batch = arguments.size() >= 2 && arguments.size() <= 3 && arguments[0] == "batch";
+    if (!batch && (arguments.size() < 2 || !valid_operation(arguments[0], static_cast<int>(arguments.size())))) {
         return false;
     }
     operation = arguments[0];
@@ -48,18 +203,91 @@ bool parse_command(int argc, char *argv[], bool& help, std::string& operation,
 }
 
 
-bool parse_url(const std::string& param1, const std::string& param2, FTP& ftp_url) {
-    std::regex url_pattern(R"(^(ftp):\/\/(?:([^:@]+)(?::([^@]+))?@)?([^:\/?#]+)(?::(\d+))?(\/[^?#]*)?$)");
-    std::smatch matches;
+/**
+ * Match one URL `ftp://[USER[:PASSWORD]@]HOST[:PORT][/PATH]` without allocating.
+ * @param with_user try the USER[:PASSWORD]@ part, otherwise everything up to the port is the host.
+ * @return true if the whole text matches.
+ */
+static bool match_url(std::string_view url, bool with_user, std::string_view parts[5]) {
+    const std::string_view scheme = "ftp://";
+    if (url.substr(0, scheme.length()) != scheme) {
+        return false;
+    }
+    url.remove_prefix(scheme.length());
+    std::string_view& user = parts[0];
+    std::string_view& password = parts[1];
+    std::string_view& host = parts[2];
+    std::string_view& port = parts[3];
+    std::string_view& path = parts[4];
+    user = password = port = path = {};
+
+    // user name has no ':' or '@', password has no '@', both must be non-empty
+    if (with_user) {
+        size_t at = url.find('@');
+        if (at == std::string_view::npos) {
+            return false;
+        }
+        size_t colon = url.substr(0, at).find(':');
+        user = url.substr(0, std::min(colon, at));
+        if (colon != std::string_view::npos) {
+            password = url.substr(colon + 1, at - colon - 1);
+            if (password.empty()) {
+                return false;
+            }
+        }
+        if (user.empty()) {
+            return false;
+        }
+        url.remove_prefix(at + 1);
+    }
+
+    // host runs up to ':', '/', '?', or '#', or is an IPv6 address in brackets,
+    // then an optional port of digits and an optional path
+    if (!url.empty() && url[0] == '[') {
+        size_t close = url.find(']');
+        if (close == std::string_view::npos || close == 1) {
+            return false;
+        }
+        host = url.substr(1, close - 1);
+        url.remove_prefix(close + 1);
+    } else {
+        host = url.substr(0, url.find_first_of(":/?#"));
+        if (host.empty()) {
+            return false;
+        }
+        url.remove_prefix(host.length());
+    }
+    if (!url.empty() && url[0] == ':') {
+        size_t digits = 1;
+        while (digits < url.length() && isdigit(static_cast<unsigned char>(url[digits]))) {
+            digits++;
+        }
+        if (digits == 1) {
+            return false;
+        }
+        port = url.substr(1, digits - 1);
+        url.remove_prefix(digits);
+    }
+    if (!url.empty()) {
+        if (url[0] != '/' || url.find_first_of("?#") != std::string_view::npos) {
+            return false;
+        }
+        path = url;
+    }
+    return true;
+}
+
 
+bool parse_url(const std::string& param1, const std::string& param2, FTP& ftp_url) {
+    std::string_view parts[5];
     for (const std::string& param: {param1, param2}) {
-        if (std::regex_match(param, matches, url_pattern)) {
-            ftp_url.protocol = matches[1].str();
-            ftp_url.username = matches[2].length() ? matches[2].str() : DEFAULT_NAME;
-            ftp_url.password = matches[3].str();
-            ftp_url.host = matches[4].str();
-            ftp_url.port = matches[5].length() ? matches[5].str() : DEFAULT_PORT;
-            ftp_url.path = matches[6].length() ? matches[6].str() : "/";
+        if (match_url(param, true, parts) || match_url(param, false, parts)) {
+            ftp_url.protocol = "ftp";
+            ftp_url.username = parts[0].empty() ? DEFAULT_NAME : std::string(parts[0]);
+            ftp_url.password = parts[1];
+            ftp_url.host = parts[2];
+            ftp_url.port = parts[3].empty() ? DEFAULT_PORT : std::string(parts[3]);
+            ftp_url.path = parts[4].empty() ? "/" : std::string(parts[4]);
             return !ftp_url.host.empty();  // host name is required
         }
     }
@@ -73,26 +301,167 @@ void print_help() {
                  "on remote FTP servers." << "\n\n";
     std::cout << "positional arguments:\n";
     std::cout << "operation" << "\t\t" << "The operation to execute. Valid operations are 'ls', 'rm', 'rmdir', "
-                                        "'mkdir', 'cp', and 'mv'" << '\n';
+                                        "'mkdir', 'cp', 'mv', 'sync', and 'batch'" << '\n';
     std::cout << "params" << "\t\t\t" << "Parameters for the given operation. "
                                          "Will be one or two paths and/or URLs.\n\n";
     std::cout << "optional arguments:\n";
     std::cout << "-h, --help" << "\t\t" << "show this help message and exit\n";
-    std::cout << "--verbose, -v" << "\t\t" << "Print all messages to and from the FTP server\n\n";
+    std::cout << "--verbose, -v" << "\t\t" << "Print all messages to and from the FTP server\n";
+    std::cout << "--jobs, -j N" << "\t\t" << "Download large files in N byte ranges over N parallel connections; "
+                                      "with -r, copy files over N logged-in sessions\n";
+    std::cout << "--recursive, -r" << "\t\t" << "Copy or move a whole directory tree with cp and mv\n";
+    std::cout << "--delete" << "\t\t" << "With sync, delete files and directories that are not in the source\n";
+    std::cout << "--continue, -c" << "\t\t" << "Resume a partial download from the size of the local file, "
+                                          "and a partial upload from the size of the remote file\n";
+    std::cout << "--journal FILE" << "\t\t" << "Record finished files and reached offsets in FILE, and skip the "
+                                          "files it lists as finished; implies --continue\n";
+    std::cout << "--cache-ttl SECONDS" << '\t' << "Reuse a directory listing for lookups and walks for SECONDS; "
+                                             "default 30, 0 turns the cache off\n";
+    std::cout << "--cache-file FILE" << "\t" << "Keep cached listings in FILE across runs\n";
+    std::cout << "--no-pipeline" << "\t\t" << "Wait for the reply to each login command before sending the next\n";
+    std::cout << "--threads" << "\t\t" << "With -r and sync, drive each session from its own thread "
+                                     "instead of one epoll loop\n";
+    std::cout << "--io-uring" << "\t\t" << "Move file data through io_uring in batches of linked requests "
+                                      "instead of sendfile and splice (Linux only)\n";
+    std::cout << "--compress, -z" << "\t\t" << "Send and fetch files in MODE Z (deflate) if the server lists it in "
+                                          "FEAT; small files and files that are already compressed go in MODE S\n";
+    std::cout << "--compress-level N" << "\t" << "zlib level of MODE Z uploads, 1 (fastest) to 9 (smallest); "
+                                              "default 6, implies --compress\n";
+    std::cout << "--compress-min BYTES" << '\t' << "Send files smaller than BYTES in MODE S; default 16384, "
+                                               "implies --compress\n";
+    std::cout << "--tls" << "\t\t\t" << "Use explicit FTPS: AUTH TLS on the control connection and PROT P on "
+                                 "every data channel, which resumes the control connection's TLS session\n";
+    std::cout << "--tls-ca-file FILE" << "\t" << "Trust the server certificates in FILE instead of the system store; "
+                                            "implies --tls\n";
+    std::cout << "--tls-insecure" << "\t\t" << "Accept any server certificate; implies --tls\n";
+    std::cout << "--verify" << "\t\t" << "Checksum every file while it is transferred and compare it with the "
+                                    "server's HASH, XCRC, or XMD5 reply\n";
+    std::cout << "--stats" << "\t\t\t" << "Print connect, login, data channel, first byte, transfer, and 226 "
+                                   "times of every session and file when the job ends\n";
+    std::cout << "--stats-json FILE" << "\t" << "Append the same metrics to FILE, one JSON object per line\n\n";
     std::cout << "This FTP client supports the following operations:\n";
     std::cout << "ls <URL>" << "\t\t" << "Print out the directory listing from the FTP server at the given URL\n";
     std::cout << "mkdir <URL>" << "\t\t" << "Create a new directory on the FTP server at the given URL\n";
     std::cout << "rm <URL>" << "\t\t" << "Delete the file on the FTP server at the given URL\n";
     std::cout << "rmdir <URL>" << "\t\t" << "Delete the directory on the FTP server at the given URL\n";
     std::cout << "cp <ARG1> <ARG2>" << '\t' << "Copy the file given by ARG1 to the file given by ARG2. "
-                                               "If ARG1 is a local file, then ARG2 must be a URL, and vice-versa.\n";
+                                               "If ARG1 is a local file, then ARG2 must be a URL, and vice-versa. "
+                                               "If both are URLs, the servers send the file to each other.\n";
     std::cout << "mv <ARG1> <ARG2>" << '\t' << "Move the file given by ARG1 to the file given by ARG2. "
-                                               "If ARG1 is a local file, then ARG2 must be a URL, and vice-versa.\n";
+                                               "If ARG1 is a local file, then ARG2 must be a URL, and vice-versa. "
+                                               "If both are URLs, the servers send the file to each other.\n";
+    std::cout << "sync <ARG1> <ARG2>" << '\t' << "Copy only the new and changed files of the directory tree ARG1 "
+                                                 "into ARG2, comparing size and modification time. "
+                                                 "If ARG1 is a local directory, then ARG2 must be a URL, and vice-versa.\n";
+    std::cout << "batch <URL> [FILE]" << '\t' << "Log in to the FTP server at the given URL once, then run every "
+                                                 "operation listed in FILE (or standard input), one per line.\n";
 
     exit(0);
 }
 
 
+/**
+ * Get the TLS session of a socket.
+ * @return the session, or nullptr for a plain socket.
+ */
+static SSL *tls_for(int sockfd) {
+    std::lock_guard<std::mutex> lock(tls_mutex);
+    auto found = tls_sockets.find(sockfd);
+    return found == tls_sockets.end() ? nullptr : found->second;
+}
+
+
+/**
+ * Drop the TLS session of a socket, if it has one, sending close_notify first if asked to.
+ */
+static void tls_forget(int sockfd, bool shutdown) {
+    SSL *ssl;
+    {
+        std::lock_guard<std::mutex> lock(tls_mutex);
+        auto found = tls_sockets.find(sockfd);
+        if (found == tls_sockets.end()) {
+            return;
+        }
+        ssl = found->second;
+        tls_sockets.erase(found);
+    }
+    if (shutdown) {
+        SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+}
+
+
+/**
+ * Send bytes over a socket, through its TLS session if it has one.
+ * @return the number of bytes sent, or -1 on error with errno set.
+ */
+static ssize_t channel_send(int sockfd, const char *buffer, size_t length) {
+    SSL *ssl = tls_for(sockfd);
+    if (!ssl) {
+        return send(sockfd, buffer, length, 0);
+    }
+    size_t written;
+    if (SSL_write_ex(ssl, buffer, length, &written) == 1) {
+        return static_cast<ssize_t>(written);
+    }
+    errno = errno != 0 ? errno : EIO;
+    return -1;
+}
+
+
+/**
+ * Receive bytes from a socket, through its TLS session if it has one.
+ * @return the number of bytes received, 0 once the peer has closed, or -1 on error with errno set,
+ * EPROTO if a data channel's peer closed without close_notify.
+ */
+static ssize_t channel_recv(int sockfd, char *buffer, size_t length) {
+    SSL *ssl = tls_for(sockfd);
+    if (!ssl) {
+        return recv(sockfd, buffer, length, 0);
+    }
+    size_t received;
+    int result = SSL_read_ex(ssl, buffer, length, &received);
+    if (result == 1) {
+        return static_cast<ssize_t>(received);
+    }
+    int error = SSL_get_error(ssl, result);
+    if (error == SSL_ERROR_ZERO_RETURN) {
+        return 0;
+    }
+    if (error == SSL_ERROR_SSL && ERR_GET_REASON(ERR_peek_last_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING) {
+        // a data channel closed without close_notify may have lost its tail, so it is not a clean end
+        errno = EPROTO;
+    } else {
+        errno = errno != 0 ? errno : EIO;
+    }
+    ERR_clear_error();
+    return -1;
+}
+
+
+/**
+ * Close a data channel, ending its TLS session with close_notify so the server knows the data is complete.
+ * After an upload the server may still have unread bytes of ours, and we may have unread TLS records of
+ * its own, like session tickets; closing over those resets the connection and the server can lose the
+ * tail of the file. Lingering sends a FIN after close_notify and waits a while for the server to close.
+ */
+static void close_channel(int sockfd, bool linger = false) {
+    bool secure = tls_for(sockfd) != nullptr;
+    tls_forget(sockfd, true);
+    if (secure && linger) {
+        shutdown(sockfd, SHUT_WR);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TLS_LINGER_MS);
+        struct pollfd ready = {sockfd, POLLIN, 0};
+        char buffer[READER_SIZE];
+        while (std::chrono::steady_clock::now() < deadline && poll(&ready, 1, TLS_LINGER_MS) > 0
+               && recv(sockfd, buffer, sizeof(buffer), 0) > 0) {
+        }
+    }
+    close(sockfd);
+}
+
+
 int open_clientfd(const std::string& host, const std::string& port) {
     int sockfd = -1, rc = -1;
     struct addrinfo hints, *addr_list, *ptr;
@@ -112,6 +481,9 @@ int open_clientfd(const std::string& host, const std::string& port) {
             continue;
         }
         if (connect(sockfd, ptr->ai_addr, ptr->ai_addrlen) != -1) {
+            // commands are whole lines written at once, there is nothing to gain from holding them back
+            int nodelay = 1;
+            setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
             break;
         }
         // connection failed, try another
@@ -120,23 +492,89 @@ int open_clientfd(const std::string& host, const std::string& port) {
 
     // clean up data structure
     freeaddrinfo(addr_list);
+    if (ptr) {
+        // a new connection may reuse the number of a closed one, drop anything left from it
+        reset_reader(sockfd);
+        tls_forget(sockfd, false);
+        std::lock_guard<std::mutex> lock(mode_mutex);
+        deflating.erase(sockfd);
+    }
     return ptr ? sockfd : -1;
 }
 
 
+/**
+ * Print one line of control channel traffic, stamped with the seconds since the program started.
+ */
+static void trace(std::string_view text) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - program_start).count();
+    char stamp[16];
+    snprintf(stamp, sizeof(stamp), "[%9.3f] ", seconds);
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    std::cout << stamp << text << '\n';
+}
+
+
+/**
+ * Trace every command in a message as it is sent, with the password left out.
+ */
+static void trace_commands(std::string_view msg) {
+    size_t start = 0, end;
+    while ((end = msg.find("\r\n", start)) != std::string_view::npos) {
+        std::string_view line = msg.substr(start, end - start);
+        trace(std::string("> ") + std::string(line.starts_with("PASS ") ? "PASS ****" : line));
+        start = end + 2;
+    }
+}
+
+
+/**
+ * Milliseconds from one point in time to another, or to now.
+ */
+static double elapsed_ms(std::chrono::steady_clock::time_point since,
+                         std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now()) {
+    return std::chrono::duration<double, std::milli>(until - since).count();
+}
+
+
+/**
+ * Fill in the data part of a transfer's metrics from the tuner of its data channel.
+ * @param command when STOR or RETR was sent.
+ * @param data_end when the data channel reached its end.
+ */
+static void measure_data(Metrics& metrics, const Tuner& tuner, std::chrono::steady_clock::time_point command,
+                         std::chrono::steady_clock::time_point data_end) {
+    metrics.bytes = tuner.total_bytes;
+    if (tuner.total_bytes > 0) {
+        metrics.first_byte_ms = elapsed_ms(command, tuner.first_byte);
+        metrics.transfer_ms = elapsed_ms(tuner.first_byte, data_end);
+    }
+}
+
+
 void send_message(int sockfd, const std::string& cmd, const std::string& param="") {
+    // a passive reply still on its way comes before the reply to this command
+    settle_data_channel(sockfd);
     std::string msg;
     if (param.empty()) {
         msg = cmd + "\r\n";
     } else {
         msg = cmd + " " + param + "\r\n";
     }
+    send_messages(sockfd, msg);
+}
+
+
+void send_messages(int sockfd, const std::string& msg) {
+    if (verbose) {
+        trace_commands(msg);
+    }
     const char* buf = msg.c_str();
 
     ssize_t total = 0, bytes_sent = 0;
     auto msg_size = static_cast<ssize_t>(msg.length());
     while (total < msg_size) {
-        if ((bytes_sent = send(sockfd, buf + total, msg_size - total, 0)) == -1) {
+        if ((bytes_sent = channel_send(sockfd, buf + total, msg_size - total)) == -1) {
             std::cerr << "Failed to send command: " << msg;
             exit(1);
         }
@@ -145,29 +583,146 @@ void send_message(int sockfd, const std::string& cmd, const std::string& param="
 }
 
 
-std::string read_response(int sockfd) {
-    char buf[1028];
-    std::string message;
-    ssize_t bytes_received;
+/**
+ * Find the end of the first complete reply in the buffer. A multi-line reply starts with
+ * `xyz-` and ends with a line starting with `xyz `.
+ * @return the length of the reply including its last '\r\n', or 0 if more bytes are needed.
+ */
+static size_t reply_length(std::string_view buffer) {
+    size_t endline = buffer.find("\r\n");
+    if (endline == std::string_view::npos) {
+        return 0;
+    }
+    if (endline < 4 || buffer[3] != '-') {
+        return endline + 2;
+    }
+    for (size_t start = endline + 2; (endline = buffer.find("\r\n", start)) != std::string_view::npos; start = endline + 2) {
+        if (buffer.compare(start, 3, buffer.substr(0, 3)) == 0 && buffer.substr(start + 3, 1) == " ") {
+            return endline + 2;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Get the reader of a control connection, creating an empty one the first time.
+ */
+static Reader& reader_for(int sockfd) {
+    std::lock_guard<std::mutex> lock(reader_mutex);
+    return readers[sockfd];
+}
+
+
+void reset_reader(int sockfd) {
+    Reader& reader = reader_for(sockfd);
+    reader.start = reader.end = 0;
+}
+
+
+/**
+ * Make room at the end of a reader's buffer: slide the unread bytes to the front, or grow for a very long reply.
+ */
+static void make_room(Reader& reader) {
+    if (reader.buffer.empty()) {
+        reader.buffer.resize(READER_SIZE);
+    }
+    if (reader.end == reader.buffer.size()) {
+        if (reader.start > 0) {
+            memmove(reader.buffer.data(), reader.buffer.data() + reader.start, reader.end - reader.start);
+            reader.end -= reader.start;
+            reader.start = 0;
+        } else {
+            reader.buffer.resize(reader.buffer.size() * 2);
+        }
+    }
+}
+
+
+/**
+ * Take the complete reply of the given length off the front of a reader's buffer.
+ */
+static Reply take_reply(Reader& reader, size_t length) {
+    Reply reply;
+    reply.text = std::string_view(reader.buffer.data() + reader.start, length - 2);
+    reply.line = reply.text.substr(0, reply.text.find("\r\n"));
+    reply.code = -1;
+    if (reply.line.length() >= 3 && std::all_of(reply.line.begin(), reply.line.begin() + 3, ::isdigit)) {
+        reply.code = (reply.line[0] - '0') * 100 + (reply.line[1] - '0') * 10 + (reply.line[2] - '0');
+    }
+
+    // whatever follows is the start of the next reply
+    reader.start += length;
+    if (reader.start == reader.end) {
+        reader.start = reader.end = 0;
+    }
+    return reply;
+}
 
-    while (true) {
-        if ((bytes_received = recv(sockfd, buf, sizeof(buf), 0)) <= 0) {
+
+/**
+ * Acknowledge every reply at once; a server with Nagle's algorithm on holds a second reply
+ * sent right behind the first until it is acknowledged, which delayed ACKs stretch to 40 ms.
+ */
+static void quick_ack(int sockfd) {
+#ifdef __linux__
+    int quickack = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+#else
+    (void) sockfd;
+#endif
+}
+
+
+Reply read_reply(int sockfd) {
+    Reader& reader = reader_for(sockfd);
+    size_t length;
+    while ((length = reply_length({reader.buffer.data() + reader.start, reader.end - reader.start})) == 0) {
+        make_room(reader);
+        quick_ack(sockfd);
+        ssize_t bytes_received = channel_recv(sockfd, reader.buffer.data() + reader.end, reader.buffer.size() - reader.end);
+        if (bytes_received <= 0) {
             std::cerr << "Failed to read response from server" << std::endl;
             exit(1);
         }
-        message.append(buf, bytes_received);
+        reader.end += bytes_received;
+    }
+    return take_reply(reader, length);
+}
 
-        std::string::size_type endline = message.find("\r\n");
-        if (endline != std::string::npos) {
-            return message.substr(0, endline);
-        }
+
+std::string read_response(int sockfd) {
+    return std::string(read_reply(sockfd).line);
+}
+
+
+int reply_code(const Reply& reply) {
+    if (verbose) {
+        trace(reply.text);
+    }
+    return reply.code;
+}
+
+
+bool response_ready(int sockfd, int timeout) {
+    Reader& reader = reader_for(sockfd);
+    if (reply_length({reader.buffer.data() + reader.start, reader.end - reader.start}) > 0) {
+        return true;
+    }
+    // bytes TLS has already decrypted do not show up in poll
+    SSL *ssl = tls_for(sockfd);
+    if (ssl && SSL_pending(ssl) > 0) {
+        return true;
     }
+    // readable does not mean a whole reply is in, but a server that answers at all is not dropping commands
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    return poll(&pfd, 1, timeout) > 0;
 }
 
 
 int response_code(std::string& response) {
     if (verbose) {
-        std::cout << response << '\n';
+        trace(response);
     }
     if (response.length() < 3) {
         return -1;
@@ -176,17 +731,14 @@ int response_code(std::string& response) {
 }
 
 
-bool pre_operation(int sockfd, const FTP& ftp) {
+/**
+ * Log in and set up the session one command at a time, waiting for each reply.
+ * @return true if all commands are successful, false on error.
+ */
+static bool login_strict(int sockfd, const FTP& ftp) {
     std::string response;
     int code;
 
-    // read hello message from the FTP server
-    response = read_response(sockfd);
-    if ((code = response_code(response)) != CODE_READY) {
-        std::cerr << "Unexpected welcome message: " << response << '\n';
-        return false;
-    }
-
     // send username and password
     send_message(sockfd, "USER", ftp.username);
     response = read_response(sockfd);
@@ -205,6 +757,22 @@ bool pre_operation(int sockfd, const FTP& ftp) {
         return false;
     }
 
+    // on a secured connection, encrypt the data channels too; PBSZ is always 0 for TLS
+    if (tls) {
+        send_message(sockfd, "PBSZ", "0");
+        response = read_response(sockfd);
+        if ((code = response_code(response)) != CODE_CMPLT) {
+            std::cerr << "Protection buffer error: " << response << '\n';
+            return false;
+        }
+        send_message(sockfd, "PROT", "P");
+        response = read_response(sockfd);
+        if ((code = response_code(response)) != CODE_CMPLT) {
+            std::cerr << "Protection level error: " << response << '\n';
+            return false;
+        }
+    }
+
     // set the connection to 8-bit binary data mode
     send_message(sockfd, "TYPE", "I");
     response = read_response(sockfd);
@@ -233,262 +801,4039 @@ bool pre_operation(int sockfd, const FTP& ftp) {
 }
 
 
-bool parse_pasv_response(const std::string& msg, std::string& ip, std::string& port) {
-    std::regex pasv_regex(R"(\((\d+),(\d+),(\d+),(\d+),(\d+),(\d+)\))");
-    std::smatch matches;
+/**
+ * Log in and set up the session with every command in one write, then check the replies in order.
+ * @param strict output parameter, set if the server stopped answering, or answered in a way that only a
+ * server confused by pipelining would, such as 503 to the early PASS or a reply that belongs to another
+ * command; the login is then worth retrying one command at a time.
+ * @return true if all commands are successful, false on error.
+ */
+static bool login_pipelined(int sockfd, const FTP& ftp, bool& strict) {
+    // PASS goes out before USER is answered; a server that logs in on USER alone
+    // answers it with an error, which is ignored
+    std::string password = ftp.password.empty() ? "PASS\r\n" : "PASS " + ftp.password + "\r\n";
+    std::string protection = tls ? "PBSZ 0\r\nPROT P\r\n" : "";
+    send_messages(sockfd, "USER " + ftp.username + "\r\n" + password + protection + "TYPE I\r\nMODE S\r\nSTRU F\r\n");
 
-    if (std::regex_search(msg, matches, pasv_regex)) {
-        ip = matches[1].str() + "." + matches[2].str() + "." + matches[3].str() + "." + matches[4].str();
-        int p1 = std::stoi(matches[5].str());
-        int p2 = std::stoi(matches[6].str());
-        port = std::to_string((p1 << 8) + p2);
-        return true;
+    std::vector<const char *> errors = {"Username error: ", "Password error: "};
+    if (tls) {
+        errors.insert(errors.end(), {"Protection buffer error: ", "Protection level error: "});
     }
-    return false;
+    errors.insert(errors.end(), {"Type command error: ", "Mode command error: ", "Structure command error: "});
+    bool logged_in = false;
+    strict = false;
+    for (size_t i = 0; i < errors.size(); i++) {
+        if (!response_ready(sockfd, PIPELINE_TIMEOUT)) {
+            strict = true;
+            return false;
+        }
+        Reply reply = read_reply(sockfd);
+        int code = reply_code(reply);
+        bool expected;
+        if (i == 0) {
+            expected = code == CODE_LOGIN || code == CODE_REQPW;
+            logged_in = code == CODE_LOGIN;
+        } else if (i == 1) {
+            expected = logged_in || code == CODE_LOGIN;
+        } else {
+            expected = code == CODE_CMPLT;
+        }
+        if (!expected) {
+            // only a refused user name or password is the final word; anything else may be the server
+            // tripping over commands it did not expect yet
+            if (code == CODE_NOLOG && i < 2) {
+                std::cerr << errors[i] << reply.line << '\n';
+            } else {
+                strict = true;
+            }
+            return false;
+        }
+    }
+    return true;
 }
 
 
-int open_data_channel(int control_sockfd) {
-    send_message(control_sockfd, "PASV");
-    std::string response = read_response(control_sockfd);
-    int code = response_code(response);
-    if (code != CODE_PSVMD) {
-        std::cerr << "Entering passive mode error: " << response << '\n';
-        return -1;
+/**
+ * Read the welcome message of a new connection.
+ * @return true if the server is ready, false on error.
+ */
+static bool read_welcome(int sockfd) {
+    Reply reply = read_reply(sockfd);
+    if (reply_code(reply) != CODE_READY) {
+        std::cerr << "Unexpected welcome message: " << reply.line << '\n';
+        return false;
     }
+    return true;
+}
 
-    std::string ip;
-    std::string port;
-    if (!parse_pasv_response(response, ip, port)) {
-        std::cerr << "Failed to parse PASV response: " << response << '\n';
-        return -1;
-    }
 
-    int data_sockfd = open_clientfd(ip, port);
-    if (data_sockfd < 0) {
-        std::cerr << "Failed to open data channel\n";
-        return -1;
+/**
+ * Create the TLS context every control connection and data channel is made from.
+ */
+static void make_tls_context() {
+    SSL_CTX *context = SSL_CTX_new(TLS_client_method());
+    if (!context) {
+        return;
     }
-    return data_sockfd;
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    // kernel TLS lets sendfile carry encrypted uploads; a control connection may close without
+    // close_notify after QUIT, data channels clear this again since their end marks the end of a file
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    if (tls_insecure) {
+        SSL_CTX_set_verify(context, SSL_VERIFY_NONE, nullptr);
+    } else {
+        SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+        bool loaded = tls_ca_file.empty() ? SSL_CTX_set_default_verify_paths(context) == 1
+                                          : SSL_CTX_load_verify_locations(context, tls_ca_file.c_str(), nullptr) == 1;
+        if (!loaded) {
+            std::cerr << "Failed to load certificates" << (tls_ca_file.empty() ? "" : " from " + tls_ca_file) << '\n';
+            SSL_CTX_free(context);
+            return;
+        }
+    }
+    tls_context = context;
 }
 
 
-bool list_directory(int control_sockfd, const std::string& path) {
-    // open data channel for file transfer
-    int data_sockfd;
-    if ((data_sockfd = open_data_channel(control_sockfd)) < 0) {
+/**
+ * Run the TLS handshake on a connected socket and register the session under it.
+ * @return true if okay, false on error.
+ */
+static bool tls_handshake(int sockfd, SSL *ssl, const char *what) {
+    SSL_set_fd(ssl, sockfd);
+    if (SSL_connect(ssl) != 1) {
+        long result = SSL_get_verify_result(ssl);
+        std::cerr << "TLS handshake on " << what << " failed: "
+                  << (result != X509_V_OK ? X509_verify_cert_error_string(result)
+                                          : ERR_reason_error_string(ERR_get_error())) << '\n';
+        SSL_free(ssl);
         return false;
     }
+    std::lock_guard<std::mutex> lock(tls_mutex);
+    tls_sockets[sockfd] = ssl;
+    return true;
+}
 
-    // send command through control channel
-    send_message(control_sockfd, "LIST", path);
-    std::string response = read_response(control_sockfd);
-    int code = response_code(response);
-    if (code != CODE_STXFR) {
-        std::cerr << "Failed to start ls command " << response << '\n';
-        close(data_sockfd);
-        return false;
-    }
 
-    // receive file listing, then close data channel
-    char buffer[4096];
-    std::string listing;
-    ssize_t bytes_received;
-    while ((bytes_received = recv(data_sockfd, buffer, sizeof(buffer) - 1, 0)) > 0) {
-        listing.append(buffer, bytes_received);
+/**
+ * Secure a control connection with AUTH TLS, checking the server certificate against the host name.
+ * @return true if okay, false on error.
+ */
+static bool start_control_tls(int sockfd, const FTP& ftp) {
+    std::call_once(tls_once, make_tls_context);
+    if (!tls_context) {
+        std::cerr << "Failed to set up TLS\n";
+        return false;
     }
-    if (bytes_received < 0) {
-        std::cerr << "Data recv error\n";
-        close(data_sockfd);
+    send_message(sockfd, "AUTH", "TLS");
+    std::string response = read_response(sockfd);
+    if (response_code(response) != CODE_AUTHOK) {
+        std::cerr << "Server refuses AUTH TLS: " << response << '\n';
         return false;
     }
-    close(data_sockfd);
 
-    // check control channel status
-    response = read_response(control_sockfd);
-    if ((code = response_code(response)) != CODE_DSUCC) {
-        std::cerr << "Failed to finish ls command " << response << '\n';
+    SSL *ssl = SSL_new(tls_context);
+    unsigned char address[sizeof(struct in6_addr)];
+    bool numeric = inet_pton(AF_INET, ftp.host.c_str(), address) == 1 || inet_pton(AF_INET6, ftp.host.c_str(), address) == 1;
+    if (numeric) {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), ftp.host.c_str());
+    } else {
+        SSL_set_tlsext_host_name(ssl, ftp.host.c_str());
+        SSL_set1_host(ssl, ftp.host.c_str());
+    }
+    if (!tls_handshake(sockfd, ssl, "control connection")) {
         return false;
     }
-
-    std::cout << listing;
+    if (verbose) {
+        std::cout << "Control connection uses " << SSL_get_version(ssl) << " with " << SSL_get_cipher_name(ssl) << '\n';
+    }
     return true;
 }
 
 
-bool make_directory(int sockfd, const std::string& dir) {
-    send_message(sockfd, "MKD", dir);
-    std::string response = read_response(sockfd);
-    int code = response_code(response);
-    if (code != CODE_CRDIR) {
-        std::cerr << "Failed to create directory " << dir << '\n';
+/**
+ * Secure a data channel after the server has answered its transfer command with 150, if the control
+ * connection is secured. The channel resumes the control connection's session, which saves the
+ * certificate exchange and is what servers that check session reuse ask for.
+ * @return true if okay, false on error.
+ */
+static bool start_data_tls(int control_sockfd, int data_sockfd) {
+    SSL *control = tls_for(control_sockfd);
+    if (!control) {
+        return true;
+    }
+    SSL *ssl = SSL_new(tls_context);
+    SSL_clear_options(ssl, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    const char *name = SSL_get_servername(control, TLSEXT_NAMETYPE_host_name);
+    if (name) {
+        SSL_set_tlsext_host_name(ssl, name);
+    }
+    X509_VERIFY_PARAM_set1(SSL_get0_param(ssl), SSL_get0_param(control));
+    SSL_SESSION *session = SSL_get1_session(control);
+    if (session) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+    if (!tls_handshake(data_sockfd, ssl, "data channel")) {
         return false;
     }
     if (verbose) {
-        std::cout << "Created directory " << dir << '\n';
+        std::cout << "Data channel " << (SSL_session_reused(ssl) ? "resumed the TLS session" : "ran a full TLS handshake")
+                  << (BIO_get_ktls_send(SSL_get_wbio(ssl)) ? ", kernel TLS sends" : "") << '\n';
     }
     return true;
 }
 
 
-bool remove_directory(int sockfd, const std::string& dir) {
-    send_message(sockfd, "RMD", dir);
-    std::string response = read_response(sockfd);
-    int code = response_code(response);
-    if (code != CODE_FSUCC) {
-        std::cerr << "Failed to remove directory " << dir << '\n';
+bool pre_operation(int sockfd, const FTP& ftp) {
+    // read hello message from the FTP server, and secure the connection before the password goes out
+    if (!read_welcome(sockfd) || (tls && !start_control_tls(sockfd, ftp))) {
         return false;
     }
+    if (!pipeline) {
+        return login_strict(sockfd, ftp);
+    }
+
+    bool strict;
+    bool success = login_pipelined(sockfd, ftp, strict);
+    if (success || !strict) {
+        return success;
+    }
+
+    // the server dropped or mixed up pipelined commands: start over on a new connection under the
+    // same descriptor, and wait for every reply from now on
     if (verbose) {
-        std::cout << "Removed directory " << dir << '\n';
+        std::cout << "Server does not handle pipelined commands, logging in again one command at a time\n";
     }
-    return true;
+    pipeline = false;
+    int new_sockfd = open_clientfd(ftp.host, ftp.port);
+    if (new_sockfd < 0 || dup2(new_sockfd, sockfd) < 0) {
+        std::cerr << "Failed to connect to " << ftp.host << '\n';
+        return false;
+    }
+    close(new_sockfd);
+    reset_reader(sockfd);
+    tls_forget(sockfd, false);
+    return read_welcome(sockfd) && (!tls || start_control_tls(sockfd, ftp)) && login_strict(sockfd, ftp);
 }
 
 
-bool remove_file(int sockfd, const std::string& dir) {
-    send_message(sockfd, "DELE", dir);
-    std::string response = read_response(sockfd);
-    int code = response_code(response);
-    if (code != CODE_FSUCC) {
-        std::cerr << "Failed to remove file " << dir << '\n';
-        return false;
+/**
+ * Pick the checksum to verify files with: the server's HASH algorithm if it is one the client computes,
+ * then XCRC, then XMD5.
+ * @param hashes the HASH line of FEAT without "HASH ", e.g. "SHA-256*;MD5;CRC32"; empty if it is missing.
+ */
+static void choose_checksum(std::string_view hashes, bool xcrc, bool xmd5) {
+    // HASH answers in the selected algorithm, marked with '*'; the first one if none is marked
+    std::string_view selected = hashes.substr(0, hashes.find(';'));
+    for (size_t start = 0, end; start < hashes.length(); start = end + 1) {
+        end = std::min(hashes.find(';', start), hashes.length());
+        if (hashes.substr(start, end - start).ends_with('*')) {
+            selected = hashes.substr(start, end - start);
+        }
     }
-    if (verbose) {
-        std::cout << "Removed file " << dir << '\n';
+    std::string algorithm(selected.substr(0, selected.find('*')));
+    std::transform(algorithm.begin(), algorithm.end(), algorithm.begin(), ::toupper);
+    if (algorithm == "CRC32" || algorithm == "MD5" || algorithm == "SHA-1" || algorithm == "SHA-256"
+        || algorithm == "SHA-512") {
+        checksum_command = "HASH";
+        checksum_algorithm = algorithm;
+    } else if (xcrc) {
+        checksum_command = "XCRC";
+        checksum_algorithm = "CRC32";
+    } else if (xmd5) {
+        checksum_command = "XMD5";
+        checksum_algorithm = "MD5";
     }
-    return true;
 }
 
 
-bool upload_file(int control_sockfd, std::string& local_path, std::string& remote_path) {
-    // handle remote file name
+/**
+ * Ask the server for its features with FEAT: whether MODE Z is among them, and which checksum it answers.
+ */
+static void check_features(int sockfd) {
+    send_message(sockfd, "FEAT");
+    Reply reply = read_reply(sockfd);
+    if (reply_code(reply) != CODE_FEATS) {
+        if (verbose && mode_z) {
+            std::cout << "Server does not answer FEAT, sending files uncompressed\n";
+        }
+        if (verify) {
+            std::cerr << "Server does not answer FEAT, files are not verified\n";
+        }
+        return;
+    }
+    // one feature per line, each indented by a space: " MODE Z"
+    std::string_view text = reply.text;
+    std::string_view hashes;
+    bool xcrc = false, xmd5 = false;
+    for (size_t start = 0, end; start < text.length(); start = end + 1) {
+        end = std::min(text.find('\n', start), text.length());
+        std::string_view line = text.substr(start, end - start);
+        size_t first = line.find_first_not_of(' ');
+        size_t last = line.find_last_not_of(" \r");
+        std::string_view feature = first == std::string_view::npos ? "" : line.substr(first, last - first + 1);
+        if (feature.length() == 6 && strncasecmp(feature.data(), "MODE Z", 6) == 0) {
+            mode_z_supported = true;
+        } else if (feature.length() > 5 && strncasecmp(feature.data(), "HASH ", 5) == 0) {
+            hashes = feature.substr(5);
+        } else if (feature.length() == 4 && strncasecmp(feature.data(), "XCRC", 4) == 0) {
+            xcrc = true;
+        } else if (feature.length() == 4 && strncasecmp(feature.data(), "XMD5", 4) == 0) {
+            xmd5 = true;
+        }
+    }
+    choose_checksum(hashes, xcrc, xmd5);
+    if (verbose && mode_z && !mode_z_supported) {
+        std::cout << "Server does not list MODE Z, sending files uncompressed\n";
+    }
+    if (verify && checksum_command.empty()) {
+        std::cerr << "Server has no HASH, XCRC, or XMD5, files are not verified\n";
+    } else if (verbose && verify) {
+        std::cout << "Verifying files with " << checksum_command << " (" << checksum_algorithm << ")\n";
+    }
+}
+
+
+/**
+ * Switch a control connection between MODE S and MODE Z, sending MODE only when the mode changes.
+ * @param deflate the mode wanted, true for MODE Z; cleared if the server refuses MODE Z.
+ * @return false if the server refuses to go back to MODE S, true otherwise.
+ */
+static bool set_mode(int sockfd, bool& deflate) {
+    {
+        std::lock_guard<std::mutex> lock(mode_mutex);
+        if (deflating.contains(sockfd) == deflate) {
+            return true;
+        }
+    }
+    send_message(sockfd, "MODE", deflate ? "Z" : "S");
+    std::string response = read_response(sockfd);
+    if (response_code(response) != CODE_CMPLT) {
+        if (!deflate) {
+            std::cerr << "Mode command error: " << response << '\n';
+            return false;
+        }
+        if (verbose) {
+            std::cout << "Server refuses MODE Z, sending files uncompressed\n";
+        }
+        mode_z_supported = false;
+        deflate = false;
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(mode_mutex);
+    if (deflate) {
+        deflating.insert(sockfd);
+    } else {
+        deflating.erase(sockfd);
+    }
+    return true;
+}
+
+
+int open_session(const FTP& ftp) {
+    Metrics metrics;
+    metrics.kind = "session";
+    metrics.path = ftp.host + ":" + ftp.port;
+    auto step = std::chrono::steady_clock::now();
+    int sockfd = open_clientfd(ftp.host, ftp.port);
+    if (sockfd < 0) {
+        std::cerr << "Failed to connect to " << ftp.host << '\n';
+        record_metrics(metrics);
+        return -1;
+    }
+    metrics.connect_ms = elapsed_ms(step);
+
+    step = std::chrono::steady_clock::now();
+    metrics.success = pre_operation(sockfd, ftp);
+    if (metrics.success && (mode_z || verify)) {
+        std::call_once(features_once, check_features, sockfd);
+    }
+    metrics.login_ms = elapsed_ms(step);
+    record_metrics(metrics);
+    if (!metrics.success) {
+        close(sockfd);
+        return -1;
+    }
+    // sessions of one user on one server share their cached listings
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    sites[sockfd] = ftp.username + "@" + ftp.host + ":" + ftp.port;
+    return sockfd;
+}
+
+
+/**
+ * Read a run of decimal digits.
+ * @return true if there is at least one digit and the value is at most limit.
+ */
+static bool parse_number(std::string_view msg, size_t& pos, int limit, int& value) {
+    size_t start = pos;
+    value = 0;
+    while (pos < msg.length() && isdigit(static_cast<unsigned char>(msg[pos]))) {
+        value = value * 10 + (msg[pos++] - '0');
+        if (value > limit) {
+            return false;
+        }
+    }
+    return pos > start;
+}
+
+
+bool parse_pasv_response(std::string_view msg, Endpoint& endpoint) {
+    // the first `(h1,h2,h3,h4,p1,p2)` in the reply
+    for (size_t open = msg.find('('); open != std::string_view::npos; open = msg.find('(', open + 1)) {
+        int numbers[6];
+        size_t pos = open + 1;
+        int i = 0;
+        for (; i < 6; i++) {
+            if (!parse_number(msg, pos, 255, numbers[i]) || pos >= msg.length() || msg[pos++] != (i < 5 ? ',' : ')')) {
+                break;
+            }
+        }
+        if (i == 6) {
+            snprintf(endpoint.host, sizeof(endpoint.host), "%d.%d.%d.%d", numbers[0], numbers[1], numbers[2], numbers[3]);
+            snprintf(endpoint.port, sizeof(endpoint.port), "%hu", static_cast<unsigned short>((numbers[4] << 8) + numbers[5]));
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool parse_epsv_response(std::string_view msg, Endpoint& endpoint) {
+    // `(<d><d><d>port<d>)`, where the delimiter d is any printable character, usually '|'
+    size_t open = msg.find('(');
+    if (open == std::string_view::npos || open + 5 >= msg.length()) {
+        return false;
+    }
+    char delimiter = msg[open + 1];
+    if (msg[open + 2] != delimiter || msg[open + 3] != delimiter) {
+        return false;
+    }
+    size_t pos = open + 4;
+    int port;
+    if (!parse_number(msg, pos, 65535, port) || pos + 1 >= msg.length() || msg[pos] != delimiter || msg[pos + 1] != ')') {
+        return false;
+    }
+    snprintf(endpoint.port, sizeof(endpoint.port), "%hu", static_cast<unsigned short>(port));
+    return true;
+}
+
+
+/**
+ * Send EPSV, or PASV once the server has refused EPSV.
+ * @return true if EPSV was sent.
+ */
+static bool send_passive(int control_sockfd) {
+    bool extended = epsv_supported;
+    send_message(control_sockfd, extended ? "EPSV" : "PASV");
+    return extended;
+}
+
+
+/**
+ * Fill in the host of an endpoint with the numeric address of the peer of a connected socket.
+ * @return true if okay, false on error.
+ */
+static bool peer_host(int sockfd, Endpoint& endpoint) {
+    struct sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+    return getpeername(sockfd, reinterpret_cast<struct sockaddr *>(&peer), &length) == 0
+           && getnameinfo(reinterpret_cast<struct sockaddr *>(&peer), length, endpoint.host, sizeof(endpoint.host),
+                          nullptr, 0, NI_NUMERICHOST) == 0;
+}
+
+
+/**
+ * Read the reply to EPSV or PASV and work out the address of the data connection.
+ * EPSV leaves the address out, the data connection goes to the host of the control connection.
+ * @return 1 if okay, 0 if the server does not know EPSV, -1 on error.
+ */
+static int read_passive(int control_sockfd, bool extended, Endpoint& endpoint) {
+    Reply reply = read_reply(control_sockfd);
+    int code = reply_code(reply);
+    if (extended) {
+        if (code == CODE_EPSVM && parse_epsv_response(reply.line, endpoint) && peer_host(control_sockfd, endpoint)) {
+            return 1;
+        }
+        if (code == CODE_NOCMD || code == CODE_NOIMP) {
+            epsv_supported = false;
+            return 0;
+        }
+        std::cerr << "Entering extended passive mode error: " << reply.line << '\n';
+        return -1;
+    }
+
+    if (code != CODE_PSVMD) {
+        std::cerr << "Entering passive mode error: " << reply.line << '\n';
+        return -1;
+    }
+    if (!parse_pasv_response(reply.line, endpoint)) {
+        std::cerr << "Failed to parse PASV response: " << reply.line << '\n';
+        return -1;
+    }
+    return 1;
+}
+
+
+/**
+ * Start connecting to a numeric address without waiting for the handshake.
+ * @return the socket descriptor, or -1 on error.
+ */
+static int connect_nonblocking(const Endpoint& endpoint) {
+    struct addrinfo hints, *addr;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    if (getaddrinfo(endpoint.host, endpoint.port, &hints, &addr) != 0) {
+        return -1;
+    }
+    int sockfd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (sockfd >= 0) {
+        tls_forget(sockfd, false);
+        fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+        if (connect(sockfd, addr->ai_addr, addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            close(sockfd);
+            sockfd = -1;
+        }
+    }
+    freeaddrinfo(addr);
+    return sockfd;
+}
+
+
+void request_data_channel(int control_sockfd) {
+    {
+        std::lock_guard<std::mutex> lock(prefetch_mutex);
+        if (prefetched.contains(control_sockfd)) {
+            return;
+        }
+    }
+    bool extended = send_passive(control_sockfd);
+    std::lock_guard<std::mutex> lock(prefetch_mutex);
+    prefetched[control_sockfd] = {true, extended, -1};
+}
+
+
+void settle_data_channel(int control_sockfd) {
+    Prefetch request;
+    {
+        std::lock_guard<std::mutex> lock(prefetch_mutex);
+        auto found = prefetched.find(control_sockfd);
+        if (found == prefetched.end() || !found->second.requested) {
+            return;
+        }
+        request = found->second;
+        found->second.requested = false;
+    }
+
+    // the handshake runs on while the caller sends its next command
+    Endpoint endpoint;
+    int data_sockfd = read_passive(control_sockfd, request.extended, endpoint) > 0 ? connect_nonblocking(endpoint) : -1;
+    std::lock_guard<std::mutex> lock(prefetch_mutex);
+    prefetched[control_sockfd].data_sockfd = data_sockfd;
+}
+
+
+/**
+ * Take the prefetched data channel of a control connection, waiting for its handshake to finish.
+ * @return the socket descriptor of the data channel, or -1 if there is none or it failed.
+ */
+static int take_data_channel(int control_sockfd) {
+    settle_data_channel(control_sockfd);
+    int data_sockfd;
+    {
+        std::lock_guard<std::mutex> lock(prefetch_mutex);
+        auto found = prefetched.find(control_sockfd);
+        if (found == prefetched.end()) {
+            return -1;
+        }
+        data_sockfd = found->second.data_sockfd;
+        prefetched.erase(found);
+    }
+    if (data_sockfd < 0) {
+        return -1;
+    }
+
+    struct pollfd pfd = {data_sockfd, POLLOUT, 0};
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (poll(&pfd, 1, PIPELINE_TIMEOUT) <= 0
+        || getsockopt(data_sockfd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+        close(data_sockfd);
+        return -1;
+    }
+    fcntl(data_sockfd, F_SETFL, fcntl(data_sockfd, F_GETFL) & ~O_NONBLOCK);
+    if (verbose) {
+        std::cout << "Using prefetched data channel\n";
+    }
+    return data_sockfd;
+}
+
+
+int open_data_channel(int control_sockfd) {
+    int data_sockfd = take_data_channel(control_sockfd);
+    if (data_sockfd >= 0) {
+        return data_sockfd;
+    }
+
+    Endpoint endpoint;
+    int result;
+    while ((result = read_passive(control_sockfd, send_passive(control_sockfd), endpoint)) == 0) {
+        // the server does not know EPSV, ask again with PASV
+        ;
+    }
+    if (result < 0) {
+        return -1;
+    }
+
+    data_sockfd = open_clientfd(endpoint.host, endpoint.port);
+    if (data_sockfd < 0) {
+        std::cerr << "Failed to open data channel\n";
+        return -1;
+    }
+    return data_sockfd;
+}
+
+
+bool fetch_listing(int control_sockfd, const std::string& cmd, const std::string& path,
+                   const std::function<void(const std::string&)>& on_line, int *reply) {
+    // listings are read as plain text, so a connection left in MODE Z by a transfer goes back to MODE S
+    bool deflate = false;
+    if (!set_mode(control_sockfd, deflate)) {
+        return false;
+    }
+
+    // open data channel for file transfer
+    int data_sockfd;
+    if ((data_sockfd = open_data_channel(control_sockfd)) < 0) {
+        return false;
+    }
+
+    // send command through control channel
+    send_message(control_sockfd, cmd, path);
+    std::string response = read_response(control_sockfd);
+    int code = response_code(response);
+    if (reply) {
+        *reply = code;
+    }
+    if (code != CODE_STXFR) {
+        // a caller asking for the code handles unknown commands itself
+        if (!reply || (code != CODE_NOCMD && code != CODE_NOIMP)) {
+            std::cerr << "Failed to start ls command " << response << '\n';
+        }
+        close_channel(data_sockfd);
+        return false;
+    }
+    if (!start_data_tls(control_sockfd, data_sockfd)) {
+        // the server gives up on the transfer and says so on the control connection
+        close_channel(data_sockfd);
+        read_response(control_sockfd);
+        return false;
+    }
+
+    // receive file listing line by line, so a long one is parsed while the rest arrives
+    Tuner tuner;
+    start_tuning(tuner, data_sockfd, false);
+    std::vector<char> buffer(tuner.chunk);
+    std::string partial;
+    ssize_t bytes_received;
+    while ((bytes_received = channel_recv(data_sockfd, buffer.data(), buffer.size())) > 0) {
+        partial.append(buffer.data(), bytes_received);
+        size_t start = 0, end;
+        while ((end = partial.find('\n', start)) != std::string::npos) {
+            size_t length = end - start - (end > start && partial[end - 1] == '\r' ? 1 : 0);
+            on_line(partial.substr(start, length));
+            start = end + 1;
+        }
+        partial.erase(0, start);
+        tune_transfer(tuner, bytes_received);
+        buffer.resize(tuner.chunk);
+    }
+    if (bytes_received == 0 && !partial.empty()) {
+        // the last line of some servers has no line ending
+        if (partial.back() == '\r') {
+            partial.pop_back();
+        }
+        on_line(partial);
+    }
+    if (bytes_received < 0) {
+        std::cerr << "Data recv error\n";
+        close_channel(data_sockfd);
+        return false;
+    }
+    close_channel(data_sockfd);
+    if (prefetch) {
+        request_data_channel(control_sockfd);
+    }
+
+    // check control channel status
+    response = read_response(control_sockfd);
+    if ((code = response_code(response)) != CODE_DSUCC) {
+        std::cerr << "Failed to finish ls command " << response << '\n';
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Build the cache key of a remote directory: the site of the control connection and the path
+ * without trailing slashes. The caller holds cache_mutex.
+ * @return the key, or an empty string if the connection is not a logged-in session.
+ */
+static std::string listing_key(int sockfd, std::string path) {
+    auto site = sites.find(sockfd);
+    if (site == sites.end()) {
+        return "";
+    }
+    while (path.length() > 1 && path.back() == '/') {
+        path.pop_back();
+    }
+    // an empty path is the login directory, which is not necessarily the root
+    return site->second + (path.empty() ? "." : path);
+}
+
+
+/**
+ * Write a whole buffer to a file descriptor.
+ * @return true if every byte is written, false on error.
+ */
+static bool write_all(int fd, const char *buffer, size_t length) {
+    size_t total = 0;
+    ssize_t written;
+    while (total < length) {
+        if ((written = write(fd, buffer + total, length - total)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error writing file: " << strerror(errno) << '\n';
+            return false;
+        }
+        total += written;
+    }
+    return true;
+}
+
+
+/**
+ * Format one entry line of the cache file.
+ */
+static std::string entry_record(const Entry& entry) {
+    return "E " + std::string(1, entry.directory ? 'd' : 'f') + ' ' + std::to_string(entry.size) + ' '
+           + std::to_string(entry.modified) + ' ' + entry.name + '\n';
+}
+
+
+/**
+ * Format one listing for the cache file.
+ */
+static std::string listing_records(const std::string& key, const Listing& listing) {
+    // `L FETCHED EXACT KEY`, then `E TYPE SIZE MODIFIED NAME` per entry; `A KEY` and one `E` line
+    // add or replace an entry, and `X KEY` drops a listing
+    std::string records = "L " + std::to_string(listing.fetched) + ' ' + std::to_string(listing.exact) + ' ' + key + '\n';
+    for (const Entry& entry : listing.entries) {
+        records += entry_record(entry);
+    }
+    return records;
+}
+
+
+/**
+ * Append records to the cache file, if one is open, in one write under its lock, so runs sharing the
+ * file never interleave their records. If another run has rewritten the file since, the new one is
+ * opened first. The caller holds cache_mutex.
+ */
+static void append_cache(const std::string& records) {
+    if (cache_fd < 0 || flock(cache_lockfd, LOCK_EX) < 0) {
+        return;
+    }
+    struct stat ours, current;
+    if (fstat(cache_fd, &ours) == 0
+        && (stat(cache_path.c_str(), &current) < 0 || current.st_ino != ours.st_ino || current.st_dev != ours.st_dev)) {
+        int fd = open(cache_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            close(cache_fd);
+            cache_fd = fd;
+        }
+    }
+    write_all(cache_fd, records.data(), records.length());
+    flock(cache_lockfd, LOCK_UN);
+}
+
+
+/**
+ * Remember the entries of a remote directory, replacing what was cached for it.
+ */
+static void store_listing(int sockfd, const std::string& path, const std::vector<Entry>& entries, bool exact) {
+    if (cache_ttl <= 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    std::string key = listing_key(sockfd, path);
+    if (key.empty()) {
+        return;
+    }
+    Listing& listing = listings[key];
+    listing = {time(nullptr), exact, entries};
+    append_cache(listing_records(key, listing));
+}
+
+
+/**
+ * Find the cached listing of a remote directory if it is younger than --cache-ttl.
+ * The caller holds cache_mutex.
+ * @return the listing, or nullptr if there is none.
+ */
+static const Listing *fresh_listing(int sockfd, const std::string& path) {
+    auto found = listings.find(listing_key(sockfd, path));
+    if (found == listings.end() || time(nullptr) - found->second.fetched >= cache_ttl) {
+        return nullptr;
+    }
+    return &found->second;
+}
+
+
+/**
+ * Append the cached entries of a remote directory, if a fresh listing with the details asked for is cached.
+ * @return true if the cache has it, false if it has to be fetched.
+ */
+static bool cached_listing(int sockfd, const std::string& path, bool exact, std::vector<Entry>& entries) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    const Listing *listing = fresh_listing(sockfd, path);
+    if (!listing || (exact && !listing->exact)) {
+        return false;
+    }
+    entries.insert(entries.end(), listing->entries.begin(), listing->entries.end());
+    if (verbose) {
+        std::cout << "Cached listing of " << path << '\n';
+    }
+    return true;
+}
+
+
+/**
+ * Look up a remote path in the cached listing of its directory.
+ * @param exact only answer from a listing with exact sizes and times, unless the path is missing from it.
+ * @return 1 and the entry if it is listed, 0 if the listing shows it does not exist, -1 if the cache cannot tell.
+ */
+static int cached_entry(int sockfd, const std::string& path, bool exact, Entry& entry) {
+    std::string::size_type slash = path.find_last_of('/');
+    std::string name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+    std::string dir = slash == std::string::npos ? "" : slash == 0 ? "/" : path.substr(0, slash);
+    if (name.empty()) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    const Listing *listing = fresh_listing(sockfd, dir);
+    if (!listing) {
+        return -1;
+    }
+    auto found = std::find_if(listing->entries.begin(), listing->entries.end(),
+                              [&](const Entry& item) { return item.name == name; });
+    if (found == listing->entries.end()) {
+        return 0;
+    }
+    if (exact && !listing->exact) {
+        return -1;
+    }
+    entry = *found;
+    return 1;
+}
+
+
+void forget_listing(int sockfd, const std::string& path) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    std::string::size_type slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "" : slash == 0 ? "/" : path.substr(0, slash);
+    for (const std::string& key : {listing_key(sockfd, path), listing_key(sockfd, dir)}) {
+        if (!key.empty() && listings.erase(key) > 0) {
+            append_cache("X " + key + '\n');
+        }
+    }
+}
+
+
+/**
+ * Add an entry to a listing, or replace the one of the same name.
+ */
+static void amend_listing(Listing& listing, const Entry& entry) {
+    auto found = std::find_if(listing.entries.begin(), listing.entries.end(),
+                              [&](const Entry& item) { return item.name == entry.name; });
+    if (found == listing.entries.end()) {
+        listing.entries.push_back(entry);
+    } else {
+        *found = entry;
+    }
+}
+
+
+void note_upload(int sockfd, const std::string& path, long long size) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    std::string::size_type slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "" : slash == 0 ? "/" : path.substr(0, slash);
+    std::string key = listing_key(sockfd, dir);
+    auto found = listings.find(key);
+    if (key.empty() || found == listings.end()) {
+        return;
+    }
+    // the server stamps the file as it arrives, so now stands in for its time; a sync comparing
+    // against it sees the file as no older than its source
+    Entry entry;
+    entry.name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+    entry.size = size;
+    entry.modified = time(nullptr);
+    amend_listing(found->second, entry);
+    append_cache("A " + key + '\n' + entry_record(entry));
+}
+
+
+bool open_listing_cache(const std::string& path) {
+    // other runs sharing the file wait while it is read and rewritten, as with the priors of the wordle client
+    std::string lock_file = path + ".lock";
+    cache_lockfd = open(lock_file.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (cache_lockfd < 0 || flock(cache_lockfd, LOCK_EX) < 0) {
+        std::cerr << "Failed to lock cache file " << path << '\n';
+        return false;
+    }
+    std::ifstream previous(path);
+    std::string line, key;
+    bool amending = false;
+    while (std::getline(previous, line)) {
+        // the last record of a directory wins, like in the journal
+        std::istringstream fields(line);
+        std::string tag;
+        fields >> tag;
+        if (tag == "L") {
+            Listing listing;
+            if (fields >> listing.fetched >> listing.exact && fields.ignore(1) && std::getline(fields, key)) {
+                listings[key] = listing;
+                amending = false;
+            }
+        } else if (tag == "A" && fields.ignore(1) && std::getline(fields, key)) {
+            amending = true;
+        } else if (tag == "E") {
+            Entry entry;
+            char type;
+            auto found = listings.find(key);
+            if (fields >> type >> entry.size >> entry.modified && fields.ignore(1) && std::getline(fields, entry.name)
+                && found != listings.end()) {
+                entry.directory = type == 'd';
+                if (amending) {
+                    amend_listing(found->second, entry);
+                } else {
+                    found->second.entries.push_back(entry);
+                }
+            }
+        } else if (tag == "X" && fields.ignore(1) && std::getline(fields, key)) {
+            listings.erase(key);
+            key.clear();
+        }
+    }
+    previous.close();
+
+    // rewrite the file with only the listings still fresh, so it does not grow run after run; a new
+    // file renamed over the old one never leaves a reader with half of it
+    time_t now = time(nullptr);
+    std::erase_if(listings, [&](const auto& item) { return now - item.second.fetched >= cache_ttl; });
+    std::string temp_file = path + ".tmp";
+    std::ofstream rewritten(temp_file, std::ios::trunc);
+    for (const auto& [site_path, listing] : listings) {
+        rewritten << listing_records(site_path, listing);
+    }
+    rewritten.close();
+    if (!rewritten || rename(temp_file.c_str(), path.c_str()) < 0
+        || (cache_fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        std::cerr << "Failed to open cache file " << path << '\n';
+        flock(cache_lockfd, LOCK_UN);
+        return false;
+    }
+    flock(cache_lockfd, LOCK_UN);
+    return true;
+}
+
+
+bool list_directory(int control_sockfd, const std::string& path) {
+    std::vector<Entry> entries;
+    Entry entry;
+    auto on_line = [&](const std::string& line) {
+        std::cout << line << '\n';
+        if (parse_list_line(line, entry)) {
+            entries.push_back(entry);
+        }
+    };
+    if (!fetch_listing(control_sockfd, "LIST", path, on_line)) {
+        return false;
+    }
+    // LIST of a file lists just that file, which says nothing about a directory
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    if (entries.size() != 1 || entries[0].directory || (entries[0].name != name && entries[0].name != path)) {
+        store_listing(control_sockfd, path, entries, false);
+    }
+    return true;
+}
+
+
+bool parse_list_line(const std::string& line, Entry& entry) {
+    // Unix format: permissions, links, owner, group, size, month, day, time or year, name
+    std::istringstream fields(line);
+    std::string permissions, links, owner, group, size, month, day, time;
+    if (!(fields >> permissions >> links >> owner >> group >> size >> month >> day >> time)) {
+        return false;
+    }
+    std::string name;
+    std::getline(fields >> std::ws, name);
+    if (!name.empty() && name.back() == '\r') {
+        name.pop_back();
+    }
+    if (name.empty() || name == "." || name == ".." || (permissions[0] != 'd' && permissions[0] != '-')) {
+        return false;
+    }
+
+    entry.name = name;
+    entry.directory = permissions[0] == 'd';
+    entry.size = std::all_of(size.begin(), size.end(), ::isdigit) ? std::stoll(size) : -1;
+    return true;
+}
+
+
+time_t parse_time_value(const std::string& value) {
+    // YYYYMMDDHHMMSS, optionally followed by fractions of a second, always in UTC
+    if (value.length() < 14 || !std::all_of(value.begin(), value.begin() + 14, ::isdigit)) {
+        return -1;
+    }
+    struct tm time = {};
+    time.tm_year = std::stoi(value.substr(0, 4)) - 1900;
+    time.tm_mon = std::stoi(value.substr(4, 2)) - 1;
+    time.tm_mday = std::stoi(value.substr(6, 2));
+    time.tm_hour = std::stoi(value.substr(8, 2));
+    time.tm_min = std::stoi(value.substr(10, 2));
+    time.tm_sec = std::stoi(value.substr(12, 2));
+    return timegm(&time);
+}
+
+
+time_t remote_mtime(int sockfd, const std::string& path) {
+    Entry entry;
+    int cached = cached_entry(sockfd, path, true, entry);
+    if (cached == 0) {
+        return -1;
+    }
+    if (cached > 0 && !entry.directory && entry.modified > 0) {
+        return entry.modified;
+    }
+    send_message(sockfd, "MDTM", path);
+    std::string response = read_response(sockfd);
+    if (response_code(response) != CODE_FSTAT || response.length() < 5) {
+        return -1;
+    }
+    return parse_time_value(response.substr(4));
+}
+
+
+bool parse_mlsd_line(const std::string& line, Entry& entry) {
+    // facts separated by ';', then a space and the name: `type=file;size=42;modify=20240101120000; name`
+    std::string::size_type space = line.find(' ');
+    if (space == std::string::npos) {
+        return false;
+    }
+    std::string name = line.substr(space + 1);
+    if (!name.empty() && name.back() == '\r') {
+        name.pop_back();
+    }
+
+    entry = Entry();
+    entry.name = name;
+    bool typed = false;
+    std::istringstream facts(line.substr(0, space));
+    std::string fact;
+    while (std::getline(facts, fact, ';')) {
+        std::string::size_type equal = fact.find('=');
+        if (equal == std::string::npos) {
+            continue;
+        }
+        std::string key = fact.substr(0, equal);
+        std::string value = fact.substr(equal + 1);
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+        if (key == "type") {
+            // cdir and pdir are the directory itself and its parent
+            if (value != "file" && value != "dir") {
+                return false;
+            }
+            entry.directory = value == "dir";
+            typed = true;
+        } else if (key == "size" && !value.empty() && std::all_of(value.begin(), value.end(), ::isdigit)) {
+            entry.size = std::stoll(value);
+        } else if (key == "modify") {
+            entry.modified = parse_time_value(value);
+        }
+    }
+    return typed && !name.empty();
+}
+
+
+bool list_entries(int control_sockfd, const std::string& path, std::vector<Entry>& entries, bool details) {
+    if (cached_listing(control_sockfd, path, details, entries)) {
+        return true;
+    }
+    Entry entry;
+    size_t first = entries.size();
+
+    // MLSD has a fixed format with exact sizes and UTC times
+    if (mlsd_supported) {
+        int code = 0;
+        auto on_line = [&](const std::string& line) {
+            if (parse_mlsd_line(line, entry)) {
+                entries.push_back(entry);
+            }
+        };
+        if (fetch_listing(control_sockfd, "MLSD", path, on_line, &code)) {
+            store_listing(control_sockfd, path, {entries.begin() + first, entries.end()}, true);
+            return true;
+        }
+        // a listing that broke off may have delivered part of its entries
+        entries.resize(first);
+        if (code != CODE_NOCMD && code != CODE_NOIMP) {
+            return false;
+        }
+        mlsd_supported = false;
+    }
+
+    auto on_line = [&](const std::string& line) {
+        if (parse_list_line(line, entry)) {
+            entries.push_back(entry);
+        }
+    };
+    if (!fetch_listing(control_sockfd, "LIST", path, on_line)) {
+        entries.resize(first);
+        return false;
+    }
+    // LIST times are local to the server and often lack the year, ask for each file instead
+    if (details) {
+        for (size_t i = first; i < entries.size(); i++) {
+            if (!entries[i].directory) {
+                std::string file = path + (path.back() == '/' ? "" : "/") + entries[i].name;
+                entries[i].size = remote_size(control_sockfd, file);
+                entries[i].modified = remote_mtime(control_sockfd, file);
+            }
+        }
+    }
+    store_listing(control_sockfd, path, {entries.begin() + first, entries.end()}, details);
+    return true;
+}
+
+
+/**
+ * Join a directory path and a name with exactly one '/' between them.
+ */
+static std::string join_path(const std::string& dir, const std::string& name) {
+    if (dir.empty() || dir.back() == '/') {
+        return dir + name;
+    }
+    return dir + "/" + name;
+}
+
+
+bool run_transfers(int control_sockfd, const FTP& ftp, std::vector<Transfer>& transfers, int sessions) {
+    // smallest files first; one session works from the other end so a large file
+    // never holds up the many small ones behind it
+    std::sort(transfers.begin(), transfers.end(), [](const Transfer& a, const Transfer& b) {
+        return a.size < b.size;
+    });
+    sessions = std::max(1, std::min(sessions, static_cast<int>(transfers.size())));
+#ifdef __linux__
+    // the engine has no resume, MODE Z, checksums, or TLS, so jobs that use them keep their threads
+    if (!threaded && !resume && !mode_z && !verify && !tls) {
+        bool success = run_engine(control_sockfd, ftp, transfers, sessions);
+        // the engine stores files without upload_file, which keeps the cached listings current itself
+        for (const Transfer& transfer : transfers) {
+            if (transfer.download) {
+                continue;
+            }
+            if (transfer.done) {
+                note_upload(control_sockfd, transfer.remote_path, transfer.size);
+            } else {
+                forget_listing(control_sockfd, transfer.remote_path);
+            }
+        }
+        return success;
+    }
+#endif
+
+    std::mutex queue_mutex;
+    size_t front = 0, back = transfers.size();
+    std::atomic<int> failures = 0;
+
+    auto worker = [&](int sockfd, bool largest_first) {
+        while (true) {
+            Transfer *transfer;
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                if (front == back) {
+                    return;
+                }
+                transfer = largest_first ? &transfers[--back] : &transfers[front++];
+            }
+            std::string local_path = transfer->local_path;
+            std::string remote_path = transfer->remote_path;
+            bool success = transfer->download ? download_file(sockfd, remote_path, local_path, transfer->size)
+                                              : upload_file(sockfd, local_path, remote_path);
+            if (!success) {
+                failures++;
+            }
+            transfer->done = success;
+        }
+    };
+
+    // the first session is the one already logged in, the others log in on their own connection
+    std::vector<std::thread> workers;
+    for (int k = 1; k < sessions; k++) {
+        workers.emplace_back([&, k]() {
+            int sockfd = open_session(ftp);
+            if (sockfd < 0) {
+                return;
+            }
+            worker(sockfd, k == 1);
+            quit_connection(sockfd);
+            close(sockfd);
+        });
+    }
+    worker(control_sockfd, false);
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+    return failures == 0;
+}
+
+
+#ifdef __linux__
+/**
+ * Register, change, or remove the events epoll reports for one descriptor of a session.
+ * The key carries the session index, whether it is the data channel, and the data channel's generation.
+ */
+static void watch(Engine& engine, int op, size_t index, bool data, uint32_t events) {
+    Session& session = engine.sessions[index];
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.u64 = static_cast<uint64_t>(data ? session.generation : 0) << 32 | index << 1 | (data ? 1 : 0);
+    epoll_ctl(engine.epfd, op, data ? session.data_sockfd : session.control_sockfd, &event);
+}
+
+
+/**
+ * Send as much of a session's pending commands as the control connection takes without blocking,
+ * and wait for it to take more if some are left. An error shows up as a failed read later.
+ */
+static void flush_commands(Engine& engine, size_t index) {
+    Session& session = engine.sessions[index];
+    size_t total = 0;
+    ssize_t bytes_sent;
+    while (total < session.outbox.length()) {
+        if ((bytes_sent = send(session.control_sockfd, session.outbox.data() + total,
+                               session.outbox.length() - total, MSG_NOSIGNAL)) < 0) {
+            break;
+        }
+        total += bytes_sent;
+    }
+    session.outbox.erase(0, total);
+    bool writing = !session.outbox.empty();
+    if (writing != session.writing) {
+        session.writing = writing;
+        watch(engine, EPOLL_CTL_MOD, index, false, EPOLLIN | (writing ? EPOLLOUT : 0));
+    }
+}
+
+
+static void queue_command(Engine& engine, size_t index, const std::string& msg) {
+    if (verbose) {
+        trace_commands(msg);
+    }
+    engine.sessions[index].outbox += msg;
+    flush_commands(engine, index);
+}
+
+
+static void close_data(Engine& engine, size_t index) {
+    Session& session = engine.sessions[index];
+    if (session.data_sockfd >= 0) {
+        watch(engine, EPOLL_CTL_DEL, index, true, 0);
+        close(session.data_sockfd);
+        session.data_sockfd = -1;
+    }
+    session.data_done = true;
+}
+
+
+/**
+ * Take the next file off the shared queue and open its local side.
+ * @param request send EPSV or PASV for it, otherwise the request is already on its way.
+ * @return true if the session has a transfer, false if the queue is empty.
+ */
+static bool begin_transfer(Engine& engine, size_t index, bool request) {
+    Session& session = engine.sessions[index];
+    session.transfer = nullptr;
+    while (engine.front < engine.back) {
+        Transfer *transfer = session.largest_first ? &(*engine.transfers)[--engine.back]
+                                                   : &(*engine.transfers)[engine.front++];
+        int fd = transfer->download ? open(transfer->local_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                                    : open(transfer->local_path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Failed to open local file " << transfer->local_path << '\n';
+            continue;
+        }
+        session.transfer = transfer;
+        session.fd = fd;
+        session.data_connected = session.data_done = session.reply_done = session.failed = false;
+        session.metrics = Metrics();
+        session.metrics.kind = transfer->download ? "download" : "upload";
+        session.metrics.path = transfer->remote_path;
+        if (request) {
+            session.passive_sent = std::chrono::steady_clock::now();
+            queue_command(engine, index, session.extended ? "EPSV\r\n" : "PASV\r\n");
+        }
+        return true;
+    }
+    return false;
+}
+
+
+/**
+ * Close whatever a session still holds and take it out of the engine. The adopted session
+ * goes back to blocking mode instead of being closed.
+ */
+static void end_session(Engine& engine, size_t index) {
+    Session& session = engine.sessions[index];
+    if (session.step == Step::Done) {
+        return;
+    }
+    close_data(engine, index);
+    if (session.fd >= 0) {
+        close(session.fd);
+        session.fd = -1;
+    }
+    if (session.transfer) {
+        record_metrics(session.metrics);
+    }
+    session.transfer = nullptr;
+    watch(engine, EPOLL_CTL_DEL, index, false, 0);
+    if (session.adopted) {
+        fcntl(session.control_sockfd, F_SETFL, fcntl(session.control_sockfd, F_GETFL) & ~O_NONBLOCK);
+    } else {
+        close(session.control_sockfd);
+    }
+    session.step = Step::Done;
+    engine.active--;
+}
+
+
+/**
+ * Move a session on to its next file, or to QUIT once the queue is empty.
+ */
+static void next_transfer(Engine& engine, size_t index) {
+    Session& session = engine.sessions[index];
+    if (begin_transfer(engine, index, true)) {
+        session.step = Step::Passive;
+    } else if (session.adopted) {
+        end_session(engine, index);
+    } else {
+        queue_command(engine, index, "QUIT\r\n");
+        session.step = Step::Quit;
+    }
+}
+
+
+/**
+ * Close the local file of the current transfer and mark it, then go on with the next one.
+ */
+static void finish_transfer(Engine& engine, size_t index) {
+    Session& session = engine.sessions[index];
+    close_data(engine, index);
+    close(session.fd);
+    session.fd = -1;
+    session.transfer->done = !session.failed;
+    session.metrics.success = !session.failed;
+    record_metrics(session.metrics);
+    if (session.early) {
+        // the passive reply for the next file is already on its way; with nothing left to copy it is just read
+        session.early = false;
+        begin_transfer(engine, index, false);
+        session.step = Step::Passive;
+    } else {
+        next_transfer(engine, index);
+    }
+}
+
+
+/**
+ * One of the commands that log a session of the engine in, in the order they are sent.
+ * @param i 0 for USER, 1 for PASS, then TYPE, MODE, and STRU.
+ */
+static std::string login_command(const FTP& ftp, int i) {
+    switch (i) {
+        case 0:
+            return "USER " + ftp.username + "\r\n";
+        case 1:
+            return ftp.password.empty() ? "PASS\r\n" : "PASS " + ftp.password + "\r\n";
+        case 2:
+            return "TYPE I\r\n";
+        case 3:
+            return "MODE S\r\n";
+        default:
+            return "STRU F\r\n";
+    }
+}
+
+
+/**
+ * Start a session over on a new connection that logs in one command at a time, after the server
+ * dropped or mixed up its pipelined login. Sessions that have not logged in yet keep pipelining,
+ * and each falls back on its own if the server trips over them too.
+ */
+static void restart_login(Engine& engine, size_t index) {
+    Session& session = engine.sessions[index];
+    if (verbose) {
+        std::cout << "Server does not handle pipelined commands, logging in again one command at a time\n";
+    }
+    pipeline = false;
+    watch(engine, EPOLL_CTL_DEL, index, false, 0);
+    close(session.control_sockfd);
+    session.reader.start = session.reader.end = 0;
+    session.outbox.clear();
+    session.writing = false;
+    session.strict = true;
+    session.step = Step::Connect;
+    session.started = std::chrono::steady_clock::now();
+    session.deadline = session.started + std::chrono::milliseconds(PIPELINE_TIMEOUT);
+    if ((session.control_sockfd = connect_nonblocking(engine.server)) < 0) {
+        std::cerr << "Failed to connect to " << engine.ftp->host << '\n';
+        record_metrics(session.metrics);
+        session.step = Step::Done;
+        engine.active--;
+        return;
+    }
+    watch(engine, EPOLL_CTL_ADD, index, false, EPOLLOUT);
+}
+
+
+/**
+ * End the logins the server has not answered in time. A stalled pipelined login is tried again
+ * one command at a time, the way pre_operation does it.
+ * @return milliseconds until the next login deadline, or -1 if no session is logging in.
+ */
+static int expire_logins(Engine& engine) {
+    auto now = std::chrono::steady_clock::now();
+    int timeout = -1;
+    for (size_t k = 0; k < engine.sessions.size(); k++) {
+        Session& session = engine.sessions[k];
+        if (session.step != Step::Connect && session.step != Step::Welcome && session.step != Step::Login) {
+            continue;
+        }
+        if (now >= session.deadline) {
+            if (session.step != Step::Login || session.strict) {
+                std::cerr << "Server did not answer the login in time\n";
+                record_metrics(session.metrics);
+                end_session(engine, k);
+                continue;
+            }
+            restart_login(engine, k);
+            if (session.step == Step::Done) {
+                continue;
+            }
+        }
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(session.deadline - now).count();
+        timeout = timeout < 0 ? static_cast<int>(left) : std::min(timeout, static_cast<int>(left));
+    }
+    return timeout;
+}
+
+
+/**
+ * Take one reply of the server and make the session's next step.
+ */
+static void handle_reply(Engine& engine, size_t index, const Reply& reply) {
+    Session& session = engine.sessions[index];
+    int code = reply_code(reply);
+    switch (session.step) {
+        case Step::Welcome:
+            if (code != CODE_READY) {
+                std::cerr << "Unexpected welcome message: " << reply.line << '\n';
+                record_metrics(session.metrics);
+                end_session(engine, index);
+                break;
+            }
+            session.replies = 0;
+            session.logged_in = false;
+            session.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PIPELINE_TIMEOUT);
+            if (session.strict) {
+                queue_command(engine, index, login_command(*engine.ftp, 0));
+            } else {
+                queue_command(engine, index, login_command(*engine.ftp, 0) + login_command(*engine.ftp, 1)
+                                             + login_command(*engine.ftp, 2) + login_command(*engine.ftp, 3)
+                                             + login_command(*engine.ftp, 4));
+            }
+            session.step = Step::Login;
+            break;
+
+        case Step::Login: {
+            // the same checks as login_pipelined
+            const char *errors[] = {"Username error: ", "Password error: ", "Type command error: ",
+                                    "Mode command error: ", "Structure command error: "};
+            int i = session.replies++;
+            bool expected;
+            if (i == 0) {
+                expected = code == CODE_LOGIN || code == CODE_REQPW;
+                session.logged_in = code == CODE_LOGIN;
+            } else if (i == 1) {
+                expected = session.logged_in || code == CODE_LOGIN;
+            } else {
+                expected = code == CODE_CMPLT;
+            }
+            if (!expected && !session.strict && !(code == CODE_NOLOG && i < 2)) {
+                // as in pre_operation, the server may be tripping over commands it did not expect yet
+                restart_login(engine, index);
+                break;
+            }
+            if (!expected) {
+                std::cerr << errors[i] << reply.line << '\n';
+                session.metrics.login_ms = elapsed_ms(session.started);
+                record_metrics(session.metrics);
+                end_session(engine, index);
+                break;
+            }
+            if (session.strict && i == 0 && session.logged_in) {
+                session.replies++;      // logged in on USER alone, PASS is not sent
+            }
+            if (session.replies == 5) {
+                session.metrics.login_ms = elapsed_ms(session.started);
+                session.metrics.success = true;
+                record_metrics(session.metrics);
+                next_transfer(engine, index);
+                break;
+            }
+            session.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PIPELINE_TIMEOUT);
+            if (session.strict) {
+                queue_command(engine, index, login_command(*engine.ftp, session.replies));
+            }
+            break;
+        }
+
+        case Step::Passive: {
+            if (!session.transfer) {
+                next_transfer(engine, index);
+                break;
+            }
+            Endpoint endpoint;
+            bool parsed;
+            if (session.extended) {
+                if (code == CODE_NOCMD || code == CODE_NOIMP) {
+                    session.extended = false;
+                    queue_command(engine, index, "PASV\r\n");
+                    break;
+                }
+                parsed = code == CODE_EPSVM && parse_epsv_response(reply.line, endpoint)
+                         && peer_host(session.control_sockfd, endpoint);
+            } else {
+                parsed = code == CODE_PSVMD && parse_pasv_response(reply.line, endpoint);
+            }
+            if (!parsed || (session.data_sockfd = connect_nonblocking(endpoint)) < 0) {
+                std::cerr << "Failed to open data channel: " << reply.line << '\n';
+                session.failed = true;
+                finish_transfer(engine, index);
+                break;
+            }
+            // STOR or RETR goes out while the data connection's handshake runs
+            session.generation++;
+            watch(engine, EPOLL_CTL_ADD, index, true, EPOLLOUT);
+            session.command_sent = std::chrono::steady_clock::now();
+            queue_command(engine, index, (session.transfer->download ? "RETR " : "STOR ")
+                                         + session.transfer->remote_path + "\r\n");
+            session.step = Step::Command;
+            break;
+        }
+
+        case Step::Command:
+            if (code != CODE_STXFR) {
+                std::cerr << (session.transfer->download ? "Failed to start download " : "Failed to start upload ")
+                          << reply.line << '\n';
+                session.failed = true;
+                finish_transfer(engine, index);
+                break;
+            }
+            session.step = Step::Transfer;
+            if (!session.transfer->download && session.data_connected && session.data_sockfd >= 0) {
+                watch(engine, EPOLL_CTL_MOD, index, true, EPOLLOUT);
+            }
+            break;
+
+        case Step::Transfer:
+            session.reply_done = true;
+            session.metrics.complete_ms = session.data_done ? elapsed_ms(session.data_ended) : 0;
+            if (code != CODE_DSUCC && code != CODE_FSUCC) {
+                std::cerr << (session.transfer->download ? "Failed to finish RETR command " : "Failed to finish STOR command ")
+                          << reply.line << '\n';
+                session.failed = true;
+                close_data(engine, index);
+            }
+            if (session.data_done) {
+                finish_transfer(engine, index);
+            }
+            break;
+
+        case Step::Quit:
+            end_session(engine, index);
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+/**
+ * The data of the current file is all sent or received. Unless this was the last file, the next
+ * passive request goes out now, so the server answers it right behind 226.
+ */
+static void data_finished(Engine& engine, size_t index) {
+    Session& session = engine.sessions[index];
+    close_data(engine, index);
+    session.data_ended = std::chrono::steady_clock::now();
+    measure_data(session.metrics, session.tuner, session.command_sent, session.data_ended);
+    if (session.reply_done) {
+        finish_transfer(engine, index);
+    } else if (!session.failed && engine.front < engine.back) {
+        session.passive_sent = std::chrono::steady_clock::now();
+        queue_command(engine, index, session.extended ? "EPSV\r\n" : "PASV\r\n");
+        session.early = true;
+    }
+}
+
+
+static void handle_data(Engine& engine, size_t index, uint32_t events) {
+    Session& session = engine.sessions[index];
+    Transfer *transfer = session.transfer;
+    if (!session.data_connected) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return;
+        }
+        if (getsockopt(session.data_sockfd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            // the server still answers STOR or RETR, with an error once it gives up waiting
+            std::cerr << "Failed to open data channel\n";
+            session.failed = true;
+            close_data(engine, index);
+            return;
+        }
+        session.data_connected = true;
+        session.metrics.passive_ms = elapsed_ms(session.passive_sent);
+        start_tuning(session.tuner, session.data_sockfd, !transfer->download);
+        // an upload waits for 150 before it sends anything
+        watch(engine, EPOLL_CTL_MOD, index, true,
+              transfer->download ? EPOLLIN : session.step == Step::Transfer ? EPOLLOUT : 0);
+        return;
+    }
+
+    // one chunk per event, so no session holds up the others
+    ssize_t bytes;
+    if (transfer->download) {
+        if (session.buffer.size() < session.tuner.chunk) {
+            session.buffer.resize(session.tuner.chunk);
+        }
+        bytes = recv(session.data_sockfd, session.buffer.data(), session.tuner.chunk, 0);
+        if (bytes > 0 && !write_all(session.fd, session.buffer.data(), bytes)) {
+            session.failed = true;
+            data_finished(engine, index);
+            return;
+        }
+    } else {
+        bytes = sendfile(session.data_sockfd, session.fd, nullptr, session.tuner.chunk);
+    }
+    if (bytes > 0) {
+        tune_transfer(session.tuner, bytes);
+    } else if (bytes == 0) {
+        data_finished(engine, index);
+    } else if (errno != EAGAIN && errno != EINTR) {
+        std::cerr << (transfer->download ? "Error receiving file: " : "Error sending file: ") << strerror(errno) << '\n';
+        session.failed = true;
+        data_finished(engine, index);
+    }
+}
+
+
+static void handle_control(Engine& engine, size_t index, uint32_t events) {
+    Session& session = engine.sessions[index];
+    if (session.step == Step::Connect) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(session.control_sockfd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            std::cerr << "Failed to connect to " << engine.ftp->host << '\n';
+            record_metrics(session.metrics);
+            end_session(engine, index);
+            return;
+        }
+        session.metrics.connect_ms = elapsed_ms(session.started);
+        session.started = std::chrono::steady_clock::now();
+        session.deadline = session.started + std::chrono::milliseconds(PIPELINE_TIMEOUT);
+        int nodelay = 1;
+        setsockopt(session.control_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        session.step = Step::Welcome;
+        watch(engine, EPOLL_CTL_MOD, index, false, EPOLLIN);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        flush_commands(engine, index);
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        return;
+    }
+
+    Reader& reader = session.reader;
+    while (session.step != Step::Done && session.step != Step::Connect) {
+        make_room(reader);
+        quick_ack(session.control_sockfd);
+        ssize_t bytes_received = recv(session.control_sockfd, reader.buffer.data() + reader.end,
+                                      reader.buffer.size() - reader.end, 0);
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (bytes_received <= 0) {
+            if (session.step != Step::Quit) {
+                std::cerr << "Failed to read response from server" << std::endl;
+            }
+            end_session(engine, index);
+            return;
+        }
+        reader.end += bytes_received;
+        size_t length;
+        while (session.step != Step::Done && session.step != Step::Connect
+               && (length = reply_length({reader.buffer.data() + reader.start, reader.end - reader.start})) > 0) {
+            handle_reply(engine, index, take_reply(reader, length));
+        }
+    }
+}
+
+
+bool run_engine(int control_sockfd, const FTP& ftp, std::vector<Transfer>& transfers, int sessions) {
+    Engine engine;
+    engine.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (engine.epfd < 0) {
+        std::cerr << "Failed to create epoll instance\n";
+        return false;
+    }
+    engine.ftp = &ftp;
+    engine.transfers = &transfers;
+    engine.back = transfers.size();
+    engine.sessions.resize(sessions);
+
+    // the other sessions connect to the address the given session is connected to
+    Endpoint& server = engine.server;
+    struct sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+    bool resolved = peer_host(control_sockfd, server)
+                    && getpeername(control_sockfd, reinterpret_cast<struct sockaddr *>(&peer), &length) == 0
+                    && getnameinfo(reinterpret_cast<struct sockaddr *>(&peer), length, nullptr, 0,
+                                   server.port, sizeof(server.port), NI_NUMERICSERV) == 0;
+
+    for (int k = 0; k < sessions; k++) {
+        Session& session = engine.sessions[k];
+        session.largest_first = k == 1;
+        if (k == 0) {
+            // a data channel prefetched for a transfer that never came, and any replies already read
+            int data_sockfd = take_data_channel(control_sockfd);
+            if (data_sockfd >= 0) {
+                close(data_sockfd);
+            }
+            session.reader = reader_for(control_sockfd);
+            reset_reader(control_sockfd);
+            session.adopted = true;
+            session.control_sockfd = control_sockfd;
+            fcntl(control_sockfd, F_SETFL, fcntl(control_sockfd, F_GETFL) | O_NONBLOCK);
+            watch(engine, EPOLL_CTL_ADD, k, false, EPOLLIN);
+            engine.active++;
+            next_transfer(engine, k);
+            continue;
+        }
+        if (!resolved || (session.control_sockfd = connect_nonblocking(server)) < 0) {
+            std::cerr << "Failed to connect to " << ftp.host << '\n';
+            session.step = Step::Done;
+            continue;
+        }
+        session.metrics.kind = "session";
+        session.metrics.path = ftp.host + ":" + ftp.port;
+        session.strict = !pipeline;
+        session.started = std::chrono::steady_clock::now();
+        session.deadline = session.started + std::chrono::milliseconds(PIPELINE_TIMEOUT);
+        watch(engine, EPOLL_CTL_ADD, k, false, EPOLLOUT);
+        engine.active++;
+    }
+
+    struct epoll_event events[64];
+    while (engine.active > 0) {
+        // wake up for the next login deadline even if no socket is ready
+        int timeout = expire_logins(engine);
+        if (engine.active == 0) {
+            break;
+        }
+        int count = epoll_wait(engine.epfd, events, 64, timeout);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Failed to wait for events: " << strerror(errno) << '\n';
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            uint64_t key = events[i].data.u64;
+            size_t index = (key & 0xffffffff) >> 1;
+            Session& session = engine.sessions[index];
+            if (session.step == Step::Done) {
+                continue;
+            }
+            if (!(key & 1)) {
+                handle_control(engine, index, events[i].events);
+            } else if (session.data_sockfd >= 0 && key >> 32 == session.generation) {
+                handle_data(engine, index, events[i].events);
+            }
+        }
+    }
+
+    for (size_t k = 0; k < engine.sessions.size(); k++) {
+        end_session(engine, k);
+    }
+    close(engine.epfd);
+    return std::all_of(transfers.begin(), transfers.end(), [](const Transfer& transfer) {
+        return transfer.done;
+    });
+}
+#endif
+
+
+bool upload_tree(int control_sockfd, const FTP& ftp, const std::string& local_root,
+                 std::string remote_root, bool move) {
+    std::error_code error;
+    if (!std::filesystem::is_directory(local_root, error)) {
+        std::cerr << "Not a local directory " << local_root << '\n';
+        return false;
+    }
+    // handle remote directory name
+    if (remote_root.back() == '/') {
+        std::filesystem::path local = std::filesystem::absolute(local_root).lexically_normal();
+        remote_root += (local.has_filename() ? local : local.parent_path()).filename().string();
+    }
+
+    // directories are created in walk order, so a parent always exists before its children;
+    // a directory that already exists is not an error
+    make_directory(control_sockfd, remote_root, true);
+    std::vector<Transfer> transfers;
+    std::vector<std::string> directories;
+    std::vector<std::string> remote_directories = {remote_root};
+    for (const auto& item : std::filesystem::recursive_directory_iterator(local_root, error)) {
+        std::string relative = std::filesystem::relative(item.path(), local_root).generic_string();
+        std::string remote_path = join_path(remote_root, relative);
+        if (item.is_directory()) {
+            make_directory(control_sockfd, remote_path, true);
+            directories.push_back(item.path().string());
+            remote_directories.push_back(remote_path);
+        } else if (item.is_regular_file()) {
+            transfers.push_back({false, item.path().string(), remote_path,
+                                 static_cast<long long>(item.file_size()), false});
+        }
+    }
+    if (error) {
+        std::cerr << "Failed to walk " << local_root << ": " << error.message() << '\n';
+        return false;
+    }
+    // a resumed upload asks for the size of every remote file; one listing per directory
+    // answers all of them from the cache
+    for (size_t i = 0; resume && cache_ttl > 0 && i < remote_directories.size(); i++) {
+        std::vector<Entry> entries;
+        list_entries(control_sockfd, remote_directories[i], entries);
+    }
+
+    bool success = run_transfers(control_sockfd, ftp, transfers, jobs);
+    if (move) {
+        for (const Transfer& transfer : transfers) {
+            if (transfer.done) {
+                std::filesystem::remove(transfer.local_path, error);
+            }
+        }
+        // deepest directories first; only empty ones can go
+        for (auto it = directories.rbegin(); it != directories.rend(); ++it) {
+            std::filesystem::remove(*it, error);
+        }
+        if (success) {
+            std::filesystem::remove(local_root, error);
+        }
+    }
+    return success;
+}
+
+
+bool download_tree(int control_sockfd, const FTP& ftp, std::string remote_root,
+                   std::string local_root, bool move) {
+    while (remote_root.length() > 1 && remote_root.back() == '/') {
+        remote_root.pop_back();
+    }
+    // handle local directory name
+    if (local_root.empty() || local_root.back() == '/') {
+        local_root += remote_root.substr(remote_root.find_last_of('/') + 1);
+    }
+
+    // walk the remote tree breadth first over the main session
+    std::vector<Transfer> transfers;
+    std::vector<std::string> directories = {remote_root};
+    std::error_code error;
+    for (size_t i = 0; i < directories.size(); i++) {
+        std::string remote_dir = directories[i];
+        std::string local_dir = join_path(local_root, remote_dir.substr(remote_root.length()));
+        std::filesystem::create_directories(local_dir, error);
+        if (error) {
+            std::cerr << "Failed to create local directory " << local_dir << '\n';
+            return false;
+        }
+
+        std::vector<Entry> entries;
+        if (!list_entries(control_sockfd, remote_dir, entries)) {
+            return false;
+        }
+        for (const Entry& entry : entries) {
+            std::string remote_path = join_path(remote_dir, entry.name);
+            if (entry.directory) {
+                directories.push_back(remote_path);
+            } else {
+                transfers.push_back({true, join_path(local_dir, entry.name), remote_path, entry.size, false});
+            }
+        }
+    }
+
+    bool success = run_transfers(control_sockfd, ftp, transfers, jobs);
+    if (move) {
+        for (const Transfer& transfer : transfers) {
+            if (transfer.done) {
+                remove_file(control_sockfd, transfer.remote_path);
+            }
+        }
+        // deepest directories first, once every file is gone
+        for (auto it = directories.rbegin(); success && it != directories.rend(); ++it) {
+            success = remove_directory(control_sockfd, *it);
+        }
+    }
+    return success;
+}
+
+
+/**
+ * List a local directory into entries, with the same fields as a remote listing.
+ */
+static bool local_entries(const std::string& path, std::vector<Entry>& entries) {
+    std::error_code error;
+    for (const auto& item : std::filesystem::directory_iterator(path, error)) {
+        struct stat st;
+        if (stat(item.path().c_str(), &st) < 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+            continue;
+        }
+        Entry entry;
+        entry.name = item.path().filename().string();
+        entry.directory = S_ISDIR(st.st_mode);
+        entry.size = entry.directory ? -1 : st.st_size;
+        entry.modified = st.st_mtime;
+        entries.push_back(entry);
+    }
+    return !error;
+}
+
+
+/**
+ * Delete a remote file or a whole remote directory tree.
+ */
+static bool remove_remote(int sockfd, const std::string& path, bool directory) {
+    if (!directory) {
+        return remove_file(sockfd, path);
+    }
+    std::vector<Entry> entries;
+    if (!list_entries(sockfd, path, entries)) {
+        return false;
+    }
+    bool success = true;
+    for (const Entry& entry : entries) {
+        success = remove_remote(sockfd, join_path(path, entry.name), entry.directory) && success;
+    }
+    return success && remove_directory(sockfd, path);
+}
+
+
+bool sync_tree(int control_sockfd, const FTP& ftp, const std::string& local_root,
+               const std::string& remote_root, bool upload, bool delete_extra) {
+    std::vector<Transfer> transfers;
+    int unchanged = 0, deleted = 0;
+    bool success = true;
+
+    // walk both trees together, one directory level at a time
+    std::vector<std::string> directories = {""};
+    for (size_t i = 0; i < directories.size(); i++) {
+        std::string local_dir = join_path(local_root, directories[i]);
+        std::string remote_dir = join_path(remote_root, directories[i]);
+        std::vector<Entry> local_list, remote_list;
+
+        if (!local_entries(local_dir, local_list)) {
+            std::error_code error;
+            if (upload || !std::filesystem::create_directories(local_dir, error)) {
+                std::cerr << "Failed to read local directory " << local_dir << '\n';
+                return false;
+            }
+        }
+        if (!list_entries(control_sockfd, remote_dir, remote_list, true)) {
+            if (!upload || !make_directory(control_sockfd, remote_dir)) {
+                return false;
+            }
+        }
+
+        const std::vector<Entry>& source = upload ? local_list : remote_list;
+        std::map<std::string, const Entry*> target;
+        for (const Entry& entry : upload ? remote_list : local_list) {
+            target[entry.name] = &entry;
+        }
+
+        for (const Entry& entry : source) {
+            std::string relative = join_path(directories[i], entry.name);
+            auto found = target.find(entry.name);
+            const Entry *existing = found == target.end() ? nullptr : found->second;
+            if (found != target.end()) {
+                target.erase(found);
+            }
+
+            if (entry.directory) {
+                if (!existing && upload) {
+                    success = make_directory(control_sockfd, join_path(remote_dir, entry.name)) && success;
+                }
+                directories.push_back(relative);
+                continue;
+            }
+            // copy new files, files of another size, and files changed since the last copy
+            if (existing && !existing->directory && existing->size == entry.size
+                && entry.modified <= existing->modified) {
+                unchanged++;
+                continue;
+            }
+            transfers.push_back({!upload, join_path(local_root, relative), join_path(remote_root, relative),
+                                 entry.size, false, entry.modified});
+        }
+
+        // whatever is left exists only on the target side
+        for (const auto& [name, entry] : target) {
+            if (!delete_extra) {
+                continue;
+            }
+            if (upload) {
+                success = remove_remote(control_sockfd, join_path(remote_dir, name), entry->directory) && success;
+            } else {
+                std::error_code error;
+                std::filesystem::remove_all(join_path(local_dir, name), error);
+                success = !error && success;
+            }
+            deleted++;
+        }
+    }
+
+    success = run_transfers(control_sockfd, ftp, transfers, jobs) && success;
+
+    // downloaded files take the remote modification time, so the next run sees them as unchanged;
+    // uploaded files are newer on the server than their source already
+    for (const Transfer& transfer : transfers) {
+        if (transfer.done && transfer.download && transfer.modified > 0) {
+            struct timespec times[2] = {{transfer.modified, 0}, {transfer.modified, 0}};
+            utimensat(AT_FDCWD, transfer.local_path.c_str(), times, 0);
+        }
+    }
+    if (verbose) {
+        std::cout << "Sync: " << transfers.size() << " copied, " << unchanged << " unchanged, "
+                  << deleted << " deleted\n";
+    }
+    return success;
+}
+
+
+bool make_directory(int sockfd, const std::string& dir, bool exist_ok) {
+    Entry entry;
+    if (exist_ok && cached_entry(sockfd, dir, false, entry) > 0 && entry.directory) {
+        return true;
+    }
+    send_message(sockfd, "MKD", dir);
+    std::string response = read_response(sockfd);
+    forget_listing(sockfd, dir);
+    int code = response_code(response);
+    if (exist_ok && code == CODE_NOFILE) {
+        return true;
+    }
+    if (code != CODE_CRDIR) {
+        std::cerr << "Failed to create directory " << dir << '\n';
+        return false;
+    }
+    if (verbose) {
+        std::cout << "Created directory " << dir << '\n';
+    }
+    return true;
+}
+
+
+bool remove_directory(int sockfd, const std::string& dir) {
+    send_message(sockfd, "RMD", dir);
+    std::string response = read_response(sockfd);
+    forget_listing(sockfd, dir);
+    int code = response_code(response);
+    if (code != CODE_FSUCC) {
+        std::cerr << "Failed to remove directory " << dir << '\n';
+        return false;
+    }
+    if (verbose) {
+        std::cout << "Removed directory " << dir << '\n';
+    }
+    return true;
+}
+
+
+bool remove_file(int sockfd, const std::string& dir) {
+    send_message(sockfd, "DELE", dir);
+    std::string response = read_response(sockfd);
+    forget_listing(sockfd, dir);
+    int code = response_code(response);
+    if (code != CODE_FSUCC) {
+        std::cerr << "Failed to remove file " << dir << '\n';
+        return false;
+    }
+    if (verbose) {
+        std::cout << "Removed file " << dir << '\n';
+    }
+    return true;
+}
+
+
+void start_tuning(Tuner& tuner, int sockfd, bool sending) {
+    tuner.sockfd = sockfd;
+    tuner.sending = sending;
+    tuner.chunk = TUNE_MIN_CHUNK;
+    socklen_t length = sizeof(tuner.buffer);
+    getsockopt(sockfd, SOL_SOCKET, sending ? SO_SNDBUF : SO_RCVBUF, &tuner.buffer, &length);
+    tuner.interval_bytes = 0;
+    tuner.interval_start = std::chrono::steady_clock::now();
+    tuner.total_bytes = 0;
+    if (verbose) {
+        std::cout << "Tuning: chunk " << tuner.chunk / 1024 << " KB, " << (sending ? "send" : "receive")
+                  << " buffer " << tuner.buffer / 1024 << " KB\n";
+    }
+}
+
+
+#ifdef __linux__
+/**
+ * Read one whitespace-separated field of a sysctl file, e.g. the maximum of tcp_rmem.
+ * @return the value, or 0 if the file cannot be read.
+ */
+static long read_sysctl(const char *path, int field) {
+    std::ifstream file(path);
+    long value = 0;
+    for (int i = 0; i <= field && file >> value; i++) {
+    }
+    return file ? value : 0;
+}
+#endif
+
+
+void tune_transfer(Tuner& tuner, size_t bytes) {
+    auto now = std::chrono::steady_clock::now();
+    if (bytes > 0) {
+        if (tuner.total_bytes == 0) {
+            tuner.first_byte = now;
+        }
+        tuner.last_byte = now;
+        tuner.total_bytes += static_cast<long long>(bytes);
+    }
+    tuner.interval_bytes += static_cast<long long>(bytes);
+    double seconds = std::chrono::duration<double>(now - tuner.interval_start).count();
+    if (seconds * 1000 < TUNE_INTERVAL) {
+        return;
+    }
+    double rate = static_cast<double>(tuner.interval_bytes) / seconds;
+    tuner.interval_bytes = 0;
+    tuner.interval_start = now;
+
+#ifdef __linux__
+    // smoothed round-trip time in microseconds; a receiver has its own estimate
+    struct tcp_info info = {};
+    socklen_t length = sizeof(info);
+    if (getsockopt(tuner.sockfd, IPPROTO_TCP, TCP_INFO, &info, &length) < 0) {
+        return;
+    }
+    unsigned rtt = !tuner.sending && info.tcpi_rcv_rtt ? info.tcpi_rcv_rtt : info.tcpi_rtt;
+    if (rtt == 0) {
+        return;
+    }
+
+    // a window-limited link delivers about one buffer per round trip, so twice the
+    // measured bandwidth-delay product keeps doubling the buffer until the link is full
+    double bdp = rate * rtt / 1e6;
+    size_t chunk = TUNE_MIN_CHUNK;
+    while (chunk < bdp && chunk < TUNE_MAX_CHUNK) {
+        chunk <<= 1;
+    }
+    int buffer = static_cast<int>(std::min<double>(2 * bdp, TUNE_MAX_BUFFER));
+    bool changed = chunk != tuner.chunk;
+    tuner.chunk = chunk;
+
+    // setting a socket buffer locks it and ends the kernel's autotuning for the connection, so it is only
+    // set for a buffer beyond what autotuning can reach (tcp_rmem or tcp_wmem). The kernel doubles the
+    // value it is given, up to twice rmem_max or wmem_max. Autotuning may have grown the buffer since
+    // the last interval, so the current size is read again before comparing
+    static const long autotune_max[2] = {read_sysctl("/proc/sys/net/ipv4/tcp_rmem", 2),
+                                         read_sysctl("/proc/sys/net/ipv4/tcp_wmem", 2)};
+    static const long request_max[2] = {read_sysctl("/proc/sys/net/core/rmem_max", 0),
+                                        read_sysctl("/proc/sys/net/core/wmem_max", 0)};
+    int option = tuner.sending ? SO_SNDBUF : SO_RCVBUF;
+    int previous = tuner.buffer;
+    socklen_t size = sizeof(tuner.buffer);
+    getsockopt(tuner.sockfd, SOL_SOCKET, option, &tuner.buffer, &size);
+    long granted = 2L * (request_max[tuner.sending] > 0 ? std::min<long>(buffer, request_max[tuner.sending]) : buffer);
+    if (granted > tuner.buffer && granted > autotune_max[tuner.sending]) {
+        setsockopt(tuner.sockfd, SOL_SOCKET, option, &buffer, sizeof(buffer));
+        size = sizeof(tuner.buffer);
+        getsockopt(tuner.sockfd, SOL_SOCKET, option, &tuner.buffer, &size);
+    }
+    changed = changed || tuner.buffer != previous;
+    if (verbose && changed) {
+        std::cout << "Tuning: rtt " << rtt / 1000.0 << " ms, " << rate / (1 << 20) << " MB/s, chunk "
+                  << tuner.chunk / 1024 << " KB, " << (tuner.sending ? "send" : "receive") << " buffer "
+                  << tuner.buffer / 1024 << " KB\n";
+    }
+#else
+    (void) rate;
+#endif
+}
+
+
+bool open_journal(const std::string& path) {
+    std::ifstream previous(path);
+    std::string line;
+    while (std::getline(previous, line)) {
+        // `done SIZE LOCAL<tab>REMOTE` or `part OFFSET LOCAL<tab>REMOTE`, the last line for a file wins
+        std::istringstream fields(line);
+        std::string state, paths;
+        long long offset;
+        if (fields >> state >> offset && std::getline(fields >> std::ws, paths) && paths.find('\t') != std::string::npos) {
+            journal_entries[paths] = {state == "done", offset};
+        }
+    }
+    journal.open(path, std::ios::app);
+    if (!journal) {
+        std::cerr << "Failed to open journal file " << path << '\n';
+        return false;
+    }
+    return true;
+}
+
+
+void record_progress(const std::string& local_path, const std::string& remote_path, long long offset, bool done) {
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    if (!journal.is_open()) {
+        return;
+    }
+    std::string paths = local_path + '\t' + remote_path;
+    journal_entries[paths] = {done, offset};
+    // flushed line by line, so a killed job still leaves every finished file behind
+    journal << (done ? "done " : "part ") << offset << ' ' << paths << std::endl;
+}
+
+
+bool open_stats(const std::string& path) {
+    stats_json.open(path, std::ios::app);
+    if (!stats_json) {
+        std::cerr << "Failed to open stats file " << path << '\n';
+        return false;
+    }
+    stats_json << std::fixed << std::setprecision(3);
+    return true;
+}
+
+
+/**
+ * Write a string as a JSON string literal.
+ */
+static void write_json_string(std::ostream& out, const std::string& text) {
+    out << '"';
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+
+void record_metrics(const Metrics& metrics) {
+    if (!stats && !stats_json.is_open()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    if (stats) {
+        metrics_log.push_back(metrics);
+    }
+    if (!stats_json.is_open()) {
+        return;
+    }
+
+    // wall-clock seconds for the dashboards, and null for a step that did not happen
+    auto field = [](std::ostream& out, const char *name, double value) {
+        out << ",\"" << name << "\":";
+        if (value < 0) {
+            out << "null";
+        } else {
+            out << value;
+        }
+    };
+    double now = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    stats_json << "{\"time\":" << now << ",\"kind\":";
+    write_json_string(stats_json, metrics.kind);
+    stats_json << ",\"path\":";
+    write_json_string(stats_json, metrics.path);
+    stats_json << ",\"success\":" << (metrics.success ? "true" : "false") << ",\"bytes\":" << metrics.bytes;
+    field(stats_json, "connect_ms", metrics.connect_ms);
+    field(stats_json, "login_ms", metrics.login_ms);
+    field(stats_json, "passive_ms", metrics.passive_ms);
+    field(stats_json, "first_byte_ms", metrics.first_byte_ms);
+    field(stats_json, "transfer_ms", metrics.transfer_ms);
+    field(stats_json, "complete_ms", metrics.complete_ms);
+    field(stats_json, "bytes_per_second", metrics.transfer_ms > 0 ? metrics.bytes / metrics.transfer_ms * 1000 : -1);
+    // flushed line by line like the journal, so a killed job keeps what it measured
+    stats_json << "}" << std::endl;
+}
+
+
+void print_metrics() {
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    if (metrics_log.empty()) {
+        return;
+    }
+    std::ios_base::fmtflags flags = std::cout.flags();
+    std::streamsize precision = std::cout.precision();
+    std::cout << std::fixed << std::setprecision(1);
+
+    std::cout << std::left << std::setw(10) << "kind" << std::right;
+    for (const char *name : {"connect", "login", "passive", "1st byte", "transfer", "226 wait"}) {
+        std::cout << std::setw(10) << name;
+    }
+    std::cout << std::setw(14) << "bytes" << std::setw(10) << "MB/s" << "  path\n";
+    for (const Metrics& metrics : metrics_log) {
+        // a trailing '!' marks a failed login or transfer
+        std::cout << std::left << std::setw(10) << (metrics.success ? metrics.kind : metrics.kind + "!") << std::right;
+        for (double value : {metrics.connect_ms, metrics.login_ms, metrics.passive_ms, metrics.first_byte_ms,
+                             metrics.transfer_ms, metrics.complete_ms}) {
+            if (value < 0) {
+                std::cout << std::setw(10) << "-";
+            } else {
+                std::cout << std::setw(10) << value;
+            }
+        }
+        if (metrics.kind == "session") {
+            std::cout << std::setw(14) << "-";
+        } else {
+            std::cout << std::setw(14) << metrics.bytes;
+        }
+        if (metrics.transfer_ms > 0) {
+            std::cout << std::setw(10) << metrics.bytes / metrics.transfer_ms * 1000 / (1 << 20);
+        } else {
+            std::cout << std::setw(10) << "-";
+        }
+        std::cout << "  " << metrics.path << '\n';
+    }
+    std::cout << "Times in milliseconds.\n";
+    std::cout.flags(flags);
+    std::cout.precision(precision);
+}
+
+
+long long journal_offset(const std::string& local_path, const std::string& remote_path, bool& done) {
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    auto found = journal_entries.find(local_path + '\t' + remote_path);
+    if (found == journal_entries.end()) {
+        done = false;
+        return -1;
+    }
+    done = found->second.first;
+    return found->second.second;
+}
+
+
+/**
+ * Start a checksum in the algorithm chosen from FEAT.
+ * @return true if okay, false if it cannot be computed.
+ */
+static bool digest_start(Digest& digest) {
+    digest.crc = crc32(0L, Z_NULL, 0);
+    if (checksum_algorithm == "CRC32") {
+        return true;
+    }
+    const EVP_MD *type = checksum_algorithm == "MD5" ? EVP_md5()
+                         : checksum_algorithm == "SHA-1" ? EVP_sha1()
+                         : checksum_algorithm == "SHA-512" ? EVP_sha512() : EVP_sha256();
+    digest.context = EVP_MD_CTX_new();
+    if (!digest.context || EVP_DigestInit_ex(digest.context, type, nullptr) != 1) {
+        std::cerr << "Failed to start " << checksum_algorithm << " checksum\n";
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Add bytes to a checksum, if there is one.
+ */
+static void digest_update(Digest *digest, const char *data, size_t length) {
+    if (!digest) {
+        return;
+    }
+    if (digest->context) {
+        EVP_DigestUpdate(digest->context, data, length);
+    } else {
+        digest->crc = crc32_z(digest->crc, reinterpret_cast<const Bytef *>(data), length);
+    }
+}
+
+
+/**
+ * Add a byte range of a file to a checksum, for the part of a file that a transfer does not move.
+ * @return true if okay, false on error.
+ */
+static bool digest_range(Digest& digest, int fd, long long from, long long to) {
+    std::vector<char> buffer(TUNE_MAX_CHUNK);
+    ssize_t bytes_read;
+    while (from < to) {
+        if ((bytes_read = pread(fd, buffer.data(), std::min<long long>(buffer.size(), to - from), from)) <= 0) {
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error reading file: " << (bytes_read < 0 ? strerror(errno) : "file is shorter than expected")
+                      << '\n';
+            return false;
+        }
+        digest_update(&digest, buffer.data(), bytes_read);
+        from += bytes_read;
+    }
+    return true;
+}
+
+
+/**
+ * Finish a checksum.
+ * @return the checksum as lowercase hex.
+ */
+static std::string digest_finish(Digest& digest) {
+    char hex[2 * EVP_MAX_MD_SIZE + 1];
+    if (!digest.context) {
+        snprintf(hex, sizeof(hex), "%08lx", digest.crc);
+        return hex;
+    }
+    unsigned char value[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    EVP_DigestFinal_ex(digest.context, value, &length);
+    for (unsigned int i = 0; i < length; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", value[i]);
+    }
+    return std::string(hex, 2 * length);
+}
+
+
+/**
+ * Ask the server for the checksum of a remote file and compare it with the one of the local copy.
+ * @param local the checksum of the local copy, from digest_finish.
+ * @return true if the checksums match, false if they differ or the server does not give one.
+ */
+static bool verify_checksum(int control_sockfd, const std::string& remote_path, const std::string& local) {
+    send_message(control_sockfd, checksum_command, remote_path);
+    std::string response = read_response(control_sockfd);
+    int code = response_code(response);
+
+    // HASH answers "213 SHA-256 0-1234 <hex> <path>", XCRC and XMD5 answer "250 <hex>"
+    std::string remote;
+    if (checksum_command == "HASH" ? code == CODE_FSTAT : code == CODE_FSUCC) {
+        std::istringstream fields(response.substr(4));
+        std::string algorithm, range;
+        if (checksum_command == "HASH") {
+            fields >> algorithm >> range;
+        }
+        fields >> remote;
+    }
+    if (remote.empty()) {
+        // the server listed the command in FEAT, so a file it cannot checksum is not taken on trust
+        std::cerr << "Failed to verify " << remote_path << ": " << response << '\n';
+        return false;
+    }
+
+    // some servers leave out the leading zeros of a CRC
+    bool same = checksum_algorithm == "CRC32"
+                ? std::strtoul(remote.c_str(), nullptr, 16) == std::strtoul(local.c_str(), nullptr, 16)
+                : strcasecmp(remote.c_str(), local.c_str()) == 0;
+    if (!same) {
+        std::cerr << "Checksum mismatch for " << remote_path << ": " << checksum_algorithm << " is " << local
+                  << " here and " << remote << " on the server\n";
+        return false;
+    }
+    if (verbose) {
+        std::cout << "Verified: " << remote_path << " " << checksum_algorithm << " " << local << '\n';
+    }
+    return true;
+}
+
+
+/**
+ * Send a file over a socket, from the current file offset to the end.
+ * @param tuner started here; keeps the byte count and timings for the caller's metrics.
+ * @param digest the checksum to add the sent bytes to, or nullptr.
+ * @return true if okay, false on error.
+ */
+static bool send_descriptor(int sockfd, int fd, Tuner& tuner, Digest *digest = nullptr) {
+    start_tuning(tuner, sockfd, true);
+#ifdef __linux__
+    // the kernel moves the bytes from the page cache to the socket, no user-space copy;
+    // a checksum needs the bytes, so checked files take the loop below. A TLS channel can only
+    // use sendfile if the kernel encrypts it; SSL_sendfile takes the offset instead of moving it
+    SSL *ssl = tls_for(sockfd);
+    bool kernel_tls = ssl && BIO_get_ktls_send(SSL_get_wbio(ssl));
+    off_t offset = kernel_tls ? lseek(fd, 0, SEEK_CUR) : 0;
+    ssize_t sent = -1;
+    while (!digest && (!ssl || kernel_tls)
+           && (sent = kernel_tls ? SSL_sendfile(ssl, fd, offset, tuner.chunk, 0)
+                                 : sendfile(sockfd, fd, nullptr, tuner.chunk)) != 0) {
+        if (sent > 0) {
+            offset += sent;
+            tune_transfer(tuner, sent);
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EINVAL || errno == ENOSYS) {
+            break;      // not a file sendfile can read, the loop below takes over at the same offset
+        }
+        std::cerr << "Error sending file: " << strerror(errno) << '\n';
+        return false;
+    }
+    if (kernel_tls) {
+        lseek(fd, offset, SEEK_SET);
+    }
+    if (sent == 0) {
+        return true;
+    }
+#endif
+
+    std::vector<char> buffer(tuner.chunk);
+    ssize_t bytes_read, total, sent_bytes;
+    while ((bytes_read = read(fd, buffer.data(), buffer.size())) > 0) {
+        digest_update(digest, buffer.data(), bytes_read);
+        total = 0;
+        while (total < bytes_read) {
+            if ((sent_bytes = channel_send(sockfd, buffer.data() + total, bytes_read - total)) == -1) {
+                std::cerr << "Error sending file: " << strerror(errno) << '\n';
+                return false;
+            }
+            total += sent_bytes;
+        }
+        tune_transfer(tuner, bytes_read);
+        buffer.resize(tuner.chunk);
+    }
+    if (bytes_read < 0) {
+        std::cerr << "Error reading file: " << strerror(errno) << '\n';
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Receive everything sent over a socket until the peer closes it and write it to a file.
+ * @param tuner started here; keeps the byte count and timings for the caller's metrics.
+ * @param digest the checksum to add the received bytes to, or nullptr.
+ * @return true if okay, false on error.
+ */
+static bool receive_descriptor(int sockfd, int fd, Tuner& tuner, Digest *digest = nullptr) {
+    start_tuning(tuner, sockfd, false);
+#ifdef __linux__
+    // socket to pipe to file, the pages move inside the kernel and never reach user space;
+    // checked files and TLS channels take the loop below
+    int pipefd[2];
+    if (!digest && !tls_for(sockfd) && pipe(pipefd) == 0) {
+        size_t pipe_size = tuner.chunk;
+        fcntl(pipefd[1], F_SETPIPE_SZ, pipe_size);
+        ssize_t moved = 0, left = 0, written = 0;
+        bool failed = false;
+        while ((moved = splice(sockfd, nullptr, pipefd[1], nullptr, pipe_size, SPLICE_F_MOVE | SPLICE_F_MORE)) != 0) {
+            if (moved < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                failed = true;
+                break;
+            }
+            left = moved;
+            while (left > 0) {
+                if ((written = splice(pipefd[0], nullptr, fd, nullptr, left, SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    break;
+                }
+                left -= written;
+            }
+            if (left > 0) {
+                // the file cannot take spliced pages; drain the pipe by hand and use the loop below
+                char buffer[65536];
+                ssize_t bytes_read;
+                while (left > 0 && (bytes_read = read(pipefd[0], buffer, sizeof(buffer))) > 0) {
+                    if (!write_all(fd, buffer, bytes_read)) {
+                        close(pipefd[0]);
+                        close(pipefd[1]);
+                        return false;
+                    }
+                    left -= bytes_read;
+                }
+                failed = true;
+                break;
+            }
+            tune_transfer(tuner, moved);
+            if (tuner.chunk > pipe_size && fcntl(pipefd[1], F_SETPIPE_SZ, tuner.chunk) > 0) {
+                pipe_size = tuner.chunk;
+            }
+        }
+        int error = errno;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (!failed) {
+            return true;
+        }
+        if (error != EINVAL && error != ENOSYS) {
+            std::cerr << "Error receiving file: " << strerror(error) << '\n';
+            return false;
+        }
+    }
+#endif
+
+    std::vector<char> buffer(tuner.chunk);
+    ssize_t bytes_received;
+    while ((bytes_received = channel_recv(sockfd, buffer.data(), buffer.size())) > 0) {
+        if (!write_all(fd, buffer.data(), bytes_received)) {
+            return false;
+        }
+        digest_update(digest, buffer.data(), bytes_received);
+        tune_transfer(tuner, bytes_received);
+        buffer.resize(tuner.chunk);
+    }
+    if (bytes_received < 0) {
+        std::cerr << "Error receiving file: " << strerror(errno) << '\n';
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Decide whether a file goes in MODE Z: --compress is on, the server has MODE Z, the file is not too small,
+ * and neither its name nor its first bytes show that it is compressed already.
+ * @param path the file name, for its extension.
+ * @param fd the open local file, whose first bytes are checked, or -1 for a remote file.
+ * @param size the file size, or -1 if it is not known.
+ * @return true if the file is worth compressing.
+ */
+static bool worth_compressing(const std::string& path, int fd, long long size) {
+    if (!mode_z || !mode_z_supported || (size >= 0 && size < compress_min)) {
+        return false;
+    }
+
+    static const char *extensions[] = {"gz", "tgz", "bz2", "xz", "zst", "lz4", "zip", "7z", "rar", "jar",
+                                       "jpg", "jpeg", "png", "gif", "webp", "mp3", "mp4", "mkv", "mov"};
+    size_t dot = path.find_last_of("./");
+    if (dot != std::string::npos && path[dot] == '.') {
+        std::string extension = path.substr(dot + 1);
+        for (const char *known : extensions) {
+            if (strcasecmp(extension.c_str(), known) == 0) {
+                return false;
+            }
+        }
+    }
+
+    if (fd < 0) {
+        return true;
+    }
+
+    // gzip, zip, bzip2, xz, zstd, 7z, PNG, and JPEG signatures
+    static const std::string_view signatures[] = {
+        {"\x1f\x8b", 2}, {"PK\x03\x04", 4}, {"BZh", 3}, {"\xfd" "7zXZ\x00", 6},
+        {"\x28\xb5\x2f\xfd", 4}, {"7z\xbc\xaf", 4}, {"\x89PNG", 4}, {"\xff\xd8\xff", 3}};
+    std::vector<char> sample(COMPRESS_SAMPLE);
+    ssize_t length = pread(fd, sample.data(), sample.size(), 0);
+    if (length <= 0) {
+        return length == 0;
+    }
+    std::string_view start(sample.data(), length);
+    for (std::string_view signature : signatures) {
+        if (start.starts_with(signature)) {
+            return false;
+        }
+    }
+
+    // anything else is tried on its first bytes at the fastest level; data that deflate
+    // cannot shrink by a tenth is random or compressed in a format not listed above
+    uLongf packed = compressBound(length);
+    std::vector<Bytef> output(packed);
+    if (compress2(output.data(), &packed, reinterpret_cast<const Bytef *>(sample.data()), length, 1) != Z_OK) {
+        return false;
+    }
+    return packed * 10 < static_cast<uLongf>(length) * 9;
+}
+
+
+/**
+ * Compress a file from the current file offset to the end and send it as one deflate stream, for MODE Z.
+ * @param tuner started here; counts the compressed bytes sent.
+ * @param digest the checksum to add the file bytes to, or nullptr.
+ * @return true if okay, false on error.
+ */
+static bool deflate_descriptor(int sockfd, int fd, Tuner& tuner, Digest *digest = nullptr) {
+    start_tuning(tuner, sockfd, true);
+    z_stream stream = {};
+    if (deflateInit(&stream, compress_level) != Z_OK) {
+        std::cerr << "Failed to start compression\n";
+        return false;
+    }
+
+    std::vector<char> input(tuner.chunk), output(tuner.chunk);
+    ssize_t bytes_read;
+    int flush = Z_NO_FLUSH;
+    bool success = true;
+    while (success && flush != Z_FINISH) {
+        if ((bytes_read = read(fd, input.data(), input.size())) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error reading file: " << strerror(errno) << '\n';
+            success = false;
+            break;
+        }
+        digest_update(digest, input.data(), bytes_read);
+        flush = bytes_read == 0 ? Z_FINISH : Z_NO_FLUSH;
+        stream.next_in = reinterpret_cast<Bytef *>(input.data());
+        stream.avail_in = static_cast<uInt>(bytes_read);
+
+        // send everything deflate makes of this input; a full output buffer means there is more
+        do {
+            stream.next_out = reinterpret_cast<Bytef *>(output.data());
+            stream.avail_out = static_cast<uInt>(output.size());
+            deflate(&stream, flush);
+            size_t produced = output.size() - stream.avail_out;
+            size_t total = 0;
+            ssize_t sent_bytes;
+            while (total < produced) {
+                if ((sent_bytes = channel_send(sockfd, output.data() + total, produced - total)) < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    std::cerr << "Error sending file: " << strerror(errno) << '\n';
+                    success = false;
+                    break;
+                }
+                total += sent_bytes;
+            }
+            if (produced > 0) {
+                tune_transfer(tuner, produced);
+            }
+        } while (success && stream.avail_out == 0);
+        input.resize(tuner.chunk);
+        output.resize(tuner.chunk);
+    }
+
+    if (success && verbose) {
+        std::cout << "Compressed " << stream.total_in << " bytes to " << stream.total_out << '\n';
+    }
+    deflateEnd(&stream);
+    return success;
+}
+
+
+/**
+ * Receive a deflate stream over a socket until it ends, and write the inflated bytes to a file, for MODE Z.
+ * @param tuner started here; counts the compressed bytes received.
+ * @param digest the checksum to add the inflated bytes to, or nullptr.
+ * @return true if okay, false on error.
+ */
+static bool inflate_descriptor(int sockfd, int fd, Tuner& tuner, Digest *digest = nullptr) {
+    start_tuning(tuner, sockfd, false);
+    z_stream stream = {};
+    if (inflateInit(&stream) != Z_OK) {
+        std::cerr << "Failed to start decompression\n";
+        return false;
+    }
+
+    std::vector<char> input(tuner.chunk), output(tuner.chunk);
+    ssize_t bytes_received;
+    int status = Z_OK;
+    bool success = true;
+    while (success && status != Z_STREAM_END) {
+        if ((bytes_received = channel_recv(sockfd, input.data(), input.size())) <= 0) {
+            if (bytes_received < 0 && errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error receiving file: "
+                      << (bytes_received < 0 ? strerror(errno) : "compressed stream ended early") << '\n';
+            success = false;
+            break;
+        }
+        tune_transfer(tuner, bytes_received);
+        stream.next_in = reinterpret_cast<Bytef *>(input.data());
+        stream.avail_in = static_cast<uInt>(bytes_received);
+
+        // write everything inflate makes of this input; a full output buffer means there is more
+        do {
+            stream.next_out = reinterpret_cast<Bytef *>(output.data());
+            stream.avail_out = static_cast<uInt>(output.size());
+            status = inflate(&stream, Z_NO_FLUSH);
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                std::cerr << "Error receiving file: corrupt compressed stream\n";
+                success = false;
+                break;
+            }
+            if (!write_all(fd, output.data(), output.size() - stream.avail_out)) {
+                success = false;
+                break;
+            }
+            digest_update(digest, output.data(), output.size() - stream.avail_out);
+        } while (status == Z_OK && stream.avail_out == 0);
+        input.resize(tuner.chunk);
+        output.resize(tuner.chunk);
+    }
+
+    if (success && verbose) {
+        std::cout << "Inflated " << stream.total_in << " bytes to " << stream.total_out << '\n';
+    }
+    inflateEnd(&stream);
+    return success;
+}
+
+
+#ifdef __linux__
+/**
+ * Unmap the rings of an io_uring instance and close it.
+ */
+static void ring_close(Ring& ring) {
+    if (ring.sqes) {
+        munmap(ring.sqes, ring.sqes_size);
+    }
+    if (ring.cq_ring && ring.cq_ring != ring.sq_ring) {
+        munmap(ring.cq_ring, ring.cq_ring_size);
+    }
+    if (ring.sq_ring) {
+        munmap(ring.sq_ring, ring.sq_ring_size);
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    ring = Ring();
+}
+
+
+/**
+ * Set up an io_uring instance with the raw system calls and map its rings.
+ * @return true if okay, false if the kernel has no io_uring or refuses it.
+ */
+static bool ring_setup(Ring& ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ring.fd < 0) {
+        return false;
+    }
+
+    // the completion ring shares one mapping with the submission ring on any recent kernel
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (single) {
+        ring.sq_ring_size = ring.cq_ring_size = std::max(ring.sq_ring_size, ring.cq_ring_size);
+    }
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sq = mmap(nullptr, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring.fd, IORING_OFF_SQ_RING);
+    void *cq = single ? sq : mmap(nullptr, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  ring.fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(nullptr, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring.fd, IORING_OFF_SQES);
+    ring.sq_ring = sq == MAP_FAILED ? nullptr : sq;
+    ring.cq_ring = cq == MAP_FAILED ? nullptr : cq;
+    ring.sqes = sqes == MAP_FAILED ? nullptr : static_cast<struct io_uring_sqe *>(sqes);
+    if (!ring.sq_ring || !ring.cq_ring || !ring.sqes) {
+        ring_close(ring);
+        return false;
+    }
+
+    char *sq_base = static_cast<char *>(ring.sq_ring);
+    char *cq_base = static_cast<char *>(ring.cq_ring);
+    ring.sq_head = reinterpret_cast<unsigned *>(sq_base + params.sq_off.head);
+    ring.sq_tail = reinterpret_cast<unsigned *>(sq_base + params.sq_off.tail);
+    ring.sq_mask = reinterpret_cast<unsigned *>(sq_base + params.sq_off.ring_mask);
+    ring.sq_array = reinterpret_cast<unsigned *>(sq_base + params.sq_off.array);
+    ring.cq_head = reinterpret_cast<unsigned *>(cq_base + params.cq_off.head);
+    ring.cq_tail = reinterpret_cast<unsigned *>(cq_base + params.cq_off.tail);
+    ring.cq_mask = reinterpret_cast<unsigned *>(cq_base + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<struct io_uring_cqe *>(cq_base + params.cq_off.cqes);
+    return true;
+}
+
+
+/**
+ * Queue one request on the submission ring; it goes to the kernel with the next ring_submit.
+ * File 0 is the local file and file 1 the socket, both registered; buffer slots are registered too if fixed.
+ * @param link the next request starts only once this one completes in full.
+ */
+static void ring_prepare(Ring& ring, uint8_t opcode, int file, int slot, char *buffer, unsigned length,
+                         long long offset, bool link) {
+    unsigned index = (*ring.sq_tail + ring.queued) & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = file;
+    sqe->flags = IOSQE_FIXED_FILE | (link ? IOSQE_IO_LINK : 0);
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = length;
+    sqe->off = offset;
+    if (opcode == IORING_OP_READ_FIXED || opcode == IORING_OP_WRITE_FIXED) {
+        sqe->buf_index = slot;
+    }
+    if (opcode == IORING_OP_SEND || opcode == IORING_OP_RECV) {
+        // a stream socket moves the whole slot or reaches the end of the stream
+        sqe->msg_flags = MSG_WAITALL;
+    }
+    sqe->user_data = static_cast<uint64_t>(slot) << 1 | (file == 1 ? 1 : 0);
+    ring.sq_array[index] = index;
+    ring.queued++;
+}
+
+
+/**
+ * Hand every queued request to the kernel and wait for that many completions, in one system call.
+ * @return true if okay, false on error.
+ */
+static bool ring_submit(Ring& ring, unsigned wait) {
+    __atomic_store_n(ring.sq_tail, *ring.sq_tail + ring.queued, __ATOMIC_RELEASE);
+    unsigned submit = ring.queued;
+    ring.queued = 0;
+    while (syscall(__NR_io_uring_enter, ring.fd, submit, wait, IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+        // interrupted while waiting, the requests are in already
+        submit = 0;
+    }
+    return true;
+}
+
+
+/**
+ * Take the oldest completion off the completion ring.
+ * @return true if there was one, false if the ring is empty.
+ */
+static bool ring_complete(Ring& ring, struct io_uring_cqe& cqe) {
+    unsigned head = *ring.cq_head;
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    cqe = ring.cqes[head & *ring.cq_mask];
+    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+/**
+ * Set up a ring for one transfer: the file and the socket become fixed files 0 and 1, and
+ * the slots of memory become fixed buffers if the kernel lets this process pin them.
+ * @return true if okay, false if io_uring is not available.
+ */
+static bool ring_attach(Ring& ring, int fd, int sockfd, std::vector<char>& memory, bool& fixed) {
+    if (!ring_setup(ring, 2 * URING_SLOTS)) {
+        return false;
+    }
+    int files[2] = {fd, sockfd};
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, 2) < 0) {
+        ring_close(ring);
+        return false;
+    }
+    memory.resize(URING_SLOTS * URING_CHUNK);
+    struct iovec slots[URING_SLOTS];
+    for (int slot = 0; slot < URING_SLOTS; slot++) {
+        slots[slot].iov_base = memory.data() + slot * URING_CHUNK;
+        slots[slot].iov_len = URING_CHUNK;
+    }
+    fixed = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, slots, URING_SLOTS) == 0;
+    return true;
+}
+
+
+/**
+ * Send a file from its current offset to the end through io_uring. Each batch is one linked chain,
+ * read slot 0, send slot 0, read slot 1, send slot 1, ..., so the sends reach the socket in order,
+ * and the whole batch costs one system call. Falls back to send_descriptor without io_uring.
+ * @return true if okay, false on error.
+ */
+static bool uring_send_descriptor(int sockfd, int fd, Tuner& tuner) {
+    struct stat st;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    Ring ring;
+    std::vector<char> memory;
+    bool fixed;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || offset < 0 || !ring_attach(ring, fd, sockfd, memory, fixed)) {
+        if (verbose) {
+            std::cout << "io_uring is not available, sending with sendfile\n";
+        }
+        return send_descriptor(sockfd, fd, tuner);
+    }
+
+    start_tuning(tuner, sockfd, true);
+    long long start = offset, submissions = 0;
+    int error = 0;
+    while (error == 0 && offset < st.st_size) {
+        unsigned lengths[URING_SLOTS];
+        int count = 0;
+        for (long long queued = offset; count < URING_SLOTS && queued < st.st_size; count++) {
+            lengths[count] = static_cast<unsigned>(std::min<long long>(URING_CHUNK, st.st_size - queued));
+            queued += lengths[count];
+        }
+        long long position = offset;
+        for (int slot = 0; slot < count; slot++) {
+            char *buffer = memory.data() + slot * URING_CHUNK;
+            ring_prepare(ring, fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, 0, slot, buffer, lengths[slot], position, true);
+            ring_prepare(ring, IORING_OP_SEND, 1, slot, buffer, lengths[slot], 0, slot + 1 < count);
+            position += lengths[slot];
+        }
+        if (!ring_submit(ring, 2 * count)) {
+            error = errno;
+            break;
+        }
+        submissions++;
+
+        // a short read or send breaks the chain and cancels the rest; the batch counts up to the first
+        // gap, including the bytes of a short send, and the next batch starts from there
+        int loaded[URING_SLOTS], sent[URING_SLOTS];
+        std::fill(loaded, loaded + URING_SLOTS, -ECANCELED);
+        std::fill(sent, sent + URING_SLOTS, -ECANCELED);
+        struct io_uring_cqe cqe;
+        while (ring_complete(ring, cqe)) {
+            int slot = static_cast<int>(cqe.user_data >> 1);
+            (cqe.user_data & 1 ? sent : loaded)[slot] = cqe.res;
+        }
+        long long before = offset;
+        for (int slot = 0; slot < count; slot++) {
+            if (loaded[slot] < 0 && loaded[slot] != -ECANCELED) {
+                error = -loaded[slot];
+                break;
+            }
+            if (sent[slot] < 0) {
+                error = sent[slot] != -ECANCELED ? -sent[slot] : 0;
+                break;
+            }
+            offset += sent[slot];
+            tune_transfer(tuner, sent[slot]);
+            if (sent[slot] < static_cast<int>(lengths[slot])) {
+                break;
+            }
+        }
+        if (error == 0 && offset == before) {
+            // the file ended before its size, or the socket takes nothing
+            error = EIO;
+        }
+    }
+    ring_close(ring);
+    lseek(fd, offset, SEEK_SET);
+
+    if (verbose) {
+        std::cout << "io_uring: sent " << (offset - start) / 1024 << " KB in " << submissions << " submissions\n";
+    }
+    if (error != 0) {
+        std::cerr << "Error sending file: " << strerror(error) << '\n';
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Receive everything sent over a socket into a file from its current offset through io_uring.
+ * Each batch is one linked chain, receive slot 0, write slot 0, receive slot 1, ..., with every
+ * receive waiting for a full slot; a short receive breaks the chain, its bytes are written by hand,
+ * and the next batch goes on from there until a receive reports the end of the stream.
+ * Falls back to receive_descriptor without io_uring.
+ * @return true if okay, false on error.
+ */
+static bool uring_receive_descriptor(int sockfd, int fd, Tuner& tuner) {
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    Ring ring;
+    std::vector<char> memory;
+    bool fixed;
+    if (offset < 0 || !ring_attach(ring, fd, sockfd, memory, fixed)) {
+        if (verbose) {
+            std::cout << "io_uring is not available, receiving with splice\n";
+        }
+        return receive_descriptor(sockfd, fd, tuner);
+    }
+
+    start_tuning(tuner, sockfd, false);
+    long long start = offset, submissions = 0;
+    int error = 0;
+    bool finished = false;
+    while (error == 0 && !finished) {
+        for (int slot = 0; slot < URING_SLOTS; slot++) {
+            char *buffer = memory.data() + slot * URING_CHUNK;
+            ring_prepare(ring, IORING_OP_RECV, 1, slot, buffer, URING_CHUNK, 0, true);
+            ring_prepare(ring, fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, 0, slot, buffer, URING_CHUNK,
+                         offset + static_cast<long long>(slot) * URING_CHUNK, slot + 1 < URING_SLOTS);
+        }
+        if (!ring_submit(ring, 2 * URING_SLOTS)) {
+            error = errno;
+            break;
+        }
+        submissions++;
+
+        int received[URING_SLOTS], written[URING_SLOTS];
+        std::fill(received, received + URING_SLOTS, -ECANCELED);
+        std::fill(written, written + URING_SLOTS, -ECANCELED);
+        struct io_uring_cqe cqe;
+        while (ring_complete(ring, cqe)) {
+            int slot = static_cast<int>(cqe.user_data >> 1);
+            (cqe.user_data & 1 ? received : written)[slot] = cqe.res;
+        }
+        for (int slot = 0; slot < URING_SLOTS && error == 0 && !finished; slot++) {
+            if (received[slot] < 0) {
+                error = -received[slot];
+            } else if (received[slot] == 0) {
+                finished = true;
+            } else if (received[slot] < URING_CHUNK) {
+                // a signal or the last bytes before the end of the stream; the write linked behind it and
+                // the rest of the batch were cancelled, so the next batch starts right after these bytes
+                char *buffer = memory.data() + slot * URING_CHUNK;
+                if (lseek(fd, offset, SEEK_SET) < 0 || !write_all(fd, buffer, received[slot])) {
+                    ring_close(ring);
+                    return false;
+                }
+                offset += received[slot];
+                tune_transfer(tuner, received[slot]);
+                break;
+            } else if (written[slot] != URING_CHUNK) {
+                error = written[slot] < 0 ? -written[slot] : EIO;
+            } else {
+                offset += URING_CHUNK;
+            }
+            tune_transfer(tuner, std::max(received[slot], 0));
+        }
+    }
+    ring_close(ring);
+    lseek(fd, offset, SEEK_SET);
+
+    if (verbose) {
+        std::cout << "io_uring: received " << (offset - start) / 1024 << " KB in " << submissions << " submissions\n";
+    }
+    if (error != 0) {
+        std::cerr << "Error receiving file: " << strerror(error) << '\n';
+        return false;
+    }
+    return true;
+}
+#endif
+
+
+bool upload_file(int control_sockfd, std::string& local_path, std::string& remote_path) {
+    // handle remote file name
     if (remote_path.back() == '/') {
         std::string filename = local_path.substr(local_path.find_last_of('/') + 1);
         remote_path += filename;
     }
-
-    // open local file for reading
-    std::ifstream local_file(local_path, std::ios::binary);
-    if (!local_file) {
-        std::cerr << "Failed to open local file for reading " << local_path << '\n';
+
+    // open local file for reading
+    int fd = open(local_path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || S_ISDIR(st.st_mode)) {
+        std::cerr << "Failed to open local file for reading " << local_path << '\n';
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    // with --continue, start where the remote copy ends. Only SIZE says what the server stored: bytes
+    // still in flight when a connection drops never arrive, so without SIZE the upload starts over
+    long long offset = 0;
+    if (resume) {
+        bool done;
+        long long recorded = journal_offset(local_path, remote_path, done);
+        if (done && recorded == st.st_size) {
+            close(fd);
+            if (verbose) {
+                std::cout << "Skipped: " << local_path << " already uploaded\n";
+            }
+            return true;
+        }
+        offset = std::max(remote_size(control_sockfd, remote_path), 0LL);
+        if (offset == st.st_size) {
+            close(fd);
+            record_progress(local_path, remote_path, offset, true);
+            if (verbose) {
+                std::cout << "Skipped: " << remote_path << " is already complete\n";
+            }
+            return true;
+        }
+        offset = offset > st.st_size ? 0 : offset;
+    }
+
+    // a deflate stream always starts at the beginning of the file, so resumed uploads stay in MODE S
+    bool deflate = offset == 0 && worth_compressing(local_path, fd, st.st_size);
+    if (!set_mode(control_sockfd, deflate)) {
+        close(fd);
+        return false;
+    }
+
+    // with --verify, the checksum covers the whole file: the part the server has is read here,
+    // the rest is added as it is sent
+    Digest digest;
+    Digest *checksum = verify && !checksum_command.empty() ? &digest : nullptr;
+    if (checksum && (!digest_start(digest) || !digest_range(digest, fd, 0, offset))) {
+        close(fd);
+        return false;
+    }
+
+    // open data channel
+    Metrics metrics;
+    metrics.kind = "upload";
+    metrics.path = remote_path;
+    auto step = std::chrono::steady_clock::now();
+    int data_sockfd;
+    if ((data_sockfd = open_data_channel(control_sockfd)) < 0) {
+        close(fd);
+        record_metrics(metrics);
+        return false;
+    }
+    metrics.passive_ms = elapsed_ms(step);
+
+    // REST then STOR overwrites from the offset; servers without REST append with APPE instead
+    std::string command = "STOR";
+    std::string response;
+    if (offset > 0) {
+        send_message(control_sockfd, "REST", std::to_string(offset));
+        response = read_response(control_sockfd);
+        if (response_code(response) != CODE_RSTRT) {
+            command = "APPE";
+        }
+        lseek(fd, offset, SEEK_SET);
+    }
+
+    // send STOR command through control channel
+    step = std::chrono::steady_clock::now();
+    send_message(control_sockfd, command, remote_path);
+    response = read_response(control_sockfd);
+    int code = response_code(response);
+    if (code != CODE_STXFR) {
+        std::cerr << "Failed to start upload " << response << '\n';
+        close_channel(data_sockfd);
+        close(fd);
+        record_metrics(metrics);
+        return false;
+    }
+    if (!start_data_tls(control_sockfd, data_sockfd)) {
+        close_channel(data_sockfd);
+        close(fd);
+        read_response(control_sockfd);
+        record_metrics(metrics);
+        return false;
+    }
+
+    // send binary file through data channel
+    Tuner tuner;
+#ifdef __linux__
+    bool sent = deflate ? deflate_descriptor(data_sockfd, fd, tuner, checksum)
+                : uring && !checksum && !tls ? uring_send_descriptor(data_sockfd, fd, tuner)
+                : send_descriptor(data_sockfd, fd, tuner, checksum);
+#else
+    bool sent = deflate ? deflate_descriptor(data_sockfd, fd, tuner, checksum)
+                        : send_descriptor(data_sockfd, fd, tuner, checksum);
+#endif
+    long long reached = lseek(fd, 0, SEEK_CUR);
+    auto data_end = std::chrono::steady_clock::now();
+    measure_data(metrics, tuner, step, data_end);
+
+    // clean up
+    close(fd);
+    close_channel(data_sockfd, sent);
+    if (!sent) {
+        record_progress(local_path, remote_path, offset, false);
+        forget_listing(control_sockfd, remote_path);
+        read_response(control_sockfd);
+        record_metrics(metrics);
+        return false;
+    }
+
+    // ask for the next data channel now, the server answers right after the transfer reply
+    if (prefetch) {
+        request_data_channel(control_sockfd);
+    }
+
+    response = read_response(control_sockfd);
+    metrics.complete_ms = elapsed_ms(data_end);
+    if ((code = response_code(response)) != CODE_DSUCC) {
+        std::cerr << "Failed to finish STOR command " << response << '\n';
+        record_progress(local_path, remote_path, offset, false);
+        forget_listing(control_sockfd, remote_path);
+        record_metrics(metrics);
+        return false;
+    }
+    if (checksum && !verify_checksum(control_sockfd, remote_path, digest_finish(digest))) {
+        // a resumed upload would keep the bad bytes, so the next attempt starts over
+        record_progress(local_path, remote_path, 0, false);
+        forget_listing(control_sockfd, remote_path);
+        record_metrics(metrics);
+        return false;
+    }
+    record_progress(local_path, remote_path, reached, true);
+    note_upload(control_sockfd, remote_path, reached);
+    metrics.success = true;
+    record_metrics(metrics);
+    if (verbose) {
+        std::cout << "Success: file uploaded as " << remote_path << (offset > 0 ? " from byte " + std::to_string(offset) : "")
+                  << (deflate ? " in MODE Z" : "") << '\n';
+    }
+    return true;
+}
+
+
+bool download_file(int control_sockfd, std::string& remote_path, std::string& local_path, long long size) {
+    // handle local file name
+    if (local_path.empty() || local_path.back() == '/') {
+        std::string filename = remote_path.substr(remote_path.find_last_of('/') + 1);
+        local_path += filename;
+    }
+
+    // with --continue, start where the local copy ends
+    long long offset = 0;
+    struct stat st;
+    if (resume && stat(local_path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        bool done;
+        long long recorded = journal_offset(local_path, remote_path, done);
+        if (done && recorded == st.st_size) {
+            if (verbose) {
+                std::cout << "Skipped: " << remote_path << " already downloaded\n";
+            }
+            return true;
+        }
+        offset = st.st_size;
+        size = remote_size(control_sockfd, remote_path);
+        if (size == offset) {
+            record_progress(local_path, remote_path, offset, true);
+            if (verbose) {
+                std::cout << "Skipped: " << local_path << " is already complete\n";
+            }
+            return true;
+        }
+        offset = size >= 0 && size < offset ? 0 : offset;   // the remote file was replaced by a shorter one
+    }
+
+    // as for uploads, only whole files are fetched in MODE Z
+    bool deflate = offset == 0 && worth_compressing(remote_path, -1, size);
+    if (!set_mode(control_sockfd, deflate)) {
+        return false;
+    }
+
+    // open local file for writing, and for reading back the part a resumed download keeps
+    Digest digest;
+    Digest *checksum = verify && !checksum_command.empty() ? &digest : nullptr;
+    int fd = open(local_path.c_str(), (checksum ? O_RDWR : O_WRONLY) | O_CREAT | (offset > 0 ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to open local file for writing " << local_path << '\n';
+        return false;
+    }
+
+    // open data channel
+    Metrics metrics;
+    metrics.kind = "download";
+    metrics.path = remote_path;
+    auto step = std::chrono::steady_clock::now();
+    int data_sockfd;
+    if ((data_sockfd = open_data_channel(control_sockfd)) < 0) {
+        close(fd);
+        record_metrics(metrics);
+        return false;
+    }
+    metrics.passive_ms = elapsed_ms(step);
+
+    // the server starts sending at the offset, or from the start if it refuses REST
+    std::string response;
+    if (offset > 0) {
+        send_message(control_sockfd, "REST", std::to_string(offset));
+        response = read_response(control_sockfd);
+        if (response_code(response) != CODE_RSTRT) {
+            offset = 0;
+        }
+    }
+    if (lseek(fd, offset, SEEK_SET) < 0 || ftruncate(fd, offset) < 0) {
+        std::cerr << "Failed to open local file for writing " << local_path << '\n';
+        close_channel(data_sockfd);
+        close(fd);
+        return false;
+    }
+    if (checksum && (!digest_start(digest) || !digest_range(digest, fd, 0, offset))) {
+        close_channel(data_sockfd);
+        close(fd);
+        return false;
+    }
+
+    // send RETR command through control channel
+    step = std::chrono::steady_clock::now();
+    send_message(control_sockfd, "RETR", remote_path);
+    response = read_response(control_sockfd);
+    int code = response_code(response);
+    if (code != CODE_STXFR) {
+        std::cerr << "Failed to start download " << response << '\n';
+        close_channel(data_sockfd);
+        close(fd);
+        record_metrics(metrics);
+        return false;
+    }
+    if (!start_data_tls(control_sockfd, data_sockfd)) {
+        close_channel(data_sockfd);
+        close(fd);
+        read_response(control_sockfd);
+        record_metrics(metrics);
+        return false;
+    }
+
+    // receive file data through data channel
+    Tuner tuner;
+#ifdef __linux__
+    bool received = deflate ? inflate_descriptor(data_sockfd, fd, tuner, checksum)
+                    : uring && !checksum && !tls ? uring_receive_descriptor(data_sockfd, fd, tuner)
+                    : receive_descriptor(data_sockfd, fd, tuner, checksum);
+#else
+    bool received = deflate ? inflate_descriptor(data_sockfd, fd, tuner, checksum)
+                            : receive_descriptor(data_sockfd, fd, tuner, checksum);
+#endif
+    long long reached = lseek(fd, 0, SEEK_CUR);
+    auto data_end = std::chrono::steady_clock::now();
+    measure_data(metrics, tuner, step, data_end);
+
+    // clean up
+    close(fd);
+    close_channel(data_sockfd);
+    if (!received) {
+        record_progress(local_path, remote_path, reached, false);
+    } else if (prefetch) {
+        // ask for the next data channel now, the server answers right after the transfer reply
+        request_data_channel(control_sockfd);
+    }
+    response = read_response(control_sockfd);
+    metrics.complete_ms = elapsed_ms(data_end);
+    if (!received) {
+        record_metrics(metrics);
+        return false;
+    }
+    if ((code = response_code(response)) != CODE_DSUCC) {
+        std::cerr << "Failed to finish RETR command " << response << '\n';
+        record_progress(local_path, remote_path, reached, false);
+        record_metrics(metrics);
+        return false;
+    }
+    if (checksum && !verify_checksum(control_sockfd, remote_path, digest_finish(digest))) {
+        record_progress(local_path, remote_path, 0, false);
+        record_metrics(metrics);
         return false;
     }
+    record_progress(local_path, remote_path, reached, true);
+    metrics.success = true;
+    record_metrics(metrics);
+    if (verbose) {
+        std::cout << "Success: file downloaded as " << local_path << (offset > 0 ? " from byte " + std::to_string(offset) : "")
+                  << (deflate ? " in MODE Z" : "") << '\n';
+    }
+    return true;
+}
 
-    // open data channel
+
+long long remote_size(int sockfd, const std::string& path) {
+    Entry entry;
+    int cached = cached_entry(sockfd, path, true, entry);
+    if (cached == 0) {
+        return -1;
+    }
+    if (cached > 0 && !entry.directory && entry.size >= 0) {
+        return entry.size;
+    }
+    send_message(sockfd, "SIZE", path);
+    std::string response = read_response(sockfd);
+    if (response_code(response) != CODE_FSTAT || response.length() < 5) {
+        return -1;
+    }
+    // a reply that is not a plain number counts as no size
+    const char *digits = response.c_str() + 4;
+    char *end;
+    errno = 0;
+    long long size = std::strtoll(digits, &end, 10);
+    if (end == digits || errno == ERANGE || size < 0 || (*end != '\0' && !isspace(static_cast<unsigned char>(*end)))) {
+        return -1;
+    }
+    return size;
+}
+
+
+/**
+ * Fetch one byte range of a remote file and write it at the same offset of the local file.
+ * @return true if every byte of the range is written, false on error.
+ */
+static bool download_segment(int control_sockfd, const std::string& remote_path, int fd,
+                             long long offset, long long length) {
+    Metrics metrics;
+    metrics.kind = "segment";
+    metrics.path = remote_path + " @" + std::to_string(offset);
+
+    // byte ranges count bytes of the file, so they are always fetched in MODE S
+    bool deflate = false;
+    if (!set_mode(control_sockfd, deflate)) {
+        record_metrics(metrics);
+        return false;
+    }
+    auto step = std::chrono::steady_clock::now();
     int data_sockfd;
     if ((data_sockfd = open_data_channel(control_sockfd)) < 0) {
-        local_file.close();
+        record_metrics(metrics);
         return false;
     }
+    metrics.passive_ms = elapsed_ms(step);
 
-    // send STOR command through control channel
-    send_message(control_sockfd, "STOR", remote_path);
+    // start the transfer at the beginning of the range
+    send_message(control_sockfd, "REST", std::to_string(offset));
     std::string response = read_response(control_sockfd);
-    int code = response_code(response);
-    if (code != CODE_STXFR) {
-        std::cerr << "Failed to start upload " << response << '\n';
-        close(data_sockfd);
-        local_file.close();
+    if (response_code(response) != CODE_RSTRT) {
+        std::cerr << "Server does not support REST: " << response << '\n';
+        close_channel(data_sockfd);
+        record_metrics(metrics);
+        return false;
+    }
+    step = std::chrono::steady_clock::now();
+    send_message(control_sockfd, "RETR", remote_path);
+    response = read_response(control_sockfd);
+    if (response_code(response) != CODE_STXFR) {
+        std::cerr << "Failed to start download " << response << '\n';
+        close_channel(data_sockfd);
+        record_metrics(metrics);
+        return false;
+    }
+    if (!start_data_tls(control_sockfd, data_sockfd)) {
+        close_channel(data_sockfd);
+        read_response(control_sockfd);
+        record_metrics(metrics);
         return false;
     }
 
-    // send binary file through data channel
-    char buffer[4096];
-    ssize_t total, sent, remain;
-    while (local_file.read(buffer, sizeof(buffer)) || local_file.gcount() > 0) {
-        total = 0;
-        remain = local_file.gcount();
-        while (total < remain) {
-            if ((sent = send(data_sockfd, buffer + total, remain - total, 0)) == -1) {
-                std::cerr << "Error sending file: " << strerror(errno) << '\n';
-                close(data_sockfd);
-                local_file.close();
+    // stop reading at the end of the range, the next segment covers the rest
+    Tuner tuner;
+    start_tuning(tuner, data_sockfd, false);
+    std::vector<char> buffer(tuner.chunk);
+    long long received = 0;
+    ssize_t bytes_received = 0;
+    while (received < length) {
+        auto want = static_cast<size_t>(std::min<long long>(buffer.size(), length - received));
+        if ((bytes_received = channel_recv(data_sockfd, buffer.data(), want)) <= 0) {
+            break;
+        }
+        ssize_t written = 0, total = 0;
+        while (total < bytes_received) {
+            if ((written = pwrite(fd, buffer.data() + total, bytes_received - total, offset + received + total)) < 0) {
+                std::cerr << "Error writing file: " << strerror(errno) << '\n';
+                close_channel(data_sockfd);
+                record_metrics(metrics);
                 return false;
             }
-            total += sent;
+            total += written;
         }
+        received += bytes_received;
+        tune_transfer(tuner, bytes_received);
+        buffer.resize(tuner.chunk);
     }
-
-    // clean up
-    local_file.close();
-    close(data_sockfd);
-
-    response = read_response(control_sockfd);
-    if ((code = response_code(response)) != CODE_DSUCC) {
-        std::cerr << "Failed to finish STOR command " << response << '\n';
+    auto data_end = std::chrono::steady_clock::now();
+    measure_data(metrics, tuner, step, data_end);
+    close_channel(data_sockfd);
+    if (received < length) {
+        std::cerr << "Error receiving segment at " << offset << ": "
+                  << (bytes_received < 0 ? strerror(errno) : "connection closed early") << '\n';
+        record_metrics(metrics);
         return false;
     }
-    if (verbose) {
-        std::cout << "Success: file uploaded as " << remote_path << '\n';
-    }
-    return true;
+
+    // closing the data channel early makes the server abort the transfer, which is expected
+    response = read_response(control_sockfd);
+    metrics.complete_ms = elapsed_ms(data_end);
+    int code = response_code(response);
+    metrics.success = code == CODE_DSUCC || code == CODE_ABORT || code == CODE_LOCAL;
+    record_metrics(metrics);
+    return metrics.success;
 }
 
 
-bool download_file(int control_sockfd, std::string& remote_path, std::string& local_path) {
+bool download_segmented(int control_sockfd, const FTP& ftp, const std::string& remote_path,
+                        std::string& local_path, int segments) {
+    long long size = remote_size(control_sockfd, remote_path);
+    segments = size < 0 ? 1 : static_cast<int>(std::min<long long>(segments, size / SEGMENT_MIN));
+    // small files, or servers without SIZE, use a single connection
+    if (segments < 2) {
+        std::string path = remote_path;
+        return download_file(control_sockfd, path, local_path, size);
+    }
+
     // handle local file name
     if (local_path.empty() || local_path.back() == '/') {
         std::string filename = remote_path.substr(remote_path.find_last_of('/') + 1);
         local_path += filename;
     }
 
-    // open local file for writing
-    std::ofstream outfile(local_path, std::ios::binary);
-    if (!outfile) {
+    // preallocate the local file so every segment can write at its own offset
+    int fd = open(local_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
         std::cerr << "Failed to open local file for writing " << local_path << '\n';
+        if (fd >= 0) {
+            close(fd);
+        }
         return false;
     }
 
-    // open data channel
-    int data_sockfd;
-    if ((data_sockfd = open_data_channel(control_sockfd)) < 0) {
-        outfile.close();
+    // the first segment reuses this session, every other one logs in on its own connection
+    std::vector<char> results(segments, 0);
+    std::vector<std::thread> workers;
+    for (int k = 0; k < segments; k++) {
+        long long offset = size * k / segments;
+        long long length = size * (k + 1) / segments - offset;
+        workers.emplace_back([&, k, offset, length]() {
+            if (k == 0) {
+                results[k] = download_segment(control_sockfd, remote_path, fd, offset, length);
+                return;
+            }
+            int sockfd = open_session(ftp);
+            if (sockfd < 0) {
+                return;
+            }
+            results[k] = download_segment(sockfd, remote_path, fd, offset, length);
+            quit_connection(sockfd);
+            close(sockfd);
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    close(fd);
+
+    if (std::find(results.begin(), results.end(), 0) != results.end()) {
+        std::cerr << "Failed to download " << remote_path << '\n';
         return false;
     }
 
-    // send RETR command through control channel
-    send_message(control_sockfd, "RETR", remote_path);
-    std::string response = read_response(control_sockfd);
+    // the ranges arrive out of order, so the checksum is taken from the file once they are all
+    // written, while its pages are still cached
+    if (verify && !checksum_command.empty()) {
+        Digest digest;
+        fd = open(local_path.c_str(), O_RDONLY);
+        bool read = fd >= 0 && digest_start(digest) && digest_range(digest, fd, 0, size);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!read || !verify_checksum(control_sockfd, remote_path, digest_finish(digest))) {
+            return false;
+        }
+    }
+    if (verbose) {
+        std::cout << "Success: file downloaded as " << local_path << " in " << segments << " segments\n";
+    }
+    return true;
+}
+
+
+/**
+ * Point the source at a passive port of the target and let the two servers move the file between themselves.
+ * @param metrics filled in with the passive and transfer times.
+ * @return 1 if the file is copied, 0 if the servers refuse a direct transfer, -1 on any other error.
+ */
+static int copy_direct(int source_sockfd, const std::string& source_path, int target_sockfd,
+                       const std::string& target_path, Metrics& metrics) {
+    // a data channel prefetched by either session would be taken by a command meant for the other server
+    for (int sockfd : {source_sockfd, target_sockfd}) {
+        int stale = take_data_channel(sockfd);
+        if (stale >= 0) {
+            close(stale);
+        }
+    }
+
+    auto step = std::chrono::steady_clock::now();
+    Endpoint endpoint;
+    int result;
+    while ((result = read_passive(target_sockfd, send_passive(target_sockfd), endpoint)) == 0) {
+        // the server does not know EPSV, ask again with PASV
+        ;
+    }
+    if (result < 0) {
+        return -1;
+    }
+
+    // PORT takes an IPv4 address and port as six decimal bytes, EPRT takes any address
+    std::string host = endpoint.host;
+    int port = std::atoi(endpoint.port);
+    if (host.find(':') == std::string::npos) {
+        std::replace(host.begin(), host.end(), '.', ',');
+        send_message(source_sockfd, "PORT", host + "," + std::to_string(port >> 8) + "," + std::to_string(port & 0xff));
+    } else {
+        send_message(source_sockfd, "EPRT", "|2|" + host + "|" + std::to_string(port) + "|");
+    }
+    std::string response = read_response(source_sockfd);
+    if (response_code(response) != CODE_CMPLT) {
+        if (verbose) {
+            std::cout << "Source refuses to connect to another server: " << response << '\n';
+        }
+        return 0;
+    }
+    metrics.passive_ms = elapsed_ms(step);
+
+    // RETR goes first, so a missing source file leaves nothing behind on the target;
+    // the source's connection waits in the target's backlog until STOR takes it
+    step = std::chrono::steady_clock::now();
+    send_message(source_sockfd, "RETR", source_path);
+    response = read_response(source_sockfd);
     int code = response_code(response);
+    if (code == CODE_NODATA) {
+        if (verbose) {
+            std::cout << "Source cannot reach the target: " << response << '\n';
+        }
+        return 0;
+    }
     if (code != CODE_STXFR) {
         std::cerr << "Failed to start download " << response << '\n';
-        close(data_sockfd);
-        outfile.close();
-        return false;
+        return -1;
+    }
+    send_message(target_sockfd, "STOR", target_path);
+    response = read_response(target_sockfd);
+    code = response_code(response);
+    if (code != CODE_STXFR) {
+        // the source ends its transfer, then answers ABOR; give up waiting if either reply is slow
+        send_message(source_sockfd, "ABOR");
+        for (int i = 0; i < 2 && response_ready(source_sockfd, PIPELINE_TIMEOUT); i++) {
+            read_response(source_sockfd);
+        }
+        // a target that only takes data connections from our own address says 425
+        if (code == CODE_NODATA) {
+            if (verbose) {
+                std::cout << "Target refuses a connection from another server: " << response << '\n';
+            }
+            return 0;
+        }
+        std::cerr << "Failed to start upload " << response << '\n';
+        return -1;
     }
 
-    // receive file data through data channel
-    char buffer[4096];
-    ssize_t bytes_received;
-    while ((bytes_received = recv(data_sockfd, buffer, sizeof(buffer), 0)) > 0) {
-        outfile.write(buffer, bytes_received);
+    std::string source_end = read_response(source_sockfd);
+    std::string target_end = read_response(target_sockfd);
+    metrics.transfer_ms = elapsed_ms(step);
+    if (response_code(source_end) == CODE_NODATA) {
+        return 0;
+    }
+    if (response_code(source_end) != CODE_DSUCC) {
+        std::cerr << "Failed to finish RETR command " << source_end << '\n';
+        return -1;
+    }
+    if (response_code(target_end) != CODE_DSUCC) {
+        std::cerr << "Failed to finish STOR command " << target_end << '\n';
+        return -1;
+    }
+    return 1;
+}
+
+
+/**
+ * Move everything one data channel receives to another until the sender closes it.
+ * On Linux plain channels are spliced through a pipe, so the bytes never reach user space;
+ * TLS channels take a recv and send loop through one buffer.
+ * @param tuner started here on the receiving channel; keeps the byte count and timings for the caller's metrics.
+ * @return true if okay, false on error.
+ */
+static bool relay_channel(int from_sockfd, int to_sockfd, Tuner& tuner) {
+    start_tuning(tuner, from_sockfd, false);
+#ifdef __linux__
+    int pipefd[2];
+    if (!tls_for(from_sockfd) && !tls_for(to_sockfd) && pipe(pipefd) == 0) {
+        size_t pipe_size = tuner.chunk;
+        fcntl(pipefd[1], F_SETPIPE_SZ, pipe_size);
+        ssize_t moved, written;
+        bool failed = false;
+        while (!failed && (moved = splice(from_sockfd, nullptr, pipefd[1], nullptr, pipe_size,
+                                          SPLICE_F_MOVE | SPLICE_F_MORE)) != 0) {
+            if (moved < 0) {
+                if (errno != EINTR) {
+                    failed = true;
+                }
+                continue;
+            }
+            for (ssize_t left = moved; left > 0 && !failed; ) {
+                if ((written = splice(pipefd[0], nullptr, to_sockfd, nullptr, left, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) {
+                    left -= written;
+                } else if (errno != EINTR) {
+                    failed = true;
+                }
+            }
+            if (!failed) {
+                tune_transfer(tuner, moved);
+                if (tuner.chunk > pipe_size && fcntl(pipefd[1], F_SETPIPE_SZ, tuner.chunk) > 0) {
+                    pipe_size = tuner.chunk;
+                }
+            }
+        }
+        int error = errno;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (!failed) {
+            return true;
+        }
+        // sockets that cannot splice fail before anything moved; the loop below takes over
+        if (tuner.total_bytes > 0 || (error != EINVAL && error != ENOSYS)) {
+            std::cerr << "Error relaying file: " << strerror(error) << '\n';
+            return false;
+        }
+    }
+#endif
+
+    std::vector<char> buffer(tuner.chunk);
+    ssize_t bytes_received, total, sent_bytes;
+    while ((bytes_received = channel_recv(from_sockfd, buffer.data(), buffer.size())) > 0) {
+        for (total = 0; total < bytes_received; total += sent_bytes) {
+            if ((sent_bytes = channel_send(to_sockfd, buffer.data() + total, bytes_received - total)) == -1) {
+                std::cerr << "Error relaying file: " << strerror(errno) << '\n';
+                return false;
+            }
+        }
+        tune_transfer(tuner, bytes_received);
+        buffer.resize(tuner.chunk);
     }
     if (bytes_received < 0) {
-        std::cerr << "Error receiving file: " << strerror(errno) << '\n';
-        close(data_sockfd);
-        outfile.close();
+        std::cerr << "Error relaying file: " << strerror(errno) << '\n';
         return false;
     }
+    return true;
+}
 
-    // clean up
-    outfile.close();
-    close(data_sockfd);
-    response = read_response(control_sockfd);
-    if ((code = response_code(response)) != CODE_DSUCC) {
-        std::cerr << "Failed to finish RETR command " << response << '\n';
+
+/**
+ * Copy a file through this machine: RETR on one data channel of ours, STOR on another, and the bytes
+ * relayed between them in memory.
+ * @param metrics filled in like the metrics of a download.
+ * @return true if okay, false on error.
+ */
+static bool copy_relayed(int source_sockfd, const std::string& source_path, int target_sockfd,
+                         const std::string& target_path, Metrics& metrics) {
+    auto step = std::chrono::steady_clock::now();
+    int in_sockfd, out_sockfd = -1;
+    if ((in_sockfd = open_data_channel(source_sockfd)) < 0 || (out_sockfd = open_data_channel(target_sockfd)) < 0) {
+        if (in_sockfd >= 0) {
+            close_channel(in_sockfd);
+        }
+        return false;
+    }
+    metrics.passive_ms = elapsed_ms(step);
+
+    step = std::chrono::steady_clock::now();
+    send_message(source_sockfd, "RETR", source_path);
+    std::string response = read_response(source_sockfd);
+    if (response_code(response) != CODE_STXFR) {
+        std::cerr << "Failed to start download " << response << '\n';
+        close_channel(in_sockfd);
+        close_channel(out_sockfd);
+        return false;
+    }
+    if (!start_data_tls(source_sockfd, in_sockfd)) {
+        close_channel(in_sockfd);
+        close_channel(out_sockfd);
+        read_response(source_sockfd);
+        return false;
+    }
+    send_message(target_sockfd, "STOR", target_path);
+    response = read_response(target_sockfd);
+    if (response_code(response) != CODE_STXFR) {
+        std::cerr << "Failed to start upload " << response << '\n';
+        // the source ends the transfer we walk away from with 426, or 226 if it was all sent
+        close_channel(in_sockfd);
+        close_channel(out_sockfd);
+        read_response(source_sockfd);
+        return false;
+    }
+    if (!start_data_tls(target_sockfd, out_sockfd)) {
+        close_channel(in_sockfd);
+        close_channel(out_sockfd);
+        read_response(source_sockfd);
+        read_response(target_sockfd);
+        return false;
+    }
+
+    Tuner tuner;
+    bool relayed = relay_channel(in_sockfd, out_sockfd, tuner);
+    auto data_end = std::chrono::steady_clock::now();
+    measure_data(metrics, tuner, step, data_end);
+    if (!relayed) {
+        // a plain close would look like the end of the file; a reset makes the target fail the STOR
+        struct linger reset = {1, 0};
+        setsockopt(out_sockfd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    }
+    close_channel(in_sockfd);
+    close_channel(out_sockfd, relayed);
+    std::string source_end = read_response(source_sockfd);
+    std::string target_end = read_response(target_sockfd);
+    metrics.complete_ms = elapsed_ms(data_end);
+    if (!relayed) {
+        return false;
+    }
+    if (response_code(source_end) != CODE_DSUCC) {
+        std::cerr << "Failed to finish RETR command " << source_end << '\n';
         return false;
     }
+    if (response_code(target_end) != CODE_DSUCC) {
+        std::cerr << "Failed to finish STOR command " << target_end << '\n';
+        return false;
+    }
+    return true;
+}
+
+
+bool copy_remote_file(int source_sockfd, const std::string& source_path, int target_sockfd,
+                      std::string target_path, long long size, bool& direct) {
+    // handle target file name
+    if (target_path.back() == '/') {
+        target_path += source_path.substr(source_path.find_last_of('/') + 1);
+    }
+    // both servers keep the file as it is, so both data channels stay in MODE S
+    bool deflate = false;
+    if (!set_mode(source_sockfd, deflate) || !set_mode(target_sockfd, deflate)) {
+        return false;
+    }
+    if (size < 0 && (stats || stats_json.is_open())) {
+        size = remote_size(source_sockfd, source_path);
+    }
+
+    Metrics metrics;
+    metrics.kind = "copy";
+    metrics.path = target_path;
+    metrics.bytes = std::max(size, 0LL);
+    // a protected channel between two servers needs SSCN or CPSV, which few servers have,
+    // so with --tls every file goes through this machine
+    int result = 0;
+    if (direct && !tls) {
+        result = copy_direct(source_sockfd, source_path, target_sockfd, target_path, metrics);
+        if (result == 0) {
+            direct = false;
+            if (verbose) {
+                std::cout << "Servers refuse a direct transfer, relaying through this machine\n";
+            }
+        }
+    }
+    bool relayed = result == 0;
+    metrics.success = result > 0 || (relayed && copy_relayed(source_sockfd, source_path, target_sockfd,
+                                                             target_path, metrics));
+    record_metrics(metrics);
+    if (!metrics.success) {
+        forget_listing(target_sockfd, target_path);
+        return false;
+    }
+    if (relayed || size >= 0) {
+        note_upload(target_sockfd, target_path, relayed ? metrics.bytes : size);
+    } else {
+        forget_listing(target_sockfd, target_path);
+    }
     if (verbose) {
-        std::cout << "Success: file downloaded as " << local_path << '\n';
+        std::cout << "Success: file copied to " << target_path
+                  << (relayed ? " through this machine" : " server to server") << '\n';
     }
     return true;
 }
 
 
+bool copy_between_servers(int source_sockfd, const FTP& source, const FTP& target, bool move) {
+    int target_sockfd = open_session(target);
+    if (target_sockfd < 0) {
+        return false;
+    }
+
+    // the first refusal sends every later file of the job through the relay
+    bool direct = true;
+    bool success = true;
+    if (!recursive) {
+        success = copy_remote_file(source_sockfd, source.path, target_sockfd, target.path, -1, direct)
+                  && (!move || remove_file(source_sockfd, source.path));
+    } else {
+        std::string source_root = source.path;
+        while (source_root.length() > 1 && source_root.back() == '/') {
+            source_root.pop_back();
+        }
+        // handle target directory name
+        std::string target_root = target.path;
+        if (target_root.back() == '/') {
+            target_root += source_root.substr(source_root.find_last_of('/') + 1);
+        }
+
+        // walk the source tree breadth first, so a target directory is made before its children;
+        // a directory that already exists is not an error
+        std::vector<std::string> directories = {source_root};
+        for (size_t i = 0; i < directories.size(); i++) {
+            std::string source_dir = directories[i];
+            std::string relative = source_dir.substr(source_root.length());
+            std::string target_dir = relative.empty() ? target_root
+                                                      : join_path(target_root, relative.substr(relative[0] == '/'));
+            make_directory(target_sockfd, target_dir, true);
+
+            std::vector<Entry> entries;
+            if (!list_entries(source_sockfd, source_dir, entries)) {
+                success = false;
+                break;
+            }
+            for (const Entry& entry : entries) {
+                std::string source_path = join_path(source_dir, entry.name);
+                if (entry.directory) {
+                    directories.push_back(source_path);
+                } else if (!copy_remote_file(source_sockfd, source_path, target_sockfd,
+                                             join_path(target_dir, entry.name), entry.size, direct)) {
+                    success = false;
+                } else if (move) {
+                    remove_file(source_sockfd, source_path);
+                }
+            }
+        }
+        // deepest directories first, once every file is gone
+        for (auto it = directories.rbegin(); move && success && it != directories.rend(); ++it) {
+            success = remove_directory(source_sockfd, *it);
+        }
+    }
+
+    quit_connection(target_sockfd);
+    close(target_sockfd);
+    return success;
+}
+
+
 void quit_connection(int sockfd) {
+    // a data channel prefetched for a transfer that never came
+    int data_sockfd = take_data_channel(sockfd);
+    if (data_sockfd >= 0) {
+        close(data_sockfd);
+    }
     send_message(sockfd, "QUIT");
     std::string response = read_response(sockfd);
+    tls_forget(sockfd, true);
     int code = response_code(response);
     if (code != CODE_CLOSE) {
         std::cerr << "Quit error" << response << '\n';
@@ -498,64 +4843,155 @@ void quit_connection(int sockfd) {
 }
 
 
+bool run_operation(int sockfd, const std::string& operation, const std::string& param1,
+                   const std::string& param2, FTP& ftp) {
+    bool success = false;
+    if (operation == "ls") {
+        success = list_directory(sockfd, ftp.path);
+    } else if (operation == "mkdir") {
+        success = make_directory(sockfd, ftp.path);
+    } else if (operation == "rmdir") {
+        success = remove_directory(sockfd, ftp.path);
+    } else if (operation == "rm") {
+        success = remove_file(sockfd, ftp.path);
+    } else {
+        bool is_download = param1.find("ftp://") == 0;
+        std::string local_path = is_download ? param2 : param1;
+        // two URLs copy a file or tree from one server to the other
+        FTP target;
+        if (is_download && parse_url(param2, "", target)) {
+            if (operation == "sync") {
+                std::cerr << "sync between two servers is not supported\n";
+                return false;
+            }
+            return copy_between_servers(sockfd, ftp, target, operation == "mv");
+        }
+        prefetch = prefetch || recursive || operation == "sync";
+        if (operation == "sync") {
+            return sync_tree(sockfd, ftp, local_path, ftp.path, !is_download, delete_extra);
+        }
+        if (recursive) {
+            // whole trees; mv removes each source file once it is copied
+            bool move = operation == "mv";
+            return is_download ? download_tree(sockfd, ftp, ftp.path, local_path, move)
+                               : upload_tree(sockfd, ftp, local_path, ftp.path, move);
+        }
+        if (is_download && jobs > 1) {
+            success = download_segmented(sockfd, ftp, ftp.path, local_path, jobs);
+        } else if (is_download) {
+            success = download_file(sockfd, ftp.path, local_path);
+        } else {
+            success = upload_file(sockfd, local_path, ftp.path);
+        }
+
+        // mv command remove file from source
+        if (operation == "mv" && success) {
+            if (is_download) {
+                success = remove_file(sockfd, ftp.path);
+            } else {
+                success = std::remove(local_path.c_str()) == 0;
+            }
+        }
+    }
+    return success;
+}
+
+
+int run_batch(int sockfd, const FTP& session, std::istream& script) {
+    prefetch = true;
+    int failures = 0;
+    int line_number = 0;
+    std::string line;
+
+    while (std::getline(script, line)) {
+        line_number++;
+        std::istringstream tokens(line);
+        std::vector<std::string> arguments;
+        std::string token;
+        while (tokens >> token) {
+            arguments.push_back(token);
+        }
+        // skip blank lines and comments
+        if (arguments.empty() || arguments[0][0] == '#') {
+            continue;
+        }
+
+        int count = static_cast<int>(arguments.size());
+        std::string param2 = count > 2 ? arguments[2] : "";
+        FTP ftp;
+        if (!valid_operation(arguments[0], count) || !parse_url(arguments[1], param2, ftp)) {
+            std::cerr << "line " << line_number << ": invalid operation: " << line << '\n';
+            failures++;
+            continue;
+        }
+        // every operation must target the server the session is logged in to
+        if (ftp.host != session.host || ftp.port != session.port || ftp.username != session.username) {
+            std::cerr << "line " << line_number << ": URL is not on " << session.host << ": " << line << '\n';
+            failures++;
+            continue;
+        }
+
+        if (!run_operation(sockfd, arguments[0], arguments[1], param2, ftp)) {
+            std::cerr << "line " << line_number << ": failed: " << line << '\n';
+            failures++;
+        }
+    }
+    return failures;
+}
+
+
 int main(int argc, char *argv[]) {
     std::string operation, param1, param2;
     bool help = false;
     if (!parse_command(argc, argv, help, operation, param1, param2) || help) {
         print_help();
     }
+    // OpenSSL writes to the socket itself, so a peer that hangs up must not kill the process
+    if (tls) {
+        signal(SIGPIPE, SIG_IGN);
+    }
 
     FTP ftp_info;
-    if (!parse_url(param1, param2, ftp_info)) {
+    if (!parse_url(param1, operation == "batch" ? "" : param2, ftp_info)) {
         std::cerr << "URL format - ftp://[USER[:PASSWORD]@]HOST[:PORT]/PATH" << std::endl;
         exit(1);
     }
 
     int sockfd;
-    if ((sockfd = open_clientfd(ftp_info.host, ftp_info.port)) < 0) {
-        std::cerr << "Failed to connect to " << ftp_info.host << std::endl;
-        exit(1);
-    }
-
-    if (!pre_operation(sockfd, ftp_info)) {
+    if ((sockfd = open_session(ftp_info)) < 0) {
         std::cerr << "Connection error." << std::endl;
-        close(sockfd);
+        print_metrics();
         exit(1);
     }
 
-    bool success = false;
-    if (operation == "ls") {
-        success = list_directory(sockfd, ftp_info.path);
-    } else if (operation == "mkdir") {
-        success = make_directory(sockfd, ftp_info.path);
-    } else if (operation == "rmdir") {
-        success = remove_directory(sockfd, ftp_info.path);
-    } else if (operation == "rm") {
-        success = remove_file(sockfd, ftp_info.path);
-    } else {
-        bool is_download = param1.find("ftp://") == 0;
-        if (is_download) {
-            success = download_file(sockfd, ftp_info.path, param2);
+    // batch mode runs every operation over the control connection logged in above
+    if (operation == "batch") {
+        int failures;
+        if (param2.empty() || param2 == "-") {
+            failures = run_batch(sockfd, ftp_info, std::cin);
         } else {
-            success = upload_file(sockfd, param1, ftp_info.path);
-        }
-
-        // mv command remove file from source
-        if (operation == "mv" && success) {
-            if (is_download) {
-                success = remove_file(sockfd, ftp_info.path);
-            } else {
-                success = std::remove(param1.c_str());
+            std::ifstream script(param2);
+            if (!script) {
+                std::cerr << "Failed to open script file " << param2 << std::endl;
+                close(sockfd);
+                exit(1);
             }
+            failures = run_batch(sockfd, ftp_info, script);
         }
+        quit_connection(sockfd);
+        close(sockfd);
+        print_metrics();
+        return failures > 0 ? 1 : 0;
     }
 
-    if (!success) {
+    if (!run_operation(sockfd, operation, param1, param2, ftp_info)) {
         close(sockfd);
+        print_metrics();
         return 0;
     }
 
     quit_connection(sockfd);
     close(sockfd);
+    print_metrics();
     return 0;
 }
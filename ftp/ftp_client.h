@@ -3,17 +3,43 @@
 
 #define DEFAULT_NAME "anonymous"
 #define DEFAULT_PORT "21"
+#define SEGMENT_MIN (1 << 20)       // smallest byte range worth its own connection
+#define TUNE_MIN_CHUNK (1 << 16)    // bytes moved per call when a transfer starts
+#define TUNE_MAX_CHUNK (1 << 22)
+#define TUNE_MAX_BUFFER (1 << 25)   // largest socket buffer asked for
+#define TUNE_INTERVAL 100           // milliseconds between throughput measurements
+#define PIPELINE_TIMEOUT 5000       // milliseconds to wait for a reply to pipelined commands
+#define READER_SIZE 4096            // starting size of a control connection's reply buffer
+#define URING_SLOTS 4               // buffers in flight per io_uring batch
+#define URING_CHUNK (1 << 20)       // bytes per io_uring buffer
+#define COMPRESS_LEVEL 6            // zlib level of MODE Z transfers unless --compress-level is given
+#define COMPRESS_MIN (1 << 14)      // files smaller than this go in MODE S unless --compress-min is given
+#define COMPRESS_SAMPLE (1 << 16)   // bytes of a local file test-compressed before choosing MODE Z
+#define TLS_LINGER_MS 2000          // wait for the server to close a TLS data channel after an upload
+#define CACHE_TTL 30                // seconds a directory listing is trusted unless --cache-ttl is given
 
 #define CODE_STXFR 150
 #define CODE_CMPLT 200
 #define CODE_READY 220
+#define CODE_FEATS 211
+#define CODE_FSTAT 213
 #define CODE_CLOSE 221
 #define CODE_DSUCC 226
 #define CODE_PSVMD 227
+#define CODE_EPSVM 229
 #define CODE_LOGIN 230
+#define CODE_AUTHOK 234
 #define CODE_FSUCC 250
 #define CODE_CRDIR 257
 #define CODE_REQPW 331
+#define CODE_RSTRT 350
+#define CODE_NODATA 425
+#define CODE_ABORT 426
+#define CODE_LOCAL 451
+#define CODE_NOCMD 500
+#define CODE_NOIMP 502
+#define CODE_NOLOG 530
+#define CODE_NOFILE 550
 
 struct FTP {
     std::string protocol;
@@ -24,6 +50,213 @@ struct FTP {
     std::string path;
 };
 
+/**
+ * Address of a data connection, as numeric text ready for getaddrinfo.
+ */
+struct Endpoint {
+    char host[INET6_ADDRSTRLEN];
+    char port[8];
+};
+
+/**
+ * A data channel asked for before the transfer that uses it.
+ */
+struct Prefetch {
+    bool requested;             // EPSV or PASV is sent and its reply not read yet
+    bool extended;              // the request was EPSV
+    int data_sockfd;            // connecting or connected socket once the reply is read, -1 if none
+};
+
+/**
+ * Check the operation name and the number of its parameters.
+ * @param operation the operation name, e.g. `ls` or `cp`.
+ * @param count number of arguments, including the operation name itself.
+ * @return true if the operation takes that many arguments, false otherwise.
+ */
+bool valid_operation(const std::string& operation, int count);
+
+/**
+ * One entry of a remote directory listing.
+ */
+struct Entry {
+    std::string name;
+    bool directory = false;
+    long long size = -1;        // -1 if the listing does not give it
+    time_t modified = 0;        // UTC, 0 if the listing does not give it
+};
+
+/**
+ * A remote directory listing kept for lookups, keyed by site and path.
+ */
+struct Listing {
+    time_t fetched = 0;         // when the listing arrived, in seconds since the epoch
+    bool exact = false;         // sizes and times come from MLSD, SIZE, or MDTM rather than LIST text
+    std::vector<Entry> entries;
+};
+
+/**
+ * One file of a recursive copy.
+ */
+struct Transfer {
+    bool download;
+    std::string local_path;
+    std::string remote_path;
+    long long size;
+    bool done;                  // set once the file is copied
+    time_t modified = 0;        // source modification time, used by sync
+};
+
+/**
+ * Transfer settings of one data channel, adjusted to the link while the transfer runs.
+ */
+struct Tuner {
+    int sockfd;
+    bool sending;
+    size_t chunk;               // bytes moved per call
+    int buffer;                 // current send or receive buffer of the socket
+    long long interval_bytes;
+    std::chrono::steady_clock::time_point interval_start;
+    long long total_bytes;      // everything moved since start_tuning
+    std::chrono::steady_clock::time_point first_byte;
+    std::chrono::steady_clock::time_point last_byte;
+};
+
+/**
+ * Checksum of a file, computed from the data as it passes through a transfer, in the algorithm
+ * the server answers HASH, XCRC, or XMD5 with.
+ */
+struct Digest {
+    EVP_MD_CTX *context = nullptr;  // MD5 and the SHA family; null for CRC32
+    uLong crc = 0;
+
+    Digest() = default;
+    Digest(const Digest&) = delete;
+    ~Digest() {
+        EVP_MD_CTX_free(context);
+    }
+};
+
+/**
+ * Timings of one login or one transfer in milliseconds, -1 for a step that did not happen.
+ */
+struct Metrics {
+    std::string kind;           // "session", "upload", "download", "segment", or "copy"
+    std::string path;           // server address for a session, remote path for a transfer
+    bool success = false;
+    double connect_ms = -1;     // TCP handshake of the control connection
+    double login_ms = -1;       // welcome message up to the last setup reply
+    double passive_ms = -1;     // EPSV or PASV sent up to the data channel connected
+    double first_byte_ms = -1;  // STOR or RETR sent up to the first byte moved
+    double transfer_ms = -1;    // first byte up to the last byte
+    double complete_ms = -1;    // last byte up to the 226 reply
+    long long bytes = 0;
+};
+
+/**
+ * Buffered reader of one control connection. Bytes past the reply last returned are kept for the next one.
+ */
+struct Reader {
+    std::vector<char> buffer;
+    size_t start = 0;           // first byte not returned yet
+    size_t end = 0;             // one past the last byte received
+};
+
+/**
+ * One reply of the server. The views point into the connection's reader and stay valid
+ * until the next reply is read from the same connection.
+ */
+struct Reply {
+    int code;                   // -1 if the reply does not start with three digits
+    std::string_view line;      // the first line, without '\r\n'
+    std::string_view text;      // every line of a multi-line reply, without the last '\r\n'
+};
+
+/**
+ * An io_uring instance set up with the raw system calls: the submission and completion rings
+ * shared with the kernel, and the array of submission entries.
+ */
+struct Ring {
+    int fd = -1;
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_mask = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    struct io_uring_sqe *sqes = nullptr;
+    struct io_uring_cqe *cqes = nullptr;
+    void *sq_ring = nullptr;
+    void *cq_ring = nullptr;    // the same mapping as sq_ring on kernels with IORING_FEAT_SINGLE_MMAP
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    size_t sqes_size = 0;
+    unsigned queued = 0;        // entries prepared but not submitted yet
+};
+
+/**
+ * Where a session of the event engine is in its exchange with the server.
+ */
+enum class Step {
+    Connect,                    // the control connection's handshake is running
+    Welcome,                    // waiting for 220
+    Login,                      // USER, PASS, TYPE, MODE, and STRU sent, all at once or one at a time
+    Passive,                    // EPSV or PASV sent
+    Command,                    // STOR or RETR sent, waiting for 150
+    Transfer,                   // waiting for the data channel to close and for 226
+    Quit,                       // QUIT sent
+    Done
+};
+
+/**
+ * One control connection of the event engine and the single transfer it runs at a time.
+ * Its descriptors are non-blocking and every step only starts I/O, epoll reports when it can go on.
+ */
+struct Session {
+    int control_sockfd = -1;
+    int data_sockfd = -1;
+    int fd = -1;                // local file of the current transfer
+    unsigned generation = 0;    // bumped for every data channel, so stale events are told apart
+    Step step = Step::Connect;
+    bool adopted = false;       // the caller's logged-in session, handed back open at the end
+    bool largest_first = false;
+    bool extended = true;       // the next passive request is EPSV
+    int replies = 0;            // login replies read so far
+    bool strict = false;        // log in one command at a time instead of pipelined
+    bool logged_in = false;
+    bool data_connected = false;
+    bool data_done = false;
+    bool reply_done = false;
+    bool failed = false;
+    bool early = false;         // the next passive request went out before 226
+    bool writing = false;       // epoll also waits for the control connection to take more commands
+    Transfer *transfer = nullptr;
+    Reader reader;
+    std::string outbox;         // commands not sent yet
+    Tuner tuner;
+    Metrics metrics;            // of the login, then of the current transfer
+    std::chrono::steady_clock::time_point started;      // of the current step being measured
+    std::chrono::steady_clock::time_point deadline;     // the login gives up if the server is silent until then
+    std::chrono::steady_clock::time_point passive_sent; // the next passive request may go out before 226
+    std::chrono::steady_clock::time_point command_sent;
+    std::chrono::steady_clock::time_point data_ended;
+    std::vector<char> buffer;   // received bytes on their way to the file
+};
+
+/**
+ * State of one run of the event engine: its sessions and the shared queue of files.
+ */
+struct Engine {
+    int epfd = -1;
+    int active = 0;             // sessions not done yet
+    const FTP *ftp = nullptr;
+    Endpoint server;            // address every new session connects to
+    std::vector<Session> sessions;
+    std::vector<Transfer> *transfers = nullptr;
+    size_t front = 0;
+    size_t back = 0;
+};
+
 /**
  * Parse command line arguments, which should have the format `./4700ftp [operation] [param1] [param2]`.
  * @param argc number of arguments.
@@ -39,6 +272,7 @@ bool parse_command(int argc, char *argv[], bool& help, std::string& operation,
 
 /**
  * Parse the URL of the FTP server, which should have the format `ftp://[USER[:PASSWORD]@]HOST[:PORT]/PATH`.
+ * An IPv6 address is written in brackets, e.g. `ftp://[::1]:2121/`.
  * @param param1 the first parameter in the command-line arguments.
  * @param param2 the second parameter in the command-line arguments.
  * @param ftp_url an output parameter for the FTP struct.
@@ -68,12 +302,42 @@ int open_clientfd(const std::string& host, const std::string& port);
 void send_message(int sockfd, const std::string& cmd, const std::string& param);
 
 /**
- * Receive a message from server. The message must ends with '\r\n'.
+ * Send one or more complete command lines to the server in a single write; exit the program if failed.
  * @param sockfd the socket descriptor used by I/O system calls.
- * @return the string message received by the client.
+ * @param msg the command lines, each ending with '\r\n'.
+ */
+void send_messages(int sockfd, const std::string& msg);
+
+/**
+ * Receive one reply from server through the connection's buffered reader; exit the program if failed.
+ * A single-line reply ends with the first '\r\n', and a multi-line reply `xyz-` ends with its `xyz ` line.
+ * Bytes after the reply are kept for the next call on the same socket.
+ * @param sockfd the socket descriptor used by I/O system calls.
+ * @return the reply, valid until the next read from the same socket.
+ */
+Reply read_reply(int sockfd);
+
+/**
+ * Forget any buffered bytes of a connection, for a new connection on the same descriptor.
+ * @param sockfd the socket descriptor used by I/O system calls.
+ */
+void reset_reader(int sockfd);
+
+/**
+ * Receive a reply from server with read_reply.
+ * @param sockfd the socket descriptor used by I/O system calls.
+ * @return a copy of the first line of the reply.
  */
 std::string read_response(int sockfd);
 
+/**
+ * Wait until a reply, or the start of one, can be read.
+ * @param sockfd the socket descriptor used by I/O system calls.
+ * @param timeout the longest wait in milliseconds.
+ * @return true if there is something to read, false on timeout.
+ */
+bool response_ready(int sockfd, int timeout);
+
 /**
  * Parse server response message. If verbose mode is set, print out the response.
  * @param response the string response received by the client.
@@ -81,8 +345,18 @@ std::string read_response(int sockfd);
  */
 int response_code(std::string& response);
 
+/**
+ * Get the code of a reply. If verbose mode is set, print out every line of the reply.
+ * @param reply the reply received by the client.
+ * @return the FTP server response code, -1 if malformed.
+ */
+int reply_code(const Reply& reply);
+
 /**
  * Send USER, PASS, TYPE, MODE, STRU commands to the FTP server before any file operation.
+ * After the welcome message, the five commands go out in one write and their replies are checked in
+ * order. If the server stops answering, it logs in again on a new connection under the same descriptor,
+ * waiting for every reply, as --no-pipeline does from the start.
  * @param sockfd the socket descriptor used by I/O system calls.
  * @param ftp a struct containing the FTP server info.
  * @return true if all commands are successful, false on error.
@@ -95,24 +369,158 @@ bool pre_operation(int sockfd, const FTP& ftp);
 void quit_connection(int sockfd);
 
 /**
- * Parse the server response to the PASV command.
+ * Parse the server response to the PASV command, e.g. `227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)`.
  * @param msg the response message.
- * @param ip output parameter for the IP address.
- * @param port output parameter for the port number.
+ * @param endpoint output parameter for the IP address and port number.
  * @return true if okay, false on error.
  */
-bool parse_pasv_response(const std::string& msg, std::string& ip, std::string& port);
+bool parse_pasv_response(std::string_view msg, Endpoint& endpoint);
+
+/**
+ * Parse the server response to the EPSV command, e.g. `229 Entering Extended Passive Mode (|||port|)`.
+ * @param msg the response message.
+ * @param endpoint output parameter, only the port number is set.
+ * @return true if okay, false on error.
+ */
+bool parse_epsv_response(std::string_view msg, Endpoint& endpoint);
 
 /**
  * Open a data channel for uploading or downloading files.
- * It sends a PASV command to the server, receives a response, and opens a new socket connection.
+ * It sends an EPSV command, or PASV once the server has refused EPSV, receives a response,
+ * and opens a new socket connection. EPSV works over IPv6 as well.
+ * A data channel prefetched by request_data_channel is used instead when there is one.
  * @param control_sockfd the socket descriptor of the control channel.
  * @return the socket descriptor of the data channel if success, -1 on any error.
  */
 int open_data_channel(int control_sockfd);
 
 /**
- * List all files under the given directory in the FTP server.
+ * Ask for the next data channel without waiting for the reply. Transfers call this as soon as their
+ * data is sent or received, so the EPSV or PASV reply comes right behind the transfer reply.
+ * @param control_sockfd the socket descriptor of the control channel.
+ */
+void request_data_channel(int control_sockfd);
+
+/**
+ * Read the reply to a requested data channel, if any, and start connecting it without waiting.
+ * send_message calls this first, so replies always stay in order.
+ * @param control_sockfd the socket descriptor of the control channel.
+ */
+void settle_data_channel(int control_sockfd);
+
+/**
+ * Load a journal left by an earlier run and open it for appending.
+ * @param path path to the journal file; it is created if missing.
+ * @return true if okay, false on error.
+ */
+bool open_journal(const std::string& path);
+
+/**
+ * Load the listings an earlier run stored, drop the ones older than --cache-ttl, and keep the file
+ * open so every listing fetched from now on is appended to it. Runs sharing the file take turns
+ * through a lock on `PATH.lock`.
+ * @param path path to the cache file; it is created if missing.
+ * @return true if okay, false on error.
+ */
+bool open_listing_cache(const std::string& path);
+
+/**
+ * Drop the cached listings a change to a remote path makes stale: that of its directory, and its own.
+ * @param sockfd the socket descriptor of the control channel the change went over.
+ * @param path the remote path that was created, written, or removed.
+ */
+void forget_listing(int sockfd, const std::string& path);
+
+/**
+ * Record a finished upload in the cached listing of its directory, if there is one, so later size
+ * checks in the same directory still need no round trip.
+ * @param sockfd the socket descriptor of the control channel the upload went over.
+ * @param path the remote file path.
+ * @param size the size of the file on the server.
+ */
+void note_upload(int sockfd, const std::string& path, long long size);
+
+/**
+ * Append the state of one file to the journal, if one is open. Safe to call from several sessions.
+ * @param local_path path to the local file.
+ * @param remote_path path to the remote file.
+ * @param offset bytes of the file already copied; for an upload, only what the server confirmed.
+ * @param done true if the whole file is copied.
+ */
+void record_progress(const std::string& local_path, const std::string& remote_path, long long offset, bool done);
+
+/**
+ * Look up the last journal entry of a file.
+ * @param local_path path to the local file.
+ * @param remote_path path to the remote file.
+ * @param done output parameter, true if the file was finished.
+ * @return the recorded offset, or -1 if the journal does not list the file.
+ */
+long long journal_offset(const std::string& local_path, const std::string& remote_path, bool& done);
+
+/**
+ * Start measuring a data channel. The chunk size starts at TUNE_MIN_CHUNK and the socket keeps its buffer.
+ * @param tuner output parameter for the transfer settings.
+ * @param sockfd the socket descriptor of the data channel.
+ * @param sending true if this side sends the data.
+ */
+void start_tuning(Tuner& tuner, int sockfd, bool sending);
+
+/**
+ * Account for bytes moved over a data channel. Every TUNE_INTERVAL, the throughput of the last
+ * interval and the round-trip time from TCP_INFO give the bandwidth-delay product; the chunk size
+ * follows it. The socket buffer is only set when twice the product is more than the kernel's autotuning
+ * can reach, since setting it turns autotuning off. Without TCP_INFO the settings stay as started.
+ * @param tuner the transfer settings.
+ * @param bytes the number of bytes moved since the last call.
+ */
+void tune_transfer(Tuner& tuner, size_t bytes);
+
+/**
+ * Open a JSON lines file that every recorded metric is appended to.
+ * @param path path to the file.
+ * @return true if okay, false on error.
+ */
+bool open_stats(const std::string& path);
+
+/**
+ * Keep the metrics of one login or transfer for the summary, and append them to the JSON lines
+ * file if one is open. Does nothing unless --stats or --stats-json is given.
+ * @param metrics the timings.
+ */
+void record_metrics(const Metrics& metrics);
+
+/**
+ * Print every recorded metric as a table, one row per login or transfer.
+ */
+void print_metrics();
+
+/**
+ * Connect to the FTP server and log in, and record how long both took.
+ * With --compress, the first session also asks FEAT whether the server has MODE Z.
+ * @param ftp a struct containing the FTP server info.
+ * @return the socket descriptor of the logged-in control channel, or -1 on error.
+ */
+int open_session(const FTP& ftp);
+
+/**
+ * Run a listing command (LIST, NLST, or MLSD) and hand over each line as soon as it arrives
+ * over the data channel, without its line ending.
+ * @param control_sockfd the socket descriptor of the control channel.
+ * @param cmd the listing command.
+ * @param path the remote directory path.
+ * @param on_line called with every line of the listing; lines of a listing that fails part way
+ *                may have been handed over already.
+ * @param reply optional output parameter for the reply code to the command; if given,
+ *              a command the server does not know is not reported as an error.
+ * @return true if okay, false on error.
+ */
+bool fetch_listing(int control_sockfd, const std::string& cmd, const std::string& path,
+                   const std::function<void(const std::string&)>& on_line, int *reply = nullptr);
+
+/**
+ * List all files under the given directory in the FTP server, printing each line as it arrives.
+ * The parsed entries replace the cached listing of the directory.
  * @param control_sockfd the socket descriptor of the control channel.
  * @param path the remote directory path.
  * @return true if okay, false on error.
@@ -123,9 +531,12 @@ bool list_directory(int control_sockfd, const std::string& path);
  * Make a new directory under the given path.
  * @param sockfd the socket descriptor of the control channel.
  * @param dir the remote directory path.
+ * @param exist_ok a directory that is already there is not an error: a cached listing that shows it skips
+ * the MKD, and a 550 reply is taken as "exists" without a message. A real failure shows up at the first
+ * file stored into it.
  * @return true if okay, false on error.
  */
-bool make_directory(int sockfd, const std::string& dir);
+bool make_directory(int sockfd, const std::string& dir, bool exist_ok = false);
 
 /**
  * Remove the specified directory from the remote server.
@@ -145,6 +556,11 @@ bool remove_file(int sockfd, const std::string& dir);
 
 /**
  * Upload local file to the remote FTP server.
+ * With --continue, an upload starts at the size of the remote file with REST and STOR, or with APPE
+ * if the server refuses REST, and a file the journal lists as finished is skipped. A server without SIZE
+ * gets the whole file again, and a failed upload journals only the offset SIZE confirmed.
+ * On Linux the file goes to the data channel with sendfile; other files and systems use a read and send loop.
+ * With --compress, a file worth compressing is deflated on its way to the socket in MODE Z.
  * @param control_sockfd the socket descriptor of the control channel.
  * @param local_path path to the local file.
  * @param remote_path path to the remote file.
@@ -154,11 +570,201 @@ bool upload_file(int control_sockfd, std::string& local_path, std::string& remot
 
 /**
  * Download file from the remote FTP server.
+ * With --continue, a download starts at the size of the local file with REST, and a file the journal
+ * lists as finished is skipped.
+ * On Linux the data channel is spliced into the file through a pipe; otherwise a recv and write loop is used.
+ * With --compress, a file worth compressing is asked for in MODE Z and inflated on its way to the file.
  * @param control_sockfd the socket descriptor of the control channel.
  * @param remote_path path to the remote file.
  * @param local_path path to the local file.
+ * @param size the remote file size if the caller knows it, or -1.
+ * @return true if okay, false on error.
+ */
+bool download_file(int control_sockfd, std::string& remote_path, std::string& local_path, long long size = -1);
+
+/**
+ * Get the size of a remote file with the SIZE command, or from a cached listing of its directory
+ * with exact sizes. A file missing from a cached listing has no size.
+ * @param sockfd the socket descriptor of the control channel.
+ * @param path the remote file path.
+ * @return the file size in bytes, or -1 if the server does not report it.
+ */
+long long remote_size(int sockfd, const std::string& path);
+
+/**
+ * Download a file in parallel byte ranges. Each range has its own logged-in control connection
+ * and data channel, starts at its offset with REST, and is written in place with pwrite.
+ * Files smaller than two ranges, or servers without SIZE, fall back to download_file.
+ * @param control_sockfd the socket descriptor of the control channel, used for the first range.
+ * @param ftp a struct containing the FTP server info, used to log in the other connections.
+ * @param remote_path path to the remote file.
+ * @param local_path path to the local file.
+ * @param segments the largest number of parallel ranges.
+ * @return true if okay, false on error.
+ */
+bool download_segmented(int control_sockfd, const FTP& ftp, const std::string& remote_path,
+                        std::string& local_path, int segments);
+
+/**
+ * Parse one line of a Unix-style LIST reply, e.g. `drwxr-xr-x 2 ftp ftp 4096 Jan 01 12:00 name`.
+ * @param line the listing line.
+ * @param entry output parameter for the entry.
+ * @return true for a file or directory other than `.` and `..`, false otherwise.
+ */
+bool parse_list_line(const std::string& line, Entry& entry);
+
+/**
+ * Parse a time value of MLSD or MDTM, `YYYYMMDDHHMMSS[.sss]` in UTC.
+ * @param value the time value.
+ * @return the time in seconds since the epoch, or -1 if malformed.
+ */
+time_t parse_time_value(const std::string& value);
+
+/**
+ * Get the modification time of a remote file with the MDTM command, or from a cached listing
+ * of its directory with exact times.
+ * @param sockfd the socket descriptor of the control channel.
+ * @param path the remote file path.
+ * @return the time in seconds since the epoch, or -1 if the server does not report it.
+ */
+time_t remote_mtime(int sockfd, const std::string& path);
+
+/**
+ * Parse one line of an MLSD reply, e.g. `type=file;size=42;modify=20240101120000; name`.
+ * @param line the listing line.
+ * @param entry output parameter for the entry.
+ * @return true for a file or directory other than `.` and `..`, false otherwise.
+ */
+bool parse_mlsd_line(const std::string& line, Entry& entry);
+
+/**
+ * List the files and subdirectories of a remote directory. MLSD is used when the server has it,
+ * otherwise LIST, with the size and time of each file asked with SIZE and MDTM if details are needed.
+ * A cached listing younger than --cache-ttl is used instead if it has the details asked for,
+ * and a fetched one is cached.
+ * @param control_sockfd the socket descriptor of the control channel.
+ * @param path the remote directory path.
+ * @param entries output parameter, every entry is appended.
+ * @param details fill in the exact size and modification time of every file.
  * @return true if okay, false on error.
  */
-bool download_file(int control_sockfd, std::string& remote_path, std::string& local_path);
+bool list_entries(int control_sockfd, const std::string& path, std::vector<Entry>& entries,
+                  bool details = false);
+
+/**
+ * Copy a list of files over a pool of logged-in sessions. The given session is one of them and
+ * the others log in on their own connections. Workers take the smallest file left from a shared
+ * queue, except one that takes the largest, so large files never hold up small ones.
+ * @param control_sockfd the socket descriptor of the logged-in control channel.
+ * @param ftp a struct containing the FTP server info, used to log in the other sessions.
+ * @param transfers the files to copy; each one is marked done once copied.
+ * @param sessions the number of sessions to use.
+ * @return true if every file is copied, false otherwise.
+ */
+bool run_transfers(int control_sockfd, const FTP& ftp, std::vector<Transfer>& transfers, int sessions);
+
+/**
+ * Copy a list of files like run_transfers, but drive every session from the calling thread.
+ * Control and data connections are non-blocking and multiplexed on one epoll descriptor; each
+ * session steps through login, EPSV, STOR or RETR, the data, and 226 as its events arrive, and asks
+ * for its next data channel as soon as the data of a file is done. Only on Linux builds.
+ * @param control_sockfd the socket descriptor of the logged-in control channel, handed back in blocking mode.
+ * @param ftp a struct containing the FTP server info, used to log in the other sessions.
+ * @param transfers the files to copy, sorted by size; each one is marked done once copied.
+ * @param sessions the number of sessions to use.
+ * @return true if every file is copied, false otherwise.
+ */
+bool run_engine(int control_sockfd, const FTP& ftp, std::vector<Transfer>& transfers, int sessions);
+
+/**
+ * Upload a local directory tree. Remote directories are created with make_directory while
+ * walking the tree, and files are sent by run_transfers.
+ * @param control_sockfd the socket descriptor of the control channel.
+ * @param ftp a struct containing the FTP server info.
+ * @param local_root path to the local directory.
+ * @param remote_root path to the remote directory; a trailing '/' appends the local directory name.
+ * @param move remove every local file and directory that was copied.
+ * @return true if okay, false on error.
+ */
+bool upload_tree(int control_sockfd, const FTP& ftp, const std::string& local_root,
+                 std::string remote_root, bool move);
+
+/**
+ * Download a remote directory tree. The tree is listed over the given session, local
+ * directories are created as they are found, and files are fetched by run_transfers.
+ * @param control_sockfd the socket descriptor of the control channel.
+ * @param ftp a struct containing the FTP server info.
+ * @param remote_root path to the remote directory.
+ * @param local_root path to the local directory; empty or a trailing '/' appends the remote directory name.
+ * @param move remove every remote file and directory that was copied.
+ * @return true if okay, false on error.
+ */
+bool download_tree(int control_sockfd, const FTP& ftp, std::string remote_root,
+                   std::string local_root, bool move);
+
+/**
+ * Bring a directory tree up to date with another one. Both sides are listed one directory
+ * at a time, and a file is copied if it is missing, differs in size, or is newer on the source.
+ * Downloaded files take the remote modification time, so an unchanged tree copies nothing.
+ * @param control_sockfd the socket descriptor of the control channel.
+ * @param ftp a struct containing the FTP server info.
+ * @param local_root path to the local directory.
+ * @param remote_root path to the remote directory.
+ * @param upload true to update the remote tree from the local one, false for the other way.
+ * @param delete_extra remove files and directories that exist only on the target side.
+ * @return true if okay, false on error.
+ */
+bool sync_tree(int control_sockfd, const FTP& ftp, const std::string& local_root,
+               const std::string& remote_root, bool upload, bool delete_extra);
+
+/**
+ * Copy a file from one FTP server to another. The target opens a passive port and the source is
+ * pointed at it with PORT or EPRT, so the data flows straight between the servers (FXP). If either
+ * server refuses, or with --tls, the file is relayed through two data channels of ours in memory.
+ * @param source_sockfd the socket descriptor of the control channel to the server that has the file.
+ * @param source_path path to the file there.
+ * @param target_sockfd the socket descriptor of the control channel to the server that receives it.
+ * @param target_path path to the file there; a trailing '/' appends the source file name.
+ * @param size the file size if the caller knows it, or -1.
+ * @param direct try a direct transfer first; cleared once the servers refuse one.
+ * @return true if okay, false on error.
+ */
+bool copy_remote_file(int source_sockfd, const std::string& source_path, int target_sockfd,
+                      std::string target_path, long long size, bool& direct);
+
+/**
+ * Copy a file, or with -r a directory tree, between two servers over a second session logged in to the target.
+ * Files are copied one at a time with copy_remote_file.
+ * @param source_sockfd the socket descriptor of the control channel to the source server.
+ * @param source the parsed source URL.
+ * @param target the parsed target URL; a trailing '/' appends the source name.
+ * @param move remove every source file and directory that was copied.
+ * @return true if okay, false on error.
+ */
+bool copy_between_servers(int source_sockfd, const FTP& source, const FTP& target, bool move);
+
+/**
+ * Execute one operation over a logged-in control connection.
+ * @param sockfd the socket descriptor of the control channel.
+ * @param operation the operation name.
+ * @param param1 the first parameter of the operation.
+ * @param param2 the second parameter, empty for single-parameter operations.
+ * @param ftp the parsed URL of the operation.
+ * @return true if okay, false on error.
+ */
+bool run_operation(int sockfd, const std::string& operation, const std::string& param1,
+                   const std::string& param2, FTP& ftp);
+
+/**
+ * Run every operation of a script over one logged-in control connection.
+ * Each line has the same form as the command line, e.g. `cp local.txt ftp://host/dir/`;
+ * blank lines and lines starting with '#' are skipped. Every URL must name the session's server.
+ * A failed operation is reported and the script continues with the next line.
+ * @param sockfd the socket descriptor of the control channel.
+ * @param session the URL the session logged in with.
+ * @param script the stream to read operations from.
+ * @return the number of operations that failed.
+ */
+int run_batch(int sockfd, const FTP& session, std::istream& script);
 
 #endif
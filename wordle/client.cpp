@@ -1,29 +1,63 @@
 #include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <fstream>
-#include <map>
-#include <set>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/file.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <nlohmann/json.hpp>
 #include "client.h"
+#include "tables.h"
 
 using json = nlohmann::json;
 
-bool parse_argv(int argc, char* argv[],
-                int& port, bool& secure, std::string& hostname, std::string& username) {
-    // parse -p and -s options
+#ifdef ALLOC_STATS
+// count every heap allocation so a game can report how many happen per round
+static size_t alloc_count = 0;
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    alloc_count++;
+    if (void *ptr = malloc(size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+#endif
+
+bool parse_argv(int argc, char* argv[], int& port, bool& secure, std::string& prior_file,
+                std::string& hostname, std::string& username) {
+    // parse -p, -s, and -w options
     int option;
-    while ((option = getopt(argc, argv, "p:s")) != -1) {
+    while ((option = getopt(argc, argv, "p:sw:")) != -1) {
         switch (option) {
             case 'p':
                 port = std::stoi(optarg);
                 break;
+            case 'w':
+                prior_file = optarg;
+                break;
             case 's':
                 secure = true;
                 if (port == DEFAULT_PORT) {
@@ -124,86 +158,114 @@ int connect_server(std::string& hostname, int port_number, bool tls, SSL_CTX **c
     return sockfd;
 }
 
-std::string play_game(int sockfd, const std::string& username, bool tls, SSL* ssl) {
-    std::vector<std::string> words = read_from_file();
-    std::set<char> nonexist;
-    std::map<char, std::vector<int>> correct;
-    std::map<char, std::vector<int>> wrong_positions;
+std::string play_game(int sockfd, const std::string& username, bool tls, SSL* ssl, const std::string& prior_file) {
+    std::vector<Word> words = read_from_file();
+    SolverTables tables;
+    load_tables(words, tables);
+    Priors priors;
+    load_priors(prior_file, tables, priors);
+    GameArena arena;
+    arena.send_buf.resize(ARENA_SIZE);
+    arena.recv_buf.resize(ARENA_SIZE);
+
+    // every word may be the answer at the start
+    arena.candidates.assign(tables.bitset_words, ~uint64_t{0});
+    if (tables.word_count % 64) {
+        arena.candidates.back() = (uint64_t{1} << (tables.word_count % 64)) - 1;
+    }
+    arena.scratch.resize((2 * LEN + 1) * tables.bitset_words);
 
-    std::string game_id = start_game(sockfd, username, tls, ssl);
-    bool game_over = false;
+    start_game(sockfd, username, tls, ssl, arena);
+    const std::string_view game_id(arena.game_id, arena.id_len);
     int round = 0;
-    std::string secret_flag;
+    uint32_t opening = NO_GUESS;
+    Word guess;
+    std::copy_n(FIRST_GUESS, LEN, guess.begin());
 
-    while (!game_over) {
-        std::string guess = FIRST_GUESS;
-        if (round != 0) {
-            guess = choose_word(words, correct, nonexist, wrong_positions);
+    while (true) {
+#ifdef ALLOC_STATS
+        size_t allocs_before = alloc_count;
+#endif
+        if (round == 1 && opening != NO_GUESS && !priors.weighted) {
+            // the second guess comes from the precomputed opening table, which assumes
+            // every answer is equally likely
+            guess = tables.words[opening];
+        } else if (round != 0) {
+            const Word* next = choose_word(tables, priors, arena);
+            if (!next) {
+                std::cerr << "no word satisfies the known constraints" << std::endl;
+                exit(1);
+            }
+            guess = *next;
         }
 
-        json guess_msg;
-        guess_msg["type"] = "guess";
-        guess_msg["id"] = game_id;
-        guess_msg["word"] = guess;
-        std::string sending = guess_msg.dump() + '\n';
-        send_message(sockfd, sending, tls, ssl);
+        size_t length = format_guess(arena, guess);
+        send_message(sockfd, arena.send_buf.data(), length, tls, ssl);
         round += 1;
 
-        std::string received = receive_message(sockfd, tls, ssl);
-        json retry = json::parse(received);
-        if (retry["type"] == "bye" && retry["id"] == game_id) {
-            game_over = true;
-            secret_flag = retry["flag"];
-        } else if (retry["type"] == "retry" && retry["id"] == game_id) {
+        std::string_view received = receive_message(sockfd, tls, ssl, arena);
+        std::string_view type, id;
+        json_string_field(received, "type", type);
+        bool same_game = json_string_field(received, "id", id) && id == game_id;
+        if (type == "bye" && same_game) {
+            std::string_view flag;
+            json_string_field(received, "flag", flag);
+            if (!prior_file.empty()) {
+                record_secret(prior_file, tables, priors, guess);
+            }
+            return std::string(flag);
+        } else if (type == "retry" && same_game) {
             std::array<int, LEN> result{};
-            const auto& prev = retry["guesses"];
-            auto latest = prev.back();
-            if (latest["word"] != guess) {
-                for (const auto& trial : prev) {
-                    if (trial.contains("word") && trial["word"] == guess) {
-                        latest = trial;
-                    }
+            if (find_marks(received, guess, result)) {
+                handle_marks(tables, guess, result, arena.candidates.data());
+                if (round == 1) {
+                    opening = tables.opening[marks_pattern(result)];
                 }
             }
-            if (latest.contains("marks") && latest["marks"].is_array()) {
-                result = latest["marks"];
-                handle_marks(guess, result, correct, nonexist, wrong_positions);
-            }
-        } else if (retry["type"] == "error") {
-            std::cerr << retry["message"] << std::endl;
+        } else if (type == "error") {
+            // error path only, a full parse is fine here
+            json error_msg = json::parse(received);
+            std::cerr << error_msg["message"] << std::endl;
             exit(1);
         } else {
             std::cerr << "unknown error: " << received << std::endl;
             exit(1);
         }
+#ifdef ALLOC_STATS
+        fprintf(stderr, "round %d: %zu heap allocations\n", round, alloc_count - allocs_before);
+#endif
     }
-    return secret_flag;
 }
 
-std::vector<std::string> read_from_file() {
+std::vector<Word> read_from_file() {
     std::ifstream word_file(FILE_NAME);
     if (!word_file) {
         std::cerr << "Failed to read from word list file" << std::endl;
         exit(1);
     }
 
-    std::vector<std::string> word_list;
-    std::string word;
-    while (std::getline(word_file, word)) {
-        word.erase(std::remove(word.begin(), word.end(), '\r' ), word.end());
-        word.erase(std::remove(word.begin(), word.end(), '\n' ), word.end());
+    std::vector<Word> word_list;
+    std::string line;
+    while (std::getline(word_file, line)) {
+        line.erase(std::remove(line.begin(), line.end(), '\r' ), line.end());
+        line.erase(std::remove(line.begin(), line.end(), '\n' ), line.end());
+        if (line.length() != LEN) {
+            continue;
+        }
+        Word word;
+        std::copy_n(line.begin(), LEN, word.begin());
         word_list.push_back(word);
     }
     word_file.close();
     return word_list;
 }
 
-void send_message(int sockfd, const std::string& message, bool tls, SSL *ssl) {
+void send_message(int sockfd, const char *message, size_t length, bool tls, SSL *ssl) {
     ssize_t bytes_sent;
     if (tls) {
-        bytes_sent = SSL_write(ssl, message.c_str(), message.length());
+        bytes_sent = SSL_write(ssl, message, static_cast<int>(length));
     } else {
-        bytes_sent = send(sockfd, message.c_str(), message.length(), 0);
+        bytes_sent = send(sockfd, message, length, 0);
     }
     if (bytes_sent < 0) {
         std::cerr << "failed to send hello message" << std::endl;
@@ -211,134 +273,467 @@ void send_message(int sockfd, const std::string& message, bool tls, SSL *ssl) {
     }
 }
 
-std::string receive_message(int sockfd, bool tls, SSL *ssl) {
-    char buffer[2048];
-    std::string message;
-    ssize_t bytes_received;
+std::string_view receive_message(int sockfd, bool tls, SSL *ssl, GameArena& arena) {
+    // drop the previous message but keep anything received after it
+    if (arena.consumed > 0) {
+        memmove(arena.recv_buf.data(), arena.recv_buf.data() + arena.consumed, arena.recv_len - arena.consumed);
+        arena.recv_len -= arena.consumed;
+        arena.consumed = 0;
+    }
 
+    size_t scanned = 0;
+    ssize_t bytes_received;
     while (true) {
+        // no \n character appears inside the JSON data
+        char *base = arena.recv_buf.data();
+        char *newline = static_cast<char*>(memchr(base + scanned, '\n', arena.recv_len - scanned));
+        if (newline) {
+            arena.consumed = newline - base + 1;
+            return std::string_view(base, newline - base);
+        }
+        scanned = arena.recv_len;
+
+        // the guesses list grows every round, only a very long game outgrows the buffer
+        if (arena.recv_len == arena.recv_buf.size()) {
+            arena.recv_buf.resize(arena.recv_buf.size() * 2);
+            base = arena.recv_buf.data();
+        }
+        size_t space = arena.recv_buf.size() - arena.recv_len;
         if (tls) {
-            bytes_received = SSL_read(ssl, buffer, sizeof(buffer));
+            bytes_received = SSL_read(ssl, base + arena.recv_len, static_cast<int>(space));
         } else {
-            bytes_received = recv(sockfd, buffer, sizeof(buffer), 0);
+            bytes_received = recv(sockfd, base + arena.recv_len, space, 0);
         }
         if (bytes_received <= 0) {
             std::cerr << "failed to receive message from server" << std::endl;
             exit(1);
         }
-        message.append(buffer, bytes_received);
-
-        // no \n character appears inside the JSON data
-        std::string::size_type newline = message.find('\n');
-        if (newline != std::string::npos) {
-            return message.substr(0, newline);
-        }
+        arena.recv_len += bytes_received;
     }
 }
 
-std::string start_game(int sockfd, const std::string& username, bool tls, SSL *ssl) {
+void start_game(int sockfd, const std::string& username, bool tls, SSL *ssl, GameArena& arena) {
     // send hello message to the server
     json hello_msg;
     hello_msg["type"] = "hello";
     hello_msg["northeastern_username"] = username;
     std::string sending = hello_msg.dump() + '\n';
-    send_message(sockfd, sending, tls, ssl);
+    send_message(sockfd, sending.c_str(), sending.length(), tls, ssl);
 
     // receive a start message from the server
-    std::string received = receive_message(sockfd, tls, ssl);
+    std::string_view received = receive_message(sockfd, tls, ssl, arena);
     json start_msg = json::parse(received);
     if (start_msg["type"] != "start") {
         std::cerr << "start message error: " << start_msg.dump() << std::endl;
         exit(1);
     }
-    return start_msg["id"];
+
+    // keep the id as raw JSON text so guess messages can copy it verbatim
+    std::string_view id;
+    if (!json_string_field(received, "id", id) || id.length() > ID_MAX) {
+        std::cerr << "start message error: " << received << std::endl;
+        exit(1);
+    }
+    memcpy(arena.game_id, id.data(), id.length());
+    arena.id_len = id.length();
 }
 
-std::string choose_word(std::vector<std::string>& all_words, std::map<char, std::vector<int>>& correct,
-                        std::set<char>& nonexist, std::map<char, std::vector<int>>& position) {
-    for (std::string& word : all_words) {
-        bool flag = true;
+size_t format_guess(GameArena& arena, const Word& guess) {
+    static constexpr std::string_view head = R"({"type": "guess", "id": ")";
+    static constexpr std::string_view middle = R"(", "word": ")";
+    static constexpr std::string_view tail = "\"}\n";
+
+    char *out = arena.send_buf.data();
+    out = std::copy(head.begin(), head.end(), out);
+    out = std::copy_n(arena.game_id, arena.id_len, out);
+    out = std::copy(middle.begin(), middle.end(), out);
+    out = std::copy(guess.begin(), guess.end(), out);
+    out = std::copy(tail.begin(), tail.end(), out);
+    return out - arena.send_buf.data();
+}
 
-        // check no letter is in the non-exist set
-        for (char c : word) {
-            if (nonexist.find(c) != nonexist.end()) {
-                flag = false;
-                break;
-            }
+/**
+ * Locate the value of "key" in a JSON text.
+ * @return the offset of the first character of the value, or npos if the key is missing.
+ */
+static size_t find_value(std::string_view message, std::string_view key) {
+    size_t pos = 0;
+    while ((pos = message.find(key, pos)) != std::string_view::npos) {
+        size_t begin = pos;
+        pos += key.length();
+        // the key must be a complete, unescaped JSON string followed by a colon
+        if (begin == 0 || message[begin - 1] != '"' || (begin >= 2 && message[begin - 2] == '\\')
+            || pos >= message.length() || message[pos] != '"') {
+            continue;
+        }
+        size_t value = pos + 1;
+        while (value < message.length() && isspace(static_cast<unsigned char>(message[value]))) {
+            value++;
         }
-        if (!flag) {
+        if (value >= message.length() || message[value] != ':') {
             continue;
         }
+        value++;
+        while (value < message.length() && isspace(static_cast<unsigned char>(message[value]))) {
+            value++;
+        }
+        return value;
+    }
+    return std::string_view::npos;
+}
 
-        // check letters in the correct position
-        for (const auto& [key, indices] : correct) {
-            for (const int index : indices) {
-                if (index < 0 || index >= LEN || word[index] != key) {
-                    flag = false;
-                    break;
-                }
-            }
+bool json_string_field(std::string_view message, std::string_view key, std::string_view& value) {
+    size_t begin = find_value(message, key);
+    if (begin == std::string_view::npos || message[begin] != '"') {
+        return false;
+    }
+    begin++;
+    for (size_t end = begin; end < message.length(); end++) {
+        if (message[end] == '\\') {
+            end++;
+        } else if (message[end] == '"') {
+            value = message.substr(begin, end - begin);
+            return true;
         }
-        if (!flag) {
-            continue;
+    }
+    return false;
+}
+
+bool find_marks(std::string_view message, const Word& guess, std::array<int, LEN>& marks) {
+    size_t pos = find_value(message, "guesses");
+    if (pos == std::string_view::npos) {
+        return false;
+    }
+
+    // every entry is a flat object, so the next '}' closes it
+    bool found = false;
+    const std::string_view word(guess.data(), LEN);
+    while ((pos = message.find('{', pos)) != std::string_view::npos) {
+        size_t end = message.find('}', pos);
+        if (end == std::string_view::npos) {
+            break;
         }
+        std::string_view entry = message.substr(pos, end - pos + 1);
+        pos = end + 1;
 
-        // check other letter exists but not in any known wrong positions
-        for (const auto& [key, wrong_positions] : position) {
-            if (word.find(key) == std::string::npos) {
-                flag = false;
-                break;
-            }
-            for (int pos : wrong_positions) {
-                if (pos >= 0 && pos < LEN && word[pos] == key) {
-                    flag = false;
-                    break;
-                }
-            }
-            if (!flag) {
-                break;
-            }
+        std::string_view trial;
+        if (!json_string_field(entry, "word", trial) || trial != word) {
+            continue;
         }
-        if (!flag) {
+        size_t index = find_value(entry, "marks");
+        if (index == std::string_view::npos || entry[index] != '[') {
             continue;
         }
+        std::array<int, LEN> parsed{};
+        int count = 0;
+        for (index++; index < entry.length() && entry[index] != ']'; index++) {
+            if (isdigit(static_cast<unsigned char>(entry[index])) && count < LEN) {
+                parsed[count++] = entry[index] - '0';
+            }
+        }
+        if (count == LEN) {
+            marks = parsed;
+            found = true;
+        }
+    }
+    return found;
+}
+
+/**
+ * The distinct letters of a guess and how many times each one appears.
+ */
+struct GuessLetters {
+    std::array<char, LEN> letter{};
+    std::array<int, LEN> count{};
+    int distinct = 0;
+};
+
+static GuessLetters guess_letters(const Word& guess) {
+    GuessLetters letters;
+    for (char c : guess) {
+        int j = 0;
+        while (j < letters.distinct && letters.letter[j] != c) {
+            j++;
+        }
+        if (j == letters.distinct) {
+            letters.letter[letters.distinct++] = c;
+        }
+        letters.count[j]++;
+    }
+    return letters;
+}
 
-        // valid word option if its made this far
-        return word;
+/**
+ * Write set & include & ~exclude into out over the word range [lo, hi); either filter may be null.
+ * @return the number of words left in out.
+ */
+static uint64_t intersect(const uint64_t *set, const uint64_t *include, const uint64_t *exclude,
+                          uint64_t *out, size_t lo, size_t hi) {
+    uint64_t total = 0;
+    for (size_t w = lo; w < hi; w++) {
+        uint64_t bits = set[w];
+        if (include) {
+            bits &= include[w];
+        }
+        if (exclude) {
+            bits &= ~exclude[w];
+        }
+        out[w] = bits;
+        total += __builtin_popcountll(bits);
     }
-    return "";
+    return total;
 }
 
-void handle_marks(std::string& word, std::array<int, LEN>& marks, std::map<char, std::vector<int>>& correct,
-                  std::set<char>& nonexist, std::map<char, std::vector<int>>& position) {
-    // handle correct characters first
+/**
+ * The answers that hold exactly `copies` of letter c, or at least `copies` if `at_least` is set.
+ */
+static uint64_t count_class(const SolverTables& tables, const uint64_t *set, char c, int copies, bool at_least,
+                            uint64_t *out, size_t lo, size_t hi) {
+    const uint64_t *include = copies > 0 ? count_set(tables, c, copies) : nullptr;
+    const uint64_t *exclude = !at_least && copies < LEN ? count_set(tables, c, copies + 1) : nullptr;
+    return intersect(set, include, exclude, out, lo, hi);
+}
+
+/**
+ * Sum of the prior weights of the words in a set.
+ */
+static uint64_t set_weight(const Priors& priors, const uint64_t *set, size_t lo, size_t hi) {
+    uint64_t total = 0;
+    for (size_t w = lo; w < hi; w++) {
+        for (uint64_t bits = set[w]; bits; bits &= bits - 1) {
+            total += priors.weight[w * 64 + __builtin_ctzll(bits)];
+        }
+    }
+    return total;
+}
+
+/**
+ * Add the squared size, or squared prior weight, of every cell of the partition a guess makes
+ * on a set of answers.
+ * Levels 0 to LEN - 1 split the set on a correct letter at each position; later levels split it
+ * on how many copies of each distinct guess letter the answer holds. Together they determine
+ * the marks, so every leaf is the set of answers that give the guess one particular pattern.
+ * @param set the answers at this level, already split by the levels above.
+ * @param size number of answers in the set.
+ * @param greens positions marked correct so far.
+ * @param score the running score, the walk stops once it exceeds bound.
+ */
+static void partition_score(const SolverTables& tables, const Priors& priors, const Word& guess,
+                            const GuessLetters& letters, int level, uint32_t greens, const uint64_t *set,
+                            uint64_t size, uint64_t *scratch, size_t lo, size_t hi, uint64_t& score, uint64_t bound) {
+    // a single answer cannot be split any further
+    if (size == 1 || level == LEN + letters.distinct) {
+        uint64_t mass = priors.weighted ? set_weight(priors, set, lo, hi) : size;
+        score += mass * mass;
+        return;
+    }
+
+    uint64_t *child = scratch + level * tables.bitset_words;
+    uint64_t remain = size, child_size;
+    if (level < LEN) {
+        const uint64_t *correct = position_set(tables, level, guess[level]);
+        if ((child_size = intersect(set, correct, nullptr, child, lo, hi)) > 0) {
+            partition_score(tables, priors, guess, letters, level + 1, greens | 1u << level, child, child_size,
+                            scratch, lo, hi, score, bound);
+        }
+        if ((remain -= child_size) > 0 && score <= bound) {
+            intersect(set, nullptr, correct, child, lo, hi);
+            partition_score(tables, priors, guess, letters, level + 1, greens, child, remain,
+                            scratch, lo, hi, score, bound);
+        }
+        return;
+    }
+
+    // the answer has min(copies in answer, copies in guess) of the letter marked 1 or 2
+    int j = level - LEN;
+    char c = letters.letter[j];
+    int marked = 0;
     for (int i = 0; i < LEN; i++) {
-        char c = word[i];
-        if (marks[i] == 2) {
-            correct[c].push_back(i);
+        marked += (greens >> i & 1) && guess[i] == c;
+    }
+    for (int copies = marked; copies <= letters.count[j] && remain > 0 && score <= bound; copies++) {
+        bool at_least = copies == letters.count[j];
+        if ((child_size = count_class(tables, set, c, copies, at_least, child, lo, hi)) > 0) {
+            partition_score(tables, priors, guess, letters, level + 1, greens, child, child_size,
+                            scratch, lo, hi, score, bound);
+            remain -= child_size;
+        }
+    }
+}
+
+const Word* choose_word(const SolverTables& tables, const Priors& priors, GameArena& arena) {
+    const uint64_t *candidates = arena.candidates.data();
+
+    // only the range of words that still holds candidates takes part in the set operations
+    size_t lo = 0, hi = tables.bitset_words;
+    while (lo < hi && candidates[lo] == 0) {
+        lo++;
+    }
+    while (hi > lo && candidates[hi - 1] == 0) {
+        hi--;
+    }
+    uint64_t size = 0;
+    for (size_t w = lo; w < hi; w++) {
+        size += __builtin_popcountll(candidates[w]);
+    }
+    if (size == 0) {
+        return nullptr;
+    }
+
+    // score candidates by the sum of squared partition sizes, which is the expected number of
+    // answers left after the guess times the number of answers now. With priors every answer counts
+    // by its weight, and the guess's own cell is left out since that answer ends the game.
+    // Candidates are visited from the most likely, so ties go to the more likely word.
+    const Word *best = nullptr;
+    uint64_t best_score = UINT64_MAX;
+    int scored = 0;
+    for (uint32_t index : priors.order) {
+        if (!(candidates[index / 64] >> (index % 64) & 1)) {
+            continue;
+        }
+        const Word& guess = tables.words[index];
+        if (size <= 2) {
+            return &guess;
+        }
+        uint64_t own = uint64_t{priors.weight[index]} * priors.weight[index];
+        uint64_t bound = best_score == UINT64_MAX ? UINT64_MAX : best_score + own;
+        uint64_t score = 0;
+        partition_score(tables, priors, guess, guess_letters(guess), 0, 0, candidates, size,
+                        arena.scratch.data(), lo, hi, score, bound);
+        score -= own;
+        if (score < best_score) {
+            best = &guess;
+            best_score = score;
+        }
+        if (++scored == SCORE_LIMIT) {
+            break;
         }
     }
+    return best;
+}
+
+void handle_marks(const SolverTables& tables, const Word& word, const std::array<int, LEN>& marks,
+                  uint64_t *candidates) {
+    const size_t words = tables.bitset_words;
+
+    // handle the letter at each position first
     for (int i = 0; i < LEN; i++) {
-        char c = word[i];
-        int mark = marks[i];
-        if (mark == 0 && correct.find(c) == correct.end()) {
-            nonexist.insert(c);
-        } else if (mark == 0 && correct.find(c) != correct.end()) {
-            position[c].push_back(i);
-        } else if (mark == 1) {
-            position[c].push_back(i);
+        const uint64_t *correct = position_set(tables, i, word[i]);
+        if (marks[i] == 2) {
+            intersect(candidates, correct, nullptr, candidates, 0, words);
+        } else {
+            intersect(candidates, nullptr, correct, candidates, 0, words);
+        }
+    }
+
+    // a letter marked 0 means the answer holds no more copies than the ones marked 1 or 2
+    GuessLetters letters = guess_letters(word);
+    for (int j = 0; j < letters.distinct; j++) {
+        char c = letters.letter[j];
+        int marked = 0;
+        bool exact = false;
+        for (int i = 0; i < LEN; i++) {
+            if (word[i] == c) {
+                marked += marks[i] != 0;
+                exact |= marks[i] == 0;
+            }
         }
+        count_class(tables, candidates, c, marked, !exact, candidates, 0, words);
+    }
+}
+
+/**
+ * Read the secret counts from a prior file; lines have the form "<word> <count>".
+ * @return true if any count is read.
+ */
+static bool read_counts(const std::string& prior_file, const SolverTables& tables, std::vector<uint32_t>& counts) {
+    counts.assign(tables.word_count, 0);
+    std::ifstream infile(prior_file);
+    if (!infile) {
+        return false;
+    }
+
+    std::unordered_map<std::string_view, uint32_t> index;
+    index.reserve(tables.word_count);
+    for (uint32_t i = 0; i < tables.word_count; i++) {
+        index.emplace(std::string_view(tables.words[i].data(), LEN), i);
+    }
+
+    bool found = false;
+    std::string word;
+    uint32_t count;
+    while (infile >> word >> count) {
+        auto it = index.find(word);
+        if (it != index.end()) {
+            counts[it->second] = count;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void load_priors(const std::string& prior_file, const SolverTables& tables, Priors& priors) {
+    // a missing file is fine, it is created after the first game
+    priors.weighted = !prior_file.empty() && read_counts(prior_file, tables, priors.count);
+    if (!priors.weighted) {
+        priors.count.assign(tables.word_count, 0);
+    }
+
+    // every word keeps a weight of at least 1, so an answer never seen before is still possible
+    priors.weight.resize(tables.word_count);
+    priors.order.resize(tables.word_count);
+    for (uint32_t i = 0; i < tables.word_count; i++) {
+        priors.weight[i] = priors.count[i] + 1;
+        priors.order[i] = i;
+    }
+    std::stable_sort(priors.order.begin(), priors.order.end(), [&priors](uint32_t a, uint32_t b) {
+        return priors.count[a] > priors.count[b];
+    });
+}
+
+void record_secret(const std::string& prior_file, const SolverTables& tables, Priors& priors, const Word& secret) {
+    const Word *found = std::find(tables.words, tables.words + tables.word_count, secret);
+    if (found == tables.words + tables.word_count) {
+        return;
+    }
+
+    // serialize concurrent clients, and re-read the counts so no other game's update is lost
+    std::string lock_file = prior_file + ".lock";
+    int lockfd = open(lock_file.c_str(), O_CREAT | O_RDWR, 0644);
+    if (lockfd < 0 || flock(lockfd, LOCK_EX) < 0) {
+        std::cerr << "failed to lock prior file " << prior_file << std::endl;
+        if (lockfd >= 0) {
+            close(lockfd);
+        }
+        return;
+    }
+    read_counts(prior_file, tables, priors.count);
+    priors.count[found - tables.words]++;
+
+    // write a new file and rename it over the old one, so a reader never sees a partial file
+    std::string temp_file = prior_file + ".tmp";
+    std::ofstream outfile(temp_file);
+    for (uint32_t i = 0; i < tables.word_count; i++) {
+        if (priors.count[i] > 0) {
+            outfile << std::string_view(tables.words[i].data(), LEN) << ' ' << priors.count[i] << '\n';
+        }
+    }
+    outfile.close();
+    if (!outfile || rename(temp_file.c_str(), prior_file.c_str()) < 0) {
+        std::cerr << "failed to write prior file " << prior_file << std::endl;
     }
+    close(lockfd);
 }
 
 int main(int argc, char* argv[]) {
     // parse command line arguments
     std::string hostname;
     std::string username;
+    std::string prior_file;
     int port = DEFAULT_PORT;
     bool secure = false;
-    if (!parse_argv(argc, argv, port, secure, hostname, username)) {
-        std::cerr << "Usage: ./client <-p port> <-s> <hostname> <Northeastern-username>" << std::endl;
+    if (!parse_argv(argc, argv, port, secure, prior_file, hostname, username)) {
+        std::cerr << "Usage: ./client <-p port> <-s> <-w prior-file> <hostname> <Northeastern-username>" << std::endl;
         exit(1);
     }
 
@@ -359,7 +754,7 @@ int main(int argc, char* argv[]) {
     }
 
     // play wordle game and print the secret flag if successful
-    std::string secret_flag = play_game(socketfd, username, secure, ssl);
+    std::string secret_flag = play_game(socketfd, username, secure, ssl, prior_file);
     std::cout << secret_flag << std::endl;
 
     // close connection
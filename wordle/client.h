@@ -2,10 +2,46 @@
 #define WORDLE_CLIENT_H
 
 #define LEN 5
+#define ALPHABET 26
 #define DEFAULT_PORT 27993
 #define DEFAULT_PORT_TLS 27994
 #define FILE_NAME "project1-words.txt"
 #define FIRST_GUESS "crane"
+#define ARENA_SIZE 65536
+#define ID_MAX 128
+#define SCORE_LIMIT 1000        // most candidates scored as the next guess in one round
+
+/**
+ * A five-letter word stored inline, so copying a guess never touches the heap.
+ */
+using Word = std::array<char, LEN>;
+
+/**
+ * Per-game scratch memory. All buffers are sized once when the game starts, so a steady-state
+ * round reads, parses, and writes messages and scores guesses without any heap allocation.
+ */
+struct GameArena {
+    std::vector<char> send_buf;
+    std::vector<char> recv_buf;
+    std::vector<uint64_t> candidates;   // bitset over the dictionary of the answers still possible
+    std::vector<uint64_t> scratch;      // one bitset per level of the partition walk
+    size_t recv_len = 0;        // number of valid bytes in recv_buf
+    size_t consumed = 0;        // bytes of recv_buf that belong to the previous message
+    char game_id[ID_MAX];
+    size_t id_len = 0;
+};
+
+/**
+ * Answer-likelihood priors learned from the secrets of earlier games.
+ */
+struct Priors {
+    std::vector<uint32_t> count;        // times each word was the secret
+    std::vector<uint32_t> weight;       // count + 1, so an unseen word stays possible
+    std::vector<uint32_t> order;        // word indices from the most to the least likely
+    bool weighted = false;              // false if no secret has been recorded yet
+};
+
+struct SolverTables;
 
 /**
  * Parse command line arguments.
@@ -13,11 +49,13 @@
  * @param argv array of arguments
  * @param port reference to the port number variable
  * @param secure reference to use TLS connection
+ * @param prior_file reference to the optional prior weight file
  * @param hostname reference to the host name
  * @param username reference to the northeastern user name
  * @return true if success, false on error.
  */
-bool parse_argv(int argc, char* argv[], int& port, bool& secure, std::string& hostname, std::string& username);
+bool parse_argv(int argc, char* argv[], int& port, bool& secure, std::string& prior_file,
+                std::string& hostname, std::string& username);
 
 /**
  * Client attempts to establish a connection with the server.
@@ -33,55 +71,107 @@ int connect_server(std::string& hostname, int port_number, bool tls, SSL_CTX **c
 /**
  * Read all words from the specified txt file to a vector for searching.
  * File name is defined as macro in this header file.
- * @return a vector of strings.
+ * @return a vector of fixed-size words.
  */
-std::vector<std::string> read_from_file();
+std::vector<Word> read_from_file();
 
 /**
  * Implements wordle game logic.
+ * @param prior_file path to the prior weight file, empty if priors are not used.
  * @return the secret flag received from the server.
  */
-std::string play_game(int sockfd, const std::string& username, bool tls, SSL* ssl);
+std::string play_game(int sockfd, const std::string& username, bool tls, SSL* ssl, const std::string& prior_file);
 
 /**
  * Start the game by sending a hello message and receiving a start message.
+ * The game id is stored in the arena and reused by every guess message.
  * @param sockfd the socket descriptor used by I/O system calls.
  * @param username northeastern username.
- * @return the game id received from the server.
+ * @param arena per-game buffers.
  */
-std::string start_game(int sockfd, const std::string& username, bool tls, SSL *ssl);
+void start_game(int sockfd, const std::string& username, bool tls, SSL *ssl, GameArena& arena);
 
 /**
  * Send a message to the server; exit the program if failed.
  * @param sockfd the socket descriptor used by I/O system calls.
- * @param message a reference to the string message.
+ * @param message pointer to the message bytes.
+ * @param length number of bytes to send.
  */
-void send_message(int sockfd, const std::string& message, bool tls, SSL *ssl);
+void send_message(int sockfd, const char *message, size_t length, bool tls, SSL *ssl);
 
 /**
  * Receive a message from server. The message must ends with a '\n' character.
+ * Bytes following the newline are kept in the arena for the next call.
  * @param sockfd the socket descriptor used by I/O system calls.
- * @return the string message received by the client.
+ * @param arena per-game buffers that hold the received bytes.
+ * @return a view of the message inside the arena, valid until the next call.
+ */
+std::string_view receive_message(int sockfd, bool tls, SSL *ssl, GameArena& arena);
+
+/**
+ * Write a guess message for the given word into the arena send buffer.
+ * @return the length of the message, including the trailing '\n'.
  */
-std::string receive_message(int sockfd, bool tls, SSL *ssl);
+size_t format_guess(GameArena& arena, const Word& guess);
 
 /**
- * Choose a word based on known constraints.
- * @param all_words a vector of strings containing all the word options
- * @param correct maps characters with its correct positions.
- * @param nonexist a set of character that does not appear in the answer.
- * @param position maps characters with its known incorrect position.
- * @return a valid option for the next guess.
+ * Find the string value of a top-level field in a JSON message without allocating.
+ * @param message the JSON text.
+ * @param key name of the field.
+ * @param value output parameter for the raw (still escaped) string value.
+ * @return true if the field is found and holds a string.
  */
-std::string choose_word(std::vector<std::string>& all_words, std::map<char, std::vector<int>>& correct,
-                        std::set<char>& nonexist, std::map<char, std::vector<int>>& position);
+bool json_string_field(std::string_view message, std::string_view key, std::string_view& value);
 
 /**
- * Handle the guess result returned by the server,
+ * Find the marks given to a word in the guesses array of a retry message.
+ * The last matching entry wins if the word was guessed more than once.
+ * @param message the JSON text of a retry message.
+ * @param guess the word to look for.
+ * @param marks output parameter for the marks.
+ * @return true if the word and its marks are found.
+ */
+bool find_marks(std::string_view message, const Word& guess, std::array<int, LEN>& marks);
+
+/**
+ * Choose the candidate that splits the remaining candidates into the smallest expected partition.
+ * Partition sizes are popcounts of candidate bitsets intersected with the table bitsets,
+ * or the sum of prior weights once priors are known.
+ * @param tables the solver tables holding all the word options.
+ * @param priors answer-likelihood priors; candidates are tried from the most likely.
+ * @param arena per-game buffers holding the candidate set and scratch bitsets.
+ * @return a pointer to a valid option for the next guess, or nullptr if none is left.
+ */
+const Word* choose_word(const SolverTables& tables, const Priors& priors, GameArena& arena);
+
+/**
+ * Handle the guess result returned by the server by removing every candidate
+ * that would have given the guess different marks.
+ * @param tables the solver tables.
  * @param word the most recent guess.
  * @param marks an array containing the marks corresponding to the latest guess.
+ * @param candidates bitset of the answers still possible.
+ */
+void handle_marks(const SolverTables& tables, const Word& word, const std::array<int, LEN>& marks,
+                  uint64_t *candidates);
+
+/**
+ * Load the answer-likelihood priors and order the dictionary from the most to the least likely word.
+ * Without a prior file, or before it records any secret, every word has the same weight.
+ * @param prior_file path to the prior weight file, may be empty or missing.
+ * @param tables the solver tables.
+ * @param priors output parameter for the priors.
+ */
+void load_priors(const std::string& prior_file, const SolverTables& tables, Priors& priors);
+
+/**
+ * Add one observation of the secret word to the prior file. The file is locked, re-read,
+ * and replaced atomically, so concurrent clients do not lose each other's updates.
+ * @param prior_file path to the prior weight file.
+ * @param tables the solver tables.
+ * @param priors the priors of this game, updated with the new count.
+ * @param secret the secret word revealed by the bye message.
  */
-void handle_marks(std::string& word, std::array<int, LEN>& marks, std::map<char, std::vector<int>>& correct,
-                  std::set<char>& nonexist, std::map<char, std::vector<int>>& position);
+void record_secret(const std::string& prior_file, const SolverTables& tables, Priors& priors, const Word& secret);
 
 #endif
@@ -0,0 +1,304 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/ssl.h>
+#include "client.h"
+#include "tables.h"
+
+static uint64_t fnv1a(const void *data, size_t length, uint64_t hash = 14695981039346656037ULL) {
+    const auto *bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint32_t feedback(const Word& guess, const Word& answer) {
+    std::array<uint8_t, ALPHABET> remain{};
+    std::array<uint8_t, LEN> marks{};
+
+    // correct letters first, then misplaced letters up to the number left in the answer
+    for (int i = 0; i < LEN; i++) {
+        if (guess[i] == answer[i]) {
+            marks[i] = 2;
+        } else {
+            remain[answer[i] - 'a']++;
+        }
+    }
+    for (int i = 0; i < LEN; i++) {
+        if (marks[i] == 0 && remain[guess[i] - 'a'] > 0) {
+            marks[i] = 1;
+            remain[guess[i] - 'a']--;
+        }
+    }
+    uint32_t pattern = 0;
+    for (int i = LEN - 1; i >= 0; i--) {
+        pattern = pattern * 3 + marks[i];
+    }
+    return pattern;
+}
+
+uint32_t marks_pattern(const std::array<int, LEN>& marks) {
+    uint32_t pattern = 0;
+    for (int i = LEN - 1; i >= 0; i--) {
+        pattern = pattern * 3 + marks[i];
+    }
+    return pattern;
+}
+
+/**
+ * Compute the byte offsets of every table for the given number of words.
+ * @return the total size of the tables in bytes.
+ */
+static uint64_t table_layout(uint32_t word_count, TableHeader& layout) {
+    layout.words_offset = sizeof(TableHeader);
+    layout.opening_offset = (layout.words_offset + uint64_t{word_count} * LEN + 3) & ~uint64_t{3};
+    layout.bitset_words = (word_count + 63) / 64;
+    layout.position_offset = (layout.opening_offset + PATTERN_COUNT * sizeof(uint32_t) + 7) & ~uint64_t{7};
+    layout.count_offset = layout.position_offset + LEN * ALPHABET * layout.bitset_words * sizeof(uint64_t);
+    layout.total_size = layout.count_offset + ALPHABET * LEN * layout.bitset_words * sizeof(uint64_t);
+    return layout.total_size;
+}
+
+/**
+ * For every pattern the first guess can get, find the guess that splits the remaining
+ * candidates into the smallest expected partition. Ties prefer a word that may be the answer.
+ */
+static void build_opening(const std::vector<Word>& words, uint32_t *opening) {
+    Word first;
+    std::copy_n(FIRST_GUESS, LEN, first.begin());
+
+    std::vector<std::vector<uint32_t>> groups(PATTERN_COUNT);
+    for (uint32_t index = 0; index < words.size(); index++) {
+        groups[feedback(first, words[index])].push_back(index);
+    }
+
+    std::vector<uint32_t> counts(PATTERN_COUNT);
+    std::vector<char> candidate(words.size());
+    for (uint32_t pattern = 0; pattern < PATTERN_COUNT; pattern++) {
+        const std::vector<uint32_t>& group = groups[pattern];
+        if (group.size() <= 2) {
+            opening[pattern] = group.empty() ? NO_GUESS : group[0];
+            continue;
+        }
+
+        for (uint32_t index : group) {
+            candidate[index] = 1;
+        }
+        uint32_t best = group[0];
+        uint64_t best_score = UINT64_MAX;
+        for (uint32_t guess = 0; guess < words.size(); guess++) {
+            // sum of squared partition sizes, stop once it cannot beat the best guess
+            std::fill(counts.begin(), counts.end(), 0);
+            uint64_t score = 0;
+            for (uint32_t answer : group) {
+                score += 2 * counts[feedback(words[guess], words[answer])]++ + 1;
+                if (score > best_score) {
+                    break;
+                }
+            }
+            if (score < best_score || (score == best_score && candidate[guess] && !candidate[best])) {
+                best = guess;
+                best_score = score;
+            }
+        }
+        for (uint32_t index : group) {
+            candidate[index] = 0;
+        }
+        opening[pattern] = best;
+    }
+}
+
+/**
+ * Write the tables into memory of table_layout() bytes. The ready flag is set last.
+ */
+static void build_tables(char *base, const std::vector<Word>& words, uint64_t dict_hash) {
+    TableHeader header{};
+    memcpy(header.magic, TABLES_MAGIC, sizeof(header.magic));
+    header.version = TABLES_VERSION;
+    header.dict_hash = dict_hash;
+    header.word_count = static_cast<uint32_t>(words.size());
+    header.pattern_count = PATTERN_COUNT;
+    table_layout(header.word_count, header);
+
+    memcpy(base + header.words_offset, words.data(), words.size() * LEN);
+    build_opening(words, reinterpret_cast<uint32_t*>(base + header.opening_offset));
+
+    // one bit per word in the position and letter count sets
+    auto *position_sets = reinterpret_cast<uint64_t*>(base + header.position_offset);
+    auto *count_sets = reinterpret_cast<uint64_t*>(base + header.count_offset);
+    for (size_t index = 0; index < words.size(); index++) {
+        uint64_t bit = uint64_t{1} << (index % 64);
+        std::array<int, ALPHABET> copies{};
+        for (int i = 0; i < LEN; i++) {
+            int c = words[index][i] - 'a';
+            position_sets[(i * ALPHABET + c) * header.bitset_words + index / 64] |= bit;
+            copies[c]++;
+            count_sets[(c * LEN + copies[c] - 1) * header.bitset_words + index / 64] |= bit;
+        }
+    }
+
+    header.checksum = fnv1a(base + sizeof(TableHeader), header.total_size - sizeof(TableHeader));
+    memcpy(base, &header, sizeof(TableHeader));
+    __atomic_store_n(&reinterpret_cast<TableHeader*>(base)->ready, 1, __ATOMIC_RELEASE);
+}
+
+static void view_tables(const TableHeader *header, SolverTables& tables) {
+    const char *base = reinterpret_cast<const char*>(header);
+    tables.header = header;
+    tables.words = reinterpret_cast<const Word*>(base + header->words_offset);
+    tables.opening = reinterpret_cast<const uint32_t*>(base + header->opening_offset);
+    tables.position_sets = reinterpret_cast<const uint64_t*>(base + header->position_offset);
+    tables.count_sets = reinterpret_cast<const uint64_t*>(base + header->count_offset);
+    tables.bitset_words = header->bitset_words;
+    tables.word_count = header->word_count;
+}
+
+static bool valid_tables(const TableHeader *header, uint64_t size, uint64_t dict_hash) {
+    TableHeader layout{};
+    return memcmp(header->magic, TABLES_MAGIC, sizeof(header->magic)) == 0
+           && header->version == TABLES_VERSION
+           && header->dict_hash == dict_hash
+           && header->pattern_count == PATTERN_COUNT
+           && header->total_size == size
+           && table_layout(header->word_count, layout) == size
+           && header->words_offset == layout.words_offset
+           && header->opening_offset == layout.opening_offset
+           && header->bitset_words == layout.bitset_words
+           && header->position_offset == layout.position_offset
+           && header->count_offset == layout.count_offset
+           && header->checksum == fnv1a(reinterpret_cast<const char*>(header) + sizeof(TableHeader),
+                                        size - sizeof(TableHeader));
+}
+
+/**
+ * Check the payload of a segment against the word list this client loaded. The checksum is not
+ * keyed, so a corrupt or foreign segment could match it; the opening table indexes the word list
+ * and must stay inside it.
+ */
+static bool valid_payload(const TableHeader *header, const std::vector<Word>& words) {
+    const char *base = reinterpret_cast<const char*>(header);
+    const auto *opening = reinterpret_cast<const uint32_t*>(base + header->opening_offset);
+    return header->word_count == words.size()
+           && memcmp(base + header->words_offset, words.data(), words.size() * LEN) == 0
+           && std::all_of(opening, opening + PATTERN_COUNT, [&](uint32_t index) {
+                  return index < header->word_count || index == NO_GUESS;
+              });
+}
+
+/**
+ * Map an existing segment read-only, waiting for a concurrent builder to finish.
+ * @param fd the shared-memory descriptor.
+ * @param words the word list in use.
+ * @param dict_hash hash of the word list in use.
+ * @param stale output parameter, set if the segment is complete but built for other tables.
+ * @return the mapped tables, or nullptr on error or if the payload does not match the word list.
+ */
+static const TableHeader* map_segment(int fd, const std::vector<Word>& words, uint64_t dict_hash, bool& stale) {
+    using clock = std::chrono::steady_clock;
+    auto deadline = clock::now() + std::chrono::milliseconds(BUILD_WAIT_MS);
+
+    // the builder sizes the segment right after creating it
+    struct stat st;
+    while (true) {
+        if (fstat(fd, &st) < 0) {
+            return nullptr;
+        }
+        if (st.st_size >= static_cast<off_t>(sizeof(TableHeader))) {
+            break;
+        }
+        if (clock::now() > deadline) {
+            return nullptr;
+        }
+        usleep(10000);
+    }
+
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+    const auto *header = static_cast<const TableHeader*>(base);
+    while (__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE) != 1) {
+        if (clock::now() > deadline) {
+            munmap(base, st.st_size);
+            return nullptr;
+        }
+        usleep(10000);
+    }
+    if (!valid_tables(header, st.st_size, dict_hash)) {
+        stale = true;
+        munmap(base, st.st_size);
+        return nullptr;
+    }
+    if (!valid_payload(header, words)) {
+        // claims our word list but does not hold it: do not trust shared memory, keep a private copy
+        munmap(base, st.st_size);
+        return nullptr;
+    }
+    return header;
+}
+
+void load_tables(const std::vector<Word>& words, SolverTables& tables) {
+    uint64_t dict_hash = fnv1a(words.data(), words.size() * LEN);
+    dict_hash = fnv1a(FIRST_GUESS, LEN, dict_hash);
+    TableHeader layout{};
+    uint64_t size = table_layout(static_cast<uint32_t>(words.size()), layout);
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+        // map the tables another client already built
+        int fd = shm_open(TABLES_SHM_NAME, O_RDONLY, 0);
+        if (fd >= 0) {
+            bool stale = false;
+            const TableHeader *header = map_segment(fd, words, dict_hash, stale);
+            close(fd);
+            if (header) {
+                view_tables(header, tables);
+                return;
+            }
+            // either a different version or a builder that died, replace it
+            shm_unlink(TABLES_SHM_NAME);
+            if (!stale) {
+                break;
+            }
+        }
+
+        // build the tables once for every client; O_EXCL picks a single builder
+        fd = shm_open(TABLES_SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0) {
+            if (errno == EEXIST) {
+                continue;
+            }
+            break;
+        }
+        void *base = MAP_FAILED;
+        if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+            base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (base == MAP_FAILED) {
+            shm_unlink(TABLES_SHM_NAME);
+            break;
+        }
+        build_tables(static_cast<char*>(base), words, dict_hash);
+        munmap(base, size);
+        // the next attempt maps the finished segment read-only
+    }
+
+    // shared memory is not usable, keep a private copy
+    static std::vector<uint64_t> private_copy;
+    private_copy.assign((size + 7) / 8, 0);
+    char *base = reinterpret_cast<char*>(private_copy.data());
+    build_tables(base, words, dict_hash);
+    view_tables(reinterpret_cast<const TableHeader*>(base), tables);
+}
@@ -0,0 +1,79 @@
+#ifndef WORDLE_TABLES_H
+#define WORDLE_TABLES_H
+
+#define TABLES_SHM_NAME "/wordle-solver-tables"
+#define TABLES_MAGIC "WRDLTBL"
+#define TABLES_VERSION 3
+#define PATTERN_COUNT 243           // 3^LEN possible mark patterns
+#define NO_GUESS UINT32_MAX
+#define BUILD_WAIT_MS 30000         // how long to wait for another client that is building the tables
+
+/**
+ * Layout of the shared solver tables. The header is followed by the payload arrays,
+ * each starting at the recorded byte offset from the beginning of the segment.
+ */
+struct TableHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t ready;                 // set last by the builder, readers wait until it is 1
+    uint64_t dict_hash;             // hash of the word list and the first guess the tables were built for
+    uint64_t checksum;              // hash of every byte after the header
+    uint64_t total_size;
+    uint32_t word_count;
+    uint32_t pattern_count;
+    uint64_t words_offset;          // word_count words of LEN letters
+    uint64_t opening_offset;        // pattern_count word indices, the best guess after FIRST_GUESS
+    uint64_t bitset_words;          // 64-bit words in one bitset over the dictionary
+    uint64_t position_offset;       // LEN * 26 bitsets, words with letter c at position i
+    uint64_t count_offset;          // 26 * LEN bitsets, words with at least k copies of letter c
+};
+
+/**
+ * Read-only view of the solver tables, either mapped from shared memory or built privately.
+ */
+struct SolverTables {
+    const TableHeader *header = nullptr;
+    const Word *words = nullptr;
+    const uint32_t *opening = nullptr;
+    const uint64_t *position_sets = nullptr;
+    const uint64_t *count_sets = nullptr;
+    uint32_t word_count = 0;
+    size_t bitset_words = 0;
+};
+
+/**
+ * Map the solver tables for the given word list. The first client builds them into a POSIX
+ * shared-memory segment; later clients map the segment read-only after checking its version,
+ * word list, and checksum. A stale segment is replaced, and the tables are built privately
+ * if shared memory is unavailable.
+ * @param words all words read from the word list file.
+ * @param tables output parameter for the table view.
+ */
+void load_tables(const std::vector<Word>& words, SolverTables& tables);
+
+/**
+ * Bitset of the words that have letter c at the given position.
+ */
+inline const uint64_t* position_set(const SolverTables& tables, int pos, char c) {
+    return tables.position_sets + (pos * ALPHABET + (c - 'a')) * tables.bitset_words;
+}
+
+/**
+ * Bitset of the words that contain at least `count` copies of letter c, for 1 <= count <= LEN.
+ */
+inline const uint64_t* count_set(const SolverTables& tables, char c, int count) {
+    return tables.count_sets + ((c - 'a') * LEN + count - 1) * tables.bitset_words;
+}
+
+/**
+ * Compute the marks the server gives to a guess for the given answer, encoded in base 3
+ * with position 0 as the least significant digit.
+ */
+uint32_t feedback(const Word& guess, const Word& answer);
+
+/**
+ * Encode the marks returned by the server as a pattern index.
+ */
+uint32_t marks_pattern(const std::array<int, LEN>& marks);
+
+#endif